@@ -0,0 +1,84 @@
+//
+//  a2_internal.h
+//  ECSE427-Assignment2
+//
+//  Internals shared by the files of the store library: a2_lib.c (tables, pods, reads and writes), a2_persist.c
+//  (the write-ahead log and snapshot files) and a2_lz.c (the value codec). Programs using the store only include
+//  a2_lib.h.
+//
+
+#ifndef a2_internal_h
+#define a2_internal_h
+
+#include "a2_lib.h"
+
+// Where each region of one table of the store lives in this process, resolved from its header when it is mapped.
+// A store is a single table until kv_store_grow() adds the next generation.
+typedef struct kvLayout {
+    uint32_t generation;
+    char *base;                                         // the mapped table, starting with its kvStore header
+    int *readCursors;                                   // int[pods], where this process's next read of each pod starts
+    struct kvLayout *older;                             // the table this process mapped before this one
+    int pods;
+    int slotsPerPod;
+    int keyBytes;
+    int indexBuckets;
+    int hashFunction;
+    uint64_t hashSeed;
+    int evictionPolicy;
+    int placement;
+    int compressAbove;
+    int orderedIndex;
+    size_t keyStride;
+    size_t arenaSize;
+    size_t totalSize;
+    kvPodMeta *podMeta;
+    short *indexHeads;
+    short *slotNext;
+    short *slotPrev;
+    short *slotBuckets;
+    unsigned char *slotPrints;
+    char *keys;
+    uint32_t *valueOffsets;
+    uint32_t *slotExpiry;
+    uint32_t *slotAccess;
+    short *skipHeads;
+    short *skipNext;
+    short *skipPrev;
+    uint64_t *slotVersions;
+    uint64_t *dropVersions;
+    char *arena;
+} kvLayout;
+
+
+// The mapping of the store's root table, and the table the calling thread is working on (see a2_lib.c)
+extern char *kvStoreInfoAddr;
+extern __thread kvLayout *layout;
+
+// a2_lib.c
+unsigned long key_hash(const char *str);
+void pod_read_lock(unsigned long podNum);
+void pod_unlock(unsigned long podNum);
+int pod_moved(unsigned long podNum);
+unsigned long pod_place(unsigned long hash, char *key);
+int pod_insert(unsigned long podNum, unsigned long hash, char *key, char *value, uint32_t expiry, uint64_t version);
+uint32_t pod_serialize(unsigned long podNum, char **payload, size_t *payloadBytes);
+int store_pin(void);
+void store_unpin(int *pinned);
+int store_finish_grow(void);
+int store_write(char *key, char *value, uint32_t expiry);
+
+// a2_persist.c. walFd is -1 unless the store is durable.
+extern int walFd;
+uint32_t crc32_update(uint32_t crc, const void *data, size_t length);
+int wal_attach(int recover);
+size_t wal_encode(char **buffer, size_t used, size_t *capacity, char *key, char *value, uint32_t expiry);
+uint64_t wal_append(const char *buffer, size_t length);
+int wal_commit(uint64_t lsn);
+uint64_t wal_log(char *key, char *value, uint32_t expiry);
+
+// a2_lz.c
+size_t lz_compress(const unsigned char *in, size_t length, unsigned char *out, size_t capacity);
+long lz_decompress(const unsigned char *in, size_t length, char *out, size_t capacity);
+
+#endif /* a2_internal_h */
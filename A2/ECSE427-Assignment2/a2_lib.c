@@ -6,237 +6,2953 @@
 //  Copyright © 2018 Shao-Wei Liang. All rights reserved.
 //
 
-#include "a2_lib.h"
+#define _GNU_SOURCE
+#include "a2_internal.h"
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/file.h>
+#include <signal.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
-sem_t *db;
-sem_t *mutex;
 char *kvStoreInfoAddr;
+static char storeName[PATH_MAX];
+static int storeMapFlags;
+
+// Each thread works on one table at a time: the current one, or the previous one while the store is growing and
+// the key's pod was not carried over yet. Tables stay mapped until kv_delete_db(), so a thread that has not
+// noticed a grow yet never touches unmapped memory, and an old table's memory is only given back once no
+// operation that may still use it is under way (see store_pin()).
+__thread kvLayout *layout;
+static __thread kvLayout *currentTable;
+static __thread kvLayout *previousTable;                // NULL unless a grow is under way
+static __thread uint32_t threadEpoch;                   // root epoch the two tables above were resolved for
+static __thread int userSlot = -1;                      // this thread's kvStore.users slot, tried first
+static __thread int userDepth;                          // nested store_pin() calls
+static pid_t userPid;                                   // getpid(), reset in forked children
+static int userThreads;                                 // threads of this process that took a user slot
+static kvLayout *tables;                                // every table this process mapped, newest first
+static pthread_mutex_t tablesLock = PTHREAD_MUTEX_INITIALIZER;
+static int readMode = KV_READ_OPTIMISTIC;
+static int lockSpins;                                   // trylock attempts before sleeping, 0 on one CPU
+static int lookupMode = KV_LOOKUP_INDEX;
+
+// wyhash building blocks: a 64x64->128 bit multiply folded back to 64 bits, and unaligned little-endian reads.
+static const uint64_t wySecret[4] = { 0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL, 0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL };
+
+static uint64_t wy_mix(uint64_t a, uint64_t b) {
+    __uint128_t product = (__uint128_t) a * b;
+    return (uint64_t) product ^ (uint64_t) (product >> 64);
+}
+
+static uint64_t wy_read8(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t wy_read4(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Word-at-a-time hash in the style of wyhash: keys up to 16 bytes are read as (possibly overlapping) words,
+// longer ones are folded 16 bytes at a time.
+static uint64_t wy_hash(const unsigned char *p, size_t length, uint64_t seed) {
+    uint64_t a, b;
+    
+    seed ^= wy_mix(seed ^ wySecret[0], wySecret[1]);
+    if (length <= 16) {
+        if (length >= 4) {
+            a = (wy_read4(p) << 32) | wy_read4(p + ((length >> 3) << 2));
+            b = (wy_read4(p + length - 4) << 32) | wy_read4(p + length - 4 - ((length >> 3) << 2));
+        } else if (length > 0) {
+            a = ((uint64_t) p[0] << 16) | ((uint64_t) p[length >> 1] << 8) | p[length - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = length;
+        while (i > 16) {
+            seed = wy_mix(wy_read8(p) ^ wySecret[1], wy_read8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = wy_read8(p + i - 16);
+        b = wy_read8(p + i - 8);
+    }
+    return wy_mix(wySecret[1] ^ length, wy_mix(a ^ wySecret[1], b ^ seed));
+}
+
+// Full hash of a key with the store's hash function: the low bits choose the pod and the remaining bits the index
+// chain within it. Only the first keyBytes bytes of a key count.
+unsigned long key_hash(const char *str) {
+    if (layout->hashFunction == KV_HASH_WY) {
+        return wy_hash((const unsigned char *) str, strnlen(str, layout->keyBytes), layout->hashSeed);
+    }
+    
+    unsigned long hash = 5381 + layout->hashSeed;
+    int c;
+    for (int i = 0; i < layout->keyBytes && (c = *str++); i++) {
+        hash = ((hash << 5) + hash) + c;
+    }
+    return hash;
+}
+
+static int hash_bucket(unsigned long hash) {
+    return (hash / layout->pods) % layout->indexBuckets;
+}
+
+static int key_bucket(const char *key) {
+    return hash_bucket(key_hash(key));
+}
+
+// 1-byte fingerprint; 0 is reserved for empty slots. djb2's high bits barely change between keys that
+// differ only in their last few characters, so the hash is mixed with a multiplicative step first (harmless for
+// the word-at-a-time hash).
+static unsigned char hash_fingerprint(unsigned long hash) {
+    unsigned char print = (unsigned char) ((hash * 0x9E3779B97F4A7C15ULL) >> 56);
+    return print ? print : 1;
+}
+
+static unsigned char key_fingerprint(const char *key) {
+    return hash_fingerprint(key_hash(key));
+}
+
+// Both go unused in the -DKV_GLOBAL_LOCK baseline, whose semaphore neither spins nor repairs pods
+static void pod_recover(unsigned long podNum) __attribute__((unused));
+
+static __attribute__((unused)) void cpu_relax(void) {
+#if defined(__x86_64__)
+    _mm_pause();
+#else
+    sched_yield();
+#endif
+}
+
+#ifdef KV_GLOBAL_LOCK
+// The baseline bench_pod_locks compares against: built with -DKV_GLOBAL_LOCK, every operation takes the original
+// store-wide named semaphore instead of its pod's lock. Nothing repairs the store if a holder dies.
+#define kvGlobalSemName "260606721_a2_db"
+static sem_t *globalSem = SEM_FAILED;
+#endif
+
+// Takes the pod lock, spinning briefly (with growing pauses) before sleeping in the kernel since pod critical
+// sections are a few hundred nanoseconds. If the previous owner died holding it, the pod is checked and repaired
+// before the lock is marked consistent again.
+static void pod_lock(unsigned long podNum) {
+#ifdef KV_GLOBAL_LOCK
+    (void) podNum;
+    while (sem_wait(globalSem) < 0 && errno == EINTR) {
+    }
+#else
+    pthread_mutex_t *lock = &layout->podMeta[podNum].lock;
+    int result = EBUSY;
+    
+    for (int spin = 0; spin < lockSpins && result == EBUSY; spin++) {
+        result = pthread_mutex_trylock(lock);
+        for (int pause = 0; result == EBUSY && pause < (1 << (spin < 6 ? spin : 6)); pause++) {
+            cpu_relax();
+        }
+    }
+    if (result == EBUSY) {
+        result = pthread_mutex_lock(lock);
+    }
+    if (result == EOWNERDEAD) {
+        pod_recover(podNum);
+        pthread_mutex_consistent(lock);
+    }
+#endif
+}
+
+// Readers and writers take the same exclusive lock: most reads are optimistic (see KV_READ_OPTIMISTIC) and only
+// fall back to it under contention, so a reader-writer lock, which cannot be made robust, buys little.
+void pod_read_lock(unsigned long podNum) {
+    pod_lock(podNum);
+}
+
+static void pod_write_lock(unsigned long podNum) {
+    pod_lock(podNum);
+}
+
+void pod_unlock(unsigned long podNum) {
+#ifdef KV_GLOBAL_LOCK
+    (void) podNum;
+    sem_post(globalSem);
+#else
+    pthread_mutex_unlock(&layout->podMeta[podNum].lock);
+#endif
+}
+
+static long futex(unsigned int *word, int op, unsigned int value, const struct timespec *timeout) {
+    return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+// Stores a new even sequence number and wakes any kv_store_watch() callers sleeping on it. The sequentially
+// consistent store orders it before the watcher count is read, pairing with the increment in kv_store_watch(),
+// so either the watcher sees the new number or the writer sees the watcher. With nobody watching there is no
+// system call.
+static void pod_seq_publish(unsigned long podNum, unsigned int value) {
+    __atomic_store_n(&layout->podMeta[podNum].seq, value, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&layout->podMeta[podNum].watchers, __ATOMIC_SEQ_CST) > 0) {
+        futex(&layout->podMeta[podNum].seq, FUTEX_WAKE, INT_MAX, NULL);
+    }
+}
+
+// Writers bracket every modification of a pod with two increments of its sequence counter (odd = in progress).
+// A write that changes a slot records it in writingSlot first, so pod_recover() knows which one may be half
+// written; the end of the write clears it. Must be called with the pod write lock held.
+static void pod_seq_begin(unsigned long podNum) {
+    unsigned int *seq = &layout->podMeta[podNum].seq;
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void pod_seq_end(unsigned long podNum) {
+    unsigned int *seq = &layout->podMeta[podNum].seq;
+    layout->podMeta[podNum].writingSlot = noSlot;
+    pod_seq_publish(podNum, *seq + 1);
+}
+
+// Returns the sequence number to validate an optimistic read against, waiting a little while a writer is active.
+// The result stays odd if the writer does not finish (it may have died mid-write), which fails validation and
+// sends the reader to the lock, whose owner-death handling repairs the pod.
+static unsigned int pod_seq_read_begin(unsigned long podNum) {
+    unsigned int *seq = &layout->podMeta[podNum].seq;
+    unsigned int start;
+    for (int attempt = 0; ((start = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1) && attempt < kvSeqMaxRetries; attempt++) {
+        sched_yield();
+    }
+    return start;
+}
+
+// Returns 1 if nothing was written to the pod since pod_seq_read_begin() returned start.
+static int pod_seq_read_valid(unsigned long podNum, unsigned int start) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (start & 1) == 0 && __atomic_load_n(&layout->podMeta[podNum].seq, __ATOMIC_RELAXED) == start;
+}
+
+// Write versions count every write to the store, in the root table so they keep growing across grows. A writer
+// draws its version inside the pod's odd sequence section, so a reader that took the current version and then
+// finds the pod's counter even knows every write with a version up to its own is complete.
+static uint64_t version_next(void) {
+    return __atomic_add_fetch(&((kvStore *)kvStoreInfoAddr)->writeVersion, 1, __ATOMIC_SEQ_CST);
+}
+
+static uint64_t version_now(void) {
+    return __atomic_load_n(&((kvStore *)kvStoreInfoAddr)->writeVersion, __ATOMIC_SEQ_CST);
+}
+
+// Keys and value offsets are kept in separate arrays, so key comparisons stream through nothing but keys.
+static char *slot_addr(unsigned long podNum, int slot) {
+    return layout->keys + (layout->slotsPerPod * podNum + slot) * layout->keyStride;
+}
+
+// The arena offset of a slot's value chunk.
+static uint32_t *slot_value_offset(unsigned long podNum, int slot) {
+    return &layout->valueOffsets[layout->slotsPerPod * podNum + slot];
+}
+
+static kvValue *arena_value(uint32_t offset) {
+    return (kvValue *) (layout->arena + offset);
+}
+
+static size_t class_size(int sizeClass) {
+    static const size_t largeClasses[] = { 768, 1024, 1536, 2048, 3072, 4096 };
+    return sizeClass < 32 ? 16 * (size_t) (sizeClass + 1) : largeClasses[sizeClass - 32];
+}
+
+// Smallest size class holding a value of length bytes (plus its header and NUL).
+static int size_class(size_t length) {
+    size_t chunkBytes = sizeof(kvValue) + length + 1;
+    if (chunkBytes <= 512) {
+        return (chunkBytes + 15) / 16 - 1;
+    }
+    for (int c = 32; c < valueClasses; c++) {
+        if (class_size(c) >= chunkBytes) {
+            return c;
+        }
+    }
+    return -1;
+}
+
+// Takes a chunk of sizeClass from the pod's free list, or carves a new one off the top of the arena. Once the
+// arena is used up, a free chunk of the pod's next larger class that has one is handed out instead (it keeps its
+// class, so freeing it puts it back on its own list). Returns its offset, or 0 when neither is left. Must be
+// called with the pod write lock held.
+static uint32_t arena_alloc(unsigned long podNum, int sizeClass) {
+    uint32_t *freeChunks = layout->podMeta[podNum].freeChunks;
+    
+    if (freeChunks[sizeClass] == 0) {
+        uint64_t top = __atomic_load_n(&((kvStore *)layout->base)->arenaTop, __ATOMIC_RELAXED);
+        while (top + class_size(sizeClass) <= layout->arenaSize) {
+            if (__atomic_compare_exchange_n(&((kvStore *)layout->base)->arenaTop, &top, top + class_size(sizeClass),
+                                            0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                arena_value((uint32_t) top)->sizeClass = sizeClass;
+                return (uint32_t) top;
+            }
+        }
+        while (sizeClass < valueClasses && freeChunks[sizeClass] == 0) {
+            sizeClass++;
+        }
+        if (sizeClass == valueClasses) {
+            return 0;
+        }
+    }
+    
+    // A free chunk keeps the offset of the next free chunk where its data would be
+    uint32_t offset = freeChunks[sizeClass];
+    memcpy(&freeChunks[sizeClass], arena_value(offset)->data, sizeof(uint32_t));
+    return offset;
+}
+
+// Returns a chunk to the pod's free list. Must be called with the pod write lock held, inside pod_seq_begin/end
+// since it overwrites the value that optimistic readers may still be copying.
+static void arena_free(unsigned long podNum, uint32_t offset) {
+    kvValue *chunk = arena_value(offset);
+    
+    memcpy(chunk->data, &layout->podMeta[podNum].freeChunks[chunk->sizeClass], sizeof(uint32_t));
+    layout->podMeta[podNum].freeChunks[chunk->sizeClass] = offset;
+}
+
+// Returns a pointer to the value a slot points at and its length. Values stored as they are are returned inside
+// the mapped store; compressed ones are expanded into scratch (maxValueSize + 1 bytes), which is returned. Optimistic
+// readers may see a slot mid-update, so an offset, length or compressed block that cannot be right sets *torn
+// instead of being followed; the caller retries.
+static const char *slot_value_view(unsigned long podNum, int slot, char *scratch, size_t *length, int *torn) {
+    uint32_t offset = __atomic_load_n(slot_value_offset(podNum, slot), __ATOMIC_RELAXED);
+    
+    if (offset < arenaStart || offset > layout->arenaSize - sizeof(kvValue)) {
+        *torn = 1;
+        return NULL;
+    }
+    kvValue *chunk = arena_value(offset);
+    *length = __atomic_load_n(&chunk->length, __ATOMIC_RELAXED);
+    if (*length > maxValueSize || offset + sizeof(kvValue) + *length >= layout->arenaSize) {
+        *torn = 1;
+        return NULL;
+    }
+    size_t rawLength = __atomic_load_n(&chunk->rawLength, __ATOMIC_RELAXED);
+    if (rawLength == 0) {
+        return chunk->data;
+    }
+    if (scratch == NULL
+        || lz_decompress((const unsigned char *) chunk->data, *length, scratch, maxValueSize) != (long) rawLength) {
+        *torn = 1;
+        return NULL;
+    }
+    scratch[rawLength] = '\0';
+    *length = rawLength;
+    return scratch;
+}
+
+// Whether a slot's value is stored compressed, i.e. reading it in place needs a scratch buffer.
+static int slot_compressed(unsigned long podNum, int slot) {
+    uint32_t offset = __atomic_load_n(slot_value_offset(podNum, slot), __ATOMIC_RELAXED);
+    
+    return offset >= arenaStart && offset <= layout->arenaSize - sizeof(kvValue)
+        && __atomic_load_n(&arena_value(offset)->rawLength, __ATOMIC_RELAXED) != 0;
+}
+
+// Copies the value a slot points at into a new string.
+static char *slot_value_dup(unsigned long podNum, int slot, int *torn) {
+    char scratch[maxValueSize + 1];
+    size_t length;
+    const char *value = slot_value_view(podNum, slot, scratch, &length, torn);
+    
+    return value == NULL ? NULL : strndup(value, length);
+}
+
+// Wall clock seconds, the unit of slot expiry times. The coarse clock is enough and costs no more than a load.
+static uint32_t clock_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    return (uint32_t) now.tv_sec;
+}
+
+// A slot written with a TTL stops matching once its expiry time has passed, whether or not it was reclaimed yet.
+static int slot_expired(unsigned long podNum, int slot) {
+    uint32_t expiry = __atomic_load_n(&layout->slotExpiry[podNum * layout->slotsPerPod + slot], __ATOMIC_RELAXED);
+    return expiry != 0 && expiry <= clock_seconds();
+}
+
+// Keys are stored NUL padded to keySize, so a stored key matches only if it is exactly key (and has not expired).
+static int slot_matches(unsigned long podNum, int slot, char *key) {
+    return strncmp(slot_addr(podNum, slot), key, layout->keyBytes) == 0 && !slot_expired(podNum, slot);
+}
+
+// Removes slot from its index chain. Must be called with the pod write lock held.
+static void index_unlink(unsigned long podNum, int slot) {
+    short bucket = layout->slotBuckets[podNum * layout->slotsPerPod + slot];
+    short next = layout->slotNext[podNum * layout->slotsPerPod + slot];
+    short prev = layout->slotPrev[podNum * layout->slotsPerPod + slot];
+    
+    if (bucket == noSlot) {
+        return;
+    }
+    if (prev == noSlot) {
+        layout->indexHeads[podNum * layout->indexBuckets + bucket] = next;
+    } else {
+        layout->slotNext[podNum * layout->slotsPerPod + prev] = next;
+    }
+    if (next != noSlot) {
+        layout->slotPrev[podNum * layout->slotsPerPod + next] = prev;
+    }
+    layout->slotBuckets[podNum * layout->slotsPerPod + slot] = noSlot;
+}
+
+// Pushes slot onto the front of the chain for bucket. Must be called with the pod write lock held.
+static void index_link(unsigned long podNum, int slot, int bucket) {
+    short head = layout->indexHeads[podNum * layout->indexBuckets + bucket];
+    
+    layout->slotBuckets[podNum * layout->slotsPerPod + slot] = bucket;
+    layout->slotPrev[podNum * layout->slotsPerPod + slot] = noSlot;
+    layout->slotNext[podNum * layout->slotsPerPod + slot] = head;
+    if (head != noSlot) {
+        layout->slotPrev[podNum * layout->slotsPerPod + head] = slot;
+    }
+    layout->indexHeads[podNum * layout->indexBuckets + bucket] = slot;
+}
+
+// The ordered index keeps a pod's live slots in a skiplist sorted by key, then slot number, so the entries of one
+// key stay together in the order they sit in the pod. A slot's height only depends on its number, so nothing but
+// the links is stored; the bottom level is also linked backwards, so the three in four slots that are only on it
+// are unlinked without a search.
+static short *skip_next(unsigned long podNum, int slot) {
+    return &layout->skipNext[((size_t) podNum * layout->slotsPerPod + slot) * kvSkipLevels];
+}
+
+// The link pointing at the slot after slot on a level: the pod's head of that level for noSlot.
+static short *skip_link_at(unsigned long podNum, int slot, int level) {
+    return slot == noSlot ? &layout->skipHeads[podNum * kvSkipLevels + level] : &skip_next(podNum, slot)[level];
+}
+
+static int skip_height(int slot) {
+    uint64_t bits = wy_mix(slot, wySecret[3]);
+    int height = 1;
+    
+    while (height < kvSkipLevels && (bits & 3) == 0) {
+        height++;
+        bits >>= 2;
+    }
+    return height;
+}
+
+// Orders the entry in slot against key, held by slot keySlot: by key bytes, then slot number. Keys are zero padded
+// to keyStride, so comparing them a word at a time, most significant byte first, orders them as strncmp() would.
+static int skip_compare(unsigned long podNum, int slot, const char *key, int keySlot) {
+    const char *slotKey = slot_addr(podNum, slot);
+    
+    for (size_t i = 0; i < layout->keyStride; i += 8) {
+        uint64_t left = wy_read8((const unsigned char *) slotKey + i);
+        uint64_t right = wy_read8((const unsigned char *) key + i);
+        if (left != right) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            left = __builtin_bswap64(left);
+            right = __builtin_bswap64(right);
+#endif
+            return left < right ? -1 : 1;
+        }
+    }
+    return slot - keySlot;
+}
+
+// Fills prev with the last slot ordered before (key, keySlot) on each level, noSlot where that is the head. An
+// optimistic reader may follow links being rewritten, so walks are bounded and a link that cannot be right
+// returns -1.
+static int skip_find(unsigned long podNum, const char *key, int keySlot, short *prev) {
+    char padded[layout->keyStride];
+    int slot = noSlot;
+    int steps = 0;
+    
+    memset(padded, 0, layout->keyStride);
+    strncpy(padded, key, layout->keyBytes);
+    key = padded;
+    for (int level = kvSkipLevels - 1; level >= 0; level--) {
+        short next = *skip_link_at(podNum, slot, level);
+        while (next != noSlot) {
+            if (next < 0 || next >= layout->slotsPerPod || steps++ > layout->slotsPerPod * kvSkipLevels) {
+                return -1;
+            }
+            if (skip_compare(podNum, next, key, keySlot) >= 0) {
+                break;
+            }
+            slot = next;
+            next = skip_next(podNum, slot)[level];
+        }
+        prev[level] = slot;
+    }
+    return 0;
+}
+
+// Adds a slot that was just written to the ordered index. Must be called with the pod write lock held, inside
+// pod_seq_begin/end.
+static void skip_link(unsigned long podNum, int slot) {
+    short prev[kvSkipLevels];
+    
+    skip_find(podNum, slot_addr(podNum, slot), slot, prev);
+    for (int level = 0, height = skip_height(slot); level < height; level++) {
+        short *link = skip_link_at(podNum, prev[level], level);
+        skip_next(podNum, slot)[level] = *link;
+        *link = slot;
+    }
+    short next = skip_next(podNum, slot)[0];
+    layout->skipPrev[podNum * layout->slotsPerPod + slot] = prev[0];
+    if (next != noSlot) {
+        layout->skipPrev[podNum * layout->slotsPerPod + next] = slot;
+    }
+}
+
+// Takes a live slot out of the ordered index, before its key is overwritten or cleared. Must be called with the
+// pod write lock held, inside pod_seq_begin/end.
+static void skip_unlink(unsigned long podNum, int slot) {
+    short prev[kvSkipLevels];
+    int height = skip_height(slot);
+    short next = skip_next(podNum, slot)[0];
+    
+    prev[0] = layout->skipPrev[podNum * layout->slotsPerPod + slot];
+    if (height > 1) {
+        skip_find(podNum, slot_addr(podNum, slot), slot, prev);
+    }
+    for (int level = 0; level < height; level++) {
+        short *link = skip_link_at(podNum, prev[level], level);
+        if (*link == slot) {
+            *link = skip_next(podNum, slot)[level];
+        }
+    }
+    if (next != noSlot) {
+        layout->skipPrev[podNum * layout->slotsPerPod + next] = prev[0];
+    }
+}
+
+// Called with the pod lock just inherited from a process that died holding it. If it died inside a write (odd
+// sequence number) the slot being written (writingSlot), the index and the free lists may be half updated: the
+// slot is dropped, the pod's free chunks are forgotten (leaking them is safe, reusing a half-linked one is not) and the
+// index and fingerprints are rebuilt from the slots that still point at a sane chunk.
+static void pod_recover(unsigned long podNum) {
+    unsigned int seq = layout->podMeta[podNum].seq;
+    uint64_t arenaTop = __atomic_load_n(&((kvStore *)layout->base)->arenaTop, __ATOMIC_RELAXED);
+    
+    if (layout->podMeta[podNum].nextSlot < 0 || layout->podMeta[podNum].nextSlot >= layout->slotsPerPod) {
+        layout->podMeta[podNum].nextSlot = 0;
+    }
+    int writing = layout->podMeta[podNum].writingSlot;
+    layout->podMeta[podNum].writingSlot = noSlot;
+    if ((seq & 1) == 0) {
+        return;
+    }
+    
+    if (writing >= 0 && writing < layout->slotsPerPod) {
+        memset(slot_addr(podNum, writing), 0, layout->keyStride);
+        *slot_value_offset(podNum, writing) = 0;
+        layout->slotExpiry[podNum * layout->slotsPerPod + writing] = 0;
+        layout->slotVersions[podNum * layout->slotsPerPod + writing] = 0;
+    }
+    layout->podMeta[podNum].ttlEntries = 0;
+    layout->podMeta[podNum].live = 0;
+    memset(layout->podMeta[podNum].freeChunks, 0, sizeof(layout->podMeta[podNum].freeChunks));
+    // Which key lost its entry is not known, so no snapshot taken before now can trust the pod
+    uint64_t dropVersion = version_next();
+    for (int bucket = 0; bucket < layout->indexBuckets; bucket++) {
+        layout->indexHeads[podNum * layout->indexBuckets + bucket] = noSlot;
+        layout->dropVersions[podNum * layout->indexBuckets + bucket] = dropVersion;
+    }
+    for (int level = 0; layout->orderedIndex && level < kvSkipLevels; level++) {
+        layout->skipHeads[podNum * kvSkipLevels + level] = noSlot;
+    }
+    for (int slot = 0; slot < layout->slotsPerPod; slot++) {
+        uint32_t *offset = slot_value_offset(podNum, slot);
+        layout->slotBuckets[podNum * layout->slotsPerPod + slot] = noSlot;
+        layout->slotNext[podNum * layout->slotsPerPod + slot] = noSlot;
+        layout->slotPrev[podNum * layout->slotsPerPod + slot] = noSlot;
+        layout->slotPrints[podNum * layout->slotsPerPod + slot] = 0;
+        if (*offset == 0) {
+            continue;
+        }
+        kvValue *chunk = arena_value(*offset);
+        if (*offset < arenaStart || *offset + sizeof(kvValue) > arenaTop || chunk->sizeClass >= valueClasses
+            || *offset + class_size(chunk->sizeClass) > arenaTop || chunk->length + sizeof(kvValue) >= class_size(chunk->sizeClass)
+            || chunk->rawLength > maxValueSize) {
+            memset(slot_addr(podNum, slot), 0, layout->keyStride);
+            *offset = 0;
+            layout->slotExpiry[podNum * layout->slotsPerPod + slot] = 0;
+            layout->slotVersions[podNum * layout->slotsPerPod + slot] = 0;
+            continue;
+        }
+        layout->podMeta[podNum].ttlEntries += layout->slotExpiry[podNum * layout->slotsPerPod + slot] != 0;
+        layout->podMeta[podNum].live++;
+        unsigned long keyHash = key_hash(slot_addr(podNum, slot));
+        index_link(podNum, slot, hash_bucket(keyHash));
+        if (layout->orderedIndex) {
+            skip_link(podNum, slot);
+        }
+        layout->slotPrints[podNum * layout->slotsPerPod + slot] = hash_fingerprint(keyHash);
+    }
+    pod_seq_publish(podNum, seq + 1);
+}
+
+// Each lookup strategy collects up to maxSlots slots holding key, ordered by distance from slot start (the pod's
+// read cursor) so reads keep their round-robin order whichever one is selected with kv_store_lookup_mode().
+
+// Walks the key's index chain. Chain walks are bounded by layout->slotsPerPod so an optimistic reader cannot loop on a
+// chain being rewritten.
+static int index_find_all(unsigned long podNum, char *key, int start, int *slots, int maxSlots) {
+    int slotsCount = 0;
+    short slot = layout->indexHeads[podNum * layout->indexBuckets + key_bucket(key)];
+    
+    for (int i = 0; i < layout->slotsPerPod && slot != noSlot; i++) {
+        int distance = (slot - start + layout->slotsPerPod) % layout->slotsPerPod;
+        if ((slotsCount < maxSlots || distance < (slots[maxSlots - 1] - start + layout->slotsPerPod) % layout->slotsPerPod)
+            && slot_matches(podNum, slot, key)) {
+            // Insertion sort on the distance from the cursor, chains are short.
+            int j = slotsCount < maxSlots ? slotsCount++ : maxSlots - 1;
+            while (j > 0 && (slots[j - 1] - start + layout->slotsPerPod) % layout->slotsPerPod > distance) {
+                slots[j] = slots[j - 1];
+                j--;
+            }
+            slots[j] = slot;
+        }
+        slot = layout->slotNext[podNum * layout->slotsPerPod + slot];
+    }
+    return slotsCount;
+}
+
+// The original lookup: compare every slot of the pod in cursor order.
+static int scan_find_all(unsigned long podNum, char *key, int start, int *slots, int maxSlots) {
+    int slotsCount = 0;
+    
+    for (int i = 0; i < layout->slotsPerPod && slotsCount < maxSlots; i++) {
+        int slot = (start + i) % layout->slotsPerPod;
+        if (slot_matches(podNum, slot, key)) {
+            slots[slotsCount++] = slot;
+        }
+    }
+    return slotsCount;
+}
+
+// Fingerprint scans set one bit in mask for every slot whose fingerprint equals print. The geometry check in
+// layout_plan() keeps slotsPerPod a multiple of 64.
+#define fingerprintWords (layout->slotsPerPod / 64)
+
+static void fingerprint_scan_scalar(const unsigned char *prints, unsigned char print, uint64_t *mask) {
+    for (int w = 0; w < fingerprintWords; w++) {
+        uint64_t bits = 0;
+        for (int i = 0; i < 64; i++) {
+            bits |= (uint64_t) (prints[w * 64 + i] == print) << i;
+        }
+        mask[w] = bits;
+    }
+}
+
+#if defined(__x86_64__)
+static void fingerprint_scan_sse2(const unsigned char *prints, unsigned char print, uint64_t *mask) {
+    __m128i needle = _mm_set1_epi8((char) print);
+    for (int w = 0; w < fingerprintWords; w++) {
+        uint64_t bits = 0;
+        for (int i = 0; i < 64; i += 16) {
+            __m128i chunk = _mm_loadu_si128((const __m128i *) (prints + w * 64 + i));
+            bits |= (uint64_t) (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle)) << i;
+        }
+        mask[w] = bits;
+    }
+}
+
+__attribute__((target("avx2")))
+static void fingerprint_scan_avx2(const unsigned char *prints, unsigned char print, uint64_t *mask) {
+    __m256i needle = _mm256_set1_epi8((char) print);
+    for (int w = 0; w < fingerprintWords; w++) {
+        __m256i low = _mm256_loadu_si256((const __m256i *) (prints + w * 64));
+        __m256i high = _mm256_loadu_si256((const __m256i *) (prints + w * 64 + 32));
+        mask[w] = (uint64_t) (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(low, needle))
+                | (uint64_t) (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(high, needle)) << 32;
+    }
+}
+#endif
+
+static void (*fingerprint_scan)(const unsigned char *, unsigned char, uint64_t *) = fingerprint_scan_scalar;
+
+// Picks the widest fingerprint scan the CPU supports. Called once from kv_store_create.
+static void fingerprint_scan_select(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    fingerprint_scan = __builtin_cpu_supports("avx2") ? fingerprint_scan_avx2 : fingerprint_scan_sse2;
+#else
+    fingerprint_scan = fingerprint_scan_scalar;
+#endif
+}
+
+// Only slots whose 1-byte fingerprint matches get a full key comparison.
+static int fingerprint_find_all(unsigned long podNum, char *key, int start, int *slots, int maxSlots) {
+    uint64_t mask[fingerprintWords];
+    int slotsCount = 0;
+    
+    fingerprint_scan(&layout->slotPrints[podNum * layout->slotsPerPod], key_fingerprint(key), mask);
+    
+    // Visit the candidates in cursor order: [start, layout->slotsPerPod) first, then [0, start).
+    for (int pass = 0; pass < 2; pass++) {
+        int from = pass == 0 ? start : 0;
+        int to = pass == 0 ? layout->slotsPerPod : start;
+        for (int w = from / 64; w * 64 < to; w++) {
+            uint64_t bits = mask[w];
+            if (w == from / 64) {
+                bits &= ~0ULL << (from % 64);
+            }
+            while (bits) {
+                int slot = w * 64 + __builtin_ctzll(bits);
+                bits &= bits - 1;
+                if (slot >= to) {
+                    break;
+                }
+                if (slot_matches(podNum, slot, key)) {
+                    slots[slotsCount++] = slot;
+                    if (slotsCount == maxSlots) {
+                        return slotsCount;
+                    }
+                }
+            }
+        }
+    }
+    return slotsCount;
+}
+
+// Records a read of slot for the eviction policy: CLOCK sets the reference bit, LRU stamps the slot with the pod's
+// write count. Either way the shared line is only written when the value actually changes, so repeated reads
+// between writes stay read-only.
+static void slot_touch(unsigned long podNum, int slot) {
+    uint32_t *access = &layout->slotAccess[podNum * layout->slotsPerPod + slot];
+    uint32_t stamp = layout->evictionPolicy == KV_EVICT_CLOCK ? 1 : __atomic_load_n(&layout->podMeta[podNum].seq, __ATOMIC_RELAXED) >> 1;
+    
+    if (__atomic_load_n(access, __ATOMIC_RELAXED) != stamp) {
+        __atomic_store_n(access, stamp, __ATOMIC_RELAXED);
+    }
+}
+
+static int pod_find_all(unsigned long podNum, char *key, int start, int *slots, int maxSlots) {
+    int slotsCount;
+    switch (lookupMode) {
+        case KV_LOOKUP_SCAN:
+            slotsCount = scan_find_all(podNum, key, start, slots, maxSlots);
+            break;
+        case KV_LOOKUP_FINGERPRINT:
+            slotsCount = fingerprint_find_all(podNum, key, start, slots, maxSlots);
+            break;
+        default:
+            slotsCount = index_find_all(podNum, key, start, slots, maxSlots);
+            break;
+    }
+    for (int i = 0; layout->evictionPolicy != KV_EVICT_FIFO && i < slotsCount; i++) {
+        slot_touch(podNum, slots[i]);
+    }
+    return slotsCount;
+}
+
+// Returns the first slot at or after start holding key, or -1 if there is none.
+static int pod_find(unsigned long podNum, char *key, int start) {
+    int slot;
+    return pod_find_all(podNum, key, start, &slot, 1) == 1 ? slot : -1;
+}
+
+int kv_store_lookup_mode(int mode) {
+    if (mode != KV_LOOKUP_INDEX && mode != KV_LOOKUP_FINGERPRINT && mode != KV_LOOKUP_SCAN) {
+        return -1;
+    }
+    lookupMode = mode;
+    return 0;
+}
+
+int kv_store_read_mode(int mode) {
+    if (mode != KV_READ_LOCKED && mode != KV_READ_OPTIMISTIC) {
+        return -1;
+    }
+    readMode = mode;
+    return 0;
+}
+
+// Rounds size up to a whole number of 64-byte cache lines.
+static uint64_t line_align(uint64_t size) {
+    return (size + 63) & ~(uint64_t) 63;
+}
+
+// Lays the regions of a store with the given geometry out one after the other in the header.
+static int layout_plan(kvStore *header, const kvOptions *options) {
+    uint64_t pods = options->pods;
+    uint64_t slots = pods * options->slotsPerPod;
+    uint64_t offset = line_align(sizeof(kvStore));
+    
+    if (options->pods < 1 || options->slotsPerPod < 64 || options->slotsPerPod % 64 != 0 || options->slotsPerPod > 32704
+        || options->keyBytes < 2 || options->valueBytes < 1
+        || (options->hashFunction != KV_HASH_WY && options->hashFunction != KV_HASH_DJB2)
+        || options->evictionPolicy < KV_EVICT_FIFO || options->evictionPolicy > KV_EVICT_LRU
+        || (options->placement != KV_PLACE_TWO_CHOICE && options->placement != KV_PLACE_ONE)
+        || options->compressAbove < 0 || (options->orderedIndex != 0 && options->orderedIndex != 1)) {
+        fprintf(stderr, "Invalid store geometry\n");
+        return -1;
+    }
+    
+    header->magic = kvStoreMagic;
+    header->layoutVersion = kvLayoutVersion;
+    header->geometry.pods = options->pods;
+    header->geometry.slotsPerPod = options->slotsPerPod;
+    header->geometry.keyBytes = options->keyBytes;
+    header->geometry.valueBytes = options->valueBytes;
+    header->hashFunction = options->hashFunction;
+    header->hashSeed = options->hashSeed;
+    header->evictionPolicy = options->evictionPolicy;
+    header->placement = options->placement;
+    header->compressAbove = options->compressAbove;
+    header->orderedIndex = options->orderedIndex;
+    header->keyStride = (options->keyBytes + 7) & ~7;
+    
+    // Value offsets are 32 bits, so the arena is capped just under 4 GB
+    header->arenaSize = slots * (options->valueBytes + 16) * 2;
+    if (header->arenaSize > UINT32_MAX - maxChunkSize) {
+        header->arenaSize = UINT32_MAX - maxChunkSize;
+    }
+    
+    header->podMetaOffset = offset;
+    offset += line_align(pods * sizeof(kvPodMeta));
+    header->indexHeadsOffset = offset;
+    offset += line_align(slots * sizeof(short));
+    header->slotNextOffset = offset;
+    offset += line_align(slots * sizeof(short));
+    header->slotPrevOffset = offset;
+    offset += line_align(slots * sizeof(short));
+    header->slotBucketsOffset = offset;
+    offset += line_align(slots * sizeof(short));
+    header->slotPrintsOffset = offset;
+    offset += line_align(slots);
+    header->keysOffset = offset;
+    offset += line_align(slots * header->keyStride);
+    header->valueOffsetsOffset = offset;
+    offset += line_align(slots * sizeof(uint32_t));
+    header->slotExpiryOffset = offset;
+    offset += line_align(slots * sizeof(uint32_t));
+    header->slotAccessOffset = offset;
+    offset += line_align(slots * sizeof(uint32_t));
+    if (options->orderedIndex) {
+        header->skipHeadsOffset = offset;
+        offset += line_align(pods * kvSkipLevels * sizeof(short));
+        header->skipNextOffset = offset;
+        offset += line_align(slots * kvSkipLevels * sizeof(short));
+        header->skipPrevOffset = offset;
+        offset += line_align(slots * sizeof(short));
+    }
+    header->slotVersionsOffset = offset;
+    offset += line_align(slots * sizeof(uint64_t));
+    header->dropVersionsOffset = offset;
+    offset += line_align(slots * sizeof(uint64_t));
+    header->arenaOffset = offset;
+    header->totalSize = offset + header->arenaSize;
+    
+    if (options->walPath != NULL) {
+        strncpy(header->walPath, options->walPath, sizeof(header->walPath) - 1);
+    }
+    return 0;
+}
+
+// Points table at the regions recorded in the header of the table mapped at base.
+static void layout_resolve(kvLayout *table, char *base) {
+    kvStore *header = (kvStore *)base;
+    
+    table->base = base;
+    table->pods = header->geometry.pods;
+    table->slotsPerPod = header->geometry.slotsPerPod;
+    table->keyBytes = header->geometry.keyBytes;
+    table->indexBuckets = header->geometry.slotsPerPod;
+    table->hashFunction = header->hashFunction;
+    table->hashSeed = header->hashSeed;
+    table->evictionPolicy = header->evictionPolicy;
+    table->placement = header->placement;
+    table->compressAbove = header->compressAbove;
+    table->orderedIndex = header->orderedIndex;
+    table->keyStride = header->keyStride;
+    table->arenaSize = header->arenaSize;
+    table->totalSize = header->totalSize;
+    table->podMeta = (kvPodMeta *) (base + header->podMetaOffset);
+    
+    // Read cursors are private to the process, so reads never write to the shared segment
+    free(table->readCursors);
+    table->readCursors = calloc(table->pods, sizeof(int));
+    table->indexHeads = (short *) (base + header->indexHeadsOffset);
+    table->slotNext = (short *) (base + header->slotNextOffset);
+    table->slotPrev = (short *) (base + header->slotPrevOffset);
+    table->slotBuckets = (short *) (base + header->slotBucketsOffset);
+    table->slotPrints = (unsigned char *) (base + header->slotPrintsOffset);
+    table->keys = base + header->keysOffset;
+    table->valueOffsets = (uint32_t *) (base + header->valueOffsetsOffset);
+    table->slotExpiry = (uint32_t *) (base + header->slotExpiryOffset);
+    table->slotAccess = (uint32_t *) (base + header->slotAccessOffset);
+    table->skipHeads = (short *) (base + header->skipHeadsOffset);
+    table->skipNext = (short *) (base + header->skipNextOffset);
+    table->skipPrev = (short *) (base + header->skipPrevOffset);
+    table->slotVersions = (uint64_t *) (base + header->slotVersionsOffset);
+    table->dropVersions = (uint64_t *) (base + header->dropVersionsOffset);
+    table->arena = base + header->arenaOffset;
+}
+
+// Sets up the book keeping of a freshly created table (layout). The shared memory object starts out zero filled.
+// The caller marks the table initialized once it is ready to be used.
+static void store_init(void) {
+    kvStore *kvStoreInfo = (kvStore *)layout->base;
+    int slots = layout->pods * layout->slotsPerPod;
+    
+    // Robust mutexes hand EOWNERDEAD to the next locker when a process dies holding one, instead of hanging
+    pthread_mutexattr_t mutexAttr;
+    pthread_mutexattr_init(&mutexAttr);
+    pthread_mutexattr_setpshared(&mutexAttr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mutexAttr, PTHREAD_MUTEX_ROBUST);
+    for (int i = 0; i < layout->pods; i++) {
+        pthread_mutex_init(&layout->podMeta[i].lock, &mutexAttr);
+        layout->podMeta[i].writingSlot = noSlot;
+    }
+    pthread_mutex_init(&kvStoreInfo->walLock, &mutexAttr);
+    pthread_mutex_init(&kvStoreInfo->growLock, &mutexAttr);
+    pthread_mutexattr_destroy(&mutexAttr);
+    
+    pthread_condattr_t condAttr;
+    pthread_condattr_init(&condAttr);
+    pthread_condattr_setpshared(&condAttr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&kvStoreInfo->walFlushedCond, &condAttr);
+    pthread_condattr_destroy(&condAttr);
+    
+    for (int j = 0; j < slots; j++) {
+        layout->indexHeads[j] = noSlot;
+        layout->slotNext[j] = noSlot;
+        layout->slotPrev[j] = noSlot;
+        layout->slotBuckets[j] = noSlot;
+    }
+    for (int j = 0; layout->orderedIndex && j < layout->pods * kvSkipLevels; j++) {
+        layout->skipHeads[j] = noSlot;
+    }
+    kvStoreInfo->arenaTop = arenaStart;
+}
+
+int kv_store_create(char *name) {
+    return kv_store_create_with(name, NULL);
+}
+
+// Opens (creating if needed, unless KV_MAP_EXISTING) the file behind the store: a POSIX shared memory object, or a
+// file on hugetlbfs.
+static int store_open(char *name, const kvOptions *options) {
+    int flags = (options->mapFlags & KV_MAP_EXISTING) ? O_RDWR : O_CREAT | O_RDWR;
+    if (options->mapFlags & KV_MAP_HUGETLB) {
+        const char *dir = options->hugetlbDir != NULL ? options->hugetlbDir : "/dev/hugepages";
+        snprintf(storeName, sizeof(storeName), "%s/%s", dir, name[0] == '/' ? name + 1 : name);
+        return open(storeName, flags, S_IRWXU);
+    }
+    strncpy(storeName, name, sizeof(storeName) - 1);
+    return shm_open(name, flags, S_IRWXU);
+}
+
+// Generation 0 of a store is the object it was created as; every kv_store_grow() adds "<name>.<generation>".
+static void table_name(char *name, size_t size, uint32_t generation) {
+    if (generation == 0) {
+        snprintf(name, size, "%s", storeName);
+    } else {
+        snprintf(name, size, "%s.%u", storeName, generation);
+    }
+}
+
+static int table_open(uint32_t generation, int flags) {
+    char name[PATH_MAX + 16];
+    table_name(name, sizeof(name), generation);
+    return (storeMapFlags & KV_MAP_HUGETLB) ? open(name, flags, S_IRWXU) : shm_open(name, flags, S_IRWXU);
+}
+
+static void table_unlink(uint32_t generation) {
+    char name[PATH_MAX + 16];
+    table_name(name, sizeof(name), generation);
+    if (storeMapFlags & KV_MAP_HUGETLB) {
+        unlink(name);
+    } else {
+        shm_unlink(name);
+    }
+}
+
+// Maps the store according to the KV_MAP_* flags. For transparent huge pages the mapping has to start on a huge
+// page boundary, so an aligned range is reserved first and the store is mapped over it.
+static char *store_map(int fd, size_t size, int mapFlags) {
+    int flags = MAP_SHARED | ((mapFlags & KV_MAP_POPULATE) ? MAP_POPULATE : 0);
+    char *addr;
+    
+    if (mapFlags & KV_MAP_THP) {
+        size_t hugePage = 2 * 1024 * 1024;
+        char *reserved = mmap(NULL, size + hugePage, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (reserved == MAP_FAILED) {
+            return MAP_FAILED;
+        }
+        char *aligned = (char *) (((uintptr_t) reserved + hugePage - 1) & ~(uintptr_t) (hugePage - 1));
+        if (aligned > reserved) {
+            munmap(reserved, aligned - reserved);
+        }
+        munmap(aligned + size, reserved + hugePage - aligned);
+        addr = mmap(aligned, size, PROT_READ | PROT_WRITE, flags | MAP_FIXED, fd, 0);
+        if (addr != MAP_FAILED && madvise(addr, size, MADV_HUGEPAGE) < 0) {
+            perror("madvise(MADV_HUGEPAGE) failed");
+        }
+    } else {
+        addr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    }
+    
+    // MLOCK_ONFAULT pins pages as they are first touched instead of faulting the sparse arena in right away
+    if (addr != MAP_FAILED && (mapFlags & KV_MAP_MLOCK) && mlock2(addr, size, MLOCK_ONFAULT) < 0) {
+        perror("mlock failed");
+    }
+    return addr;
+}
+
+// Adds a table mapped at base to this process's list. Called with tablesLock held.
+static kvLayout *table_add(uint32_t generation, char *base) {
+    kvLayout *table = calloc(1, sizeof(kvLayout));
+    
+    table->generation = generation;
+    layout_resolve(table, base);
+    table->older = tables;
+    tables = table;
+    return table;
+}
+
+// Returns this process's mapping of a table, mapping it first if needed. Returns NULL if the table is gone (it
+// was released after a grow this process has not caught up with yet). Called with tablesLock held.
+static kvLayout *table_attach(uint32_t generation) {
+    kvStore header;
+    struct stat info;
+    
+    for (kvLayout *table = tables; table != NULL; table = table->older) {
+        if (table->generation == generation) {
+            return table;
+        }
+    }
+    
+    int fd = table_open(generation, O_RDWR);
+    if (fd < 0) {
+        return NULL;
+    }
+    fstat(fd, &info);
+    if (info.st_size < (off_t) sizeof(kvStore) || pread(fd, &header, sizeof(kvStore), 0) != sizeof(kvStore)
+        || header.magic != kvStoreMagic || header.initialized == 0 || header.totalSize > (uint64_t) info.st_size) {
+        close(fd);
+        return NULL;
+    }
+    char *base = store_map(fd, header.totalSize, storeMapFlags);
+    close(fd);
+    return base == MAP_FAILED ? NULL : table_add(generation, base);
+}
+
+// Resolves this thread's tables for a root epoch: the newest generation and, while entries are still being moved
+// into it, the one before. On failure the thread keeps its old tables and tries again on its next operation.
+static void store_refresh(uint32_t epoch) {
+    pthread_mutex_lock(&tablesLock);
+    kvLayout *current = table_attach((epoch + 1) / 2);
+    kvLayout *previous = (epoch & 1) ? table_attach(epoch / 2) : NULL;
+    pthread_mutex_unlock(&tablesLock);
+    
+    if (current != NULL && (previous != NULL || (epoch & 1) == 0)) {
+        currentTable = current;
+        previousTable = previous;
+        threadEpoch = epoch;
+    }
+}
+
+// Starts every operation: notices a grow begun or finished by any process and points this thread at the current
+// table. Costs one load of the root header when nothing changed.
+static void store_enter(void) {
+    uint32_t epoch = __atomic_load_n(&((kvStore *)kvStoreInfoAddr)->epoch, __ATOMIC_ACQUIRE);
+    
+    if (epoch != threadEpoch || currentTable == NULL) {
+        store_refresh(epoch);
+    }
+    layout = currentTable;
+}
+
+// Starts an operation that may touch the store's tables: takes a user slot naming the oldest generation the
+// thread may use from now on, then resolves its tables like store_enter(). The slot is taken before the epoch is
+// read again, so a grow that moves the epoch on either sees the slot or is seen by store_enter(). Meant to
+// initialize a variable with cleanup(store_unpin), which frees the slot whichever way the function returns.
+int store_pin(void) {
+    kvStore *root = (kvStore *)kvStoreInfoAddr;
+    
+    if (userDepth++ > 0) {
+        store_enter();
+        return 0;
+    }
+    // Threads start at different slots, and keep trying the one they had last first
+    if (userSlot < 0) {
+        userSlot = (userPid + __atomic_fetch_add(&userThreads, 1, __ATOMIC_RELAXED)) % kvMaxUsers;
+    }
+    uint32_t epoch = __atomic_load_n(&root->epoch, __ATOMIC_ACQUIRE);
+    uint64_t user = (uint64_t) userPid << 32 | (epoch / 2 + 1);
+    for (int slot = userSlot, tries = 1; ; slot = (slot + 1) % kvMaxUsers, tries++) {
+        uint64_t expected = 0;
+        if (__atomic_compare_exchange_n(&root->users[slot].user, &expected, user, 0, __ATOMIC_SEQ_CST,
+                                        __ATOMIC_RELAXED)) {
+            userSlot = slot;
+            break;
+        }
+        if (tries % kvMaxUsers == 0) {
+            sched_yield();
+        }
+    }
+    store_enter();
+    return 0;
+}
+
+void store_unpin(int *pinned) {
+    (void) pinned;
+    if (--userDepth == 0) {
+        __atomic_store_n(&((kvStore *)kvStoreInfoAddr)->users[userSlot].user, 0, __ATOMIC_RELEASE);
+    }
+}
+
+// Narrows a pinned operation's slot to the table it is working on (layout), once it is done with any other, so
+// a long wait there does not hold up the release of an older table.
+static void store_pin_table(void) {
+    if (userDepth == 1) {
+        uint64_t user = (uint64_t) userPid << 32 | (layout->generation + 1);
+        __atomic_store_n(&((kvStore *)kvStoreInfoAddr)->users[userSlot].user, user, __ATOMIC_RELEASE);
+    }
+}
+
+// Waits until no operation that may touch generation (or an older table) is under way, except this thread's own.
+static void store_quiesce(uint32_t generation) {
+    kvStore *root = (kvStore *)kvStoreInfoAddr;
+    struct timespec pause = { 0, 100 * 1000 };
+    
+    // Pairs with the slot store_pin() takes before reading the epoch
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (int slot = 0; slot < kvMaxUsers; slot++) {
+        uint64_t user;
+        while ((user = __atomic_load_n(&root->users[slot].user, __ATOMIC_ACQUIRE)) != 0
+               && (uint32_t) user <= generation + 1 && (slot != userSlot || userDepth == 0)) {
+            // An operation of a process that died never ends
+            if (kill((pid_t) (user >> 32), 0) < 0 && errno == ESRCH) {
+                __atomic_compare_exchange_n(&root->users[slot].user, &user, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+                break;
+            }
+            nanosleep(&pause, NULL);
+        }
+    }
+}
+
+static void user_forked(void) {
+    userPid = getpid();
+}
+
+int kv_store_create_with(char *name, const kvOptions *options) {
+    
+    kvOptions defaults = { numberOfPods, podSize, keySize, valueSize, 0, NULL, NULL, KV_HASH_WY, 0, KV_EVICT_FIFO,
+                           KV_PLACE_TWO_CHOICE, 0, 0 };
+    kvStore plan;
+    struct stat info;
+    
+    if (options == NULL) {
+        options = &defaults;
+    }
+    
+    fingerprint_scan_select();
+    lockSpins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? kvLockSpins : 0;
+    if (userPid == 0) {
+        pthread_atfork(NULL, NULL, user_forked);
+    }
+    userPid = getpid();
+#ifdef KV_GLOBAL_LOCK
+    globalSem = sem_open(kvGlobalSemName, O_CREAT, S_IRWXU, 1);
+    if (globalSem == SEM_FAILED) {
+        perror("db semaphore failed.");
+        return -1;
+    }
+#endif
+    
+    // Creates and opens a new, or opens an existing, POSIX shared memory object (or hugetlbfs file).
+    storeMapFlags = options->mapFlags;
+    int fd = store_open(name, options);
+    if (fd < 0) {
+        perror("Error... Opening shm\n");
+        return -1;
+    }
+    
+    // The object stays flock()ed until the store is created, initialized and rebuilt from its log, so processes
+    // attaching meanwhile wait. The kernel drops the lock of a process that dies, and the store is only marked
+    // initialized at the very end, so one whose creator died is found uninitialized and created again.
+    flock(fd, LOCK_EX);
+    fstat(fd, &info);
+    if (info.st_size >= (off_t) sizeof(kvStore) && !(options->mapFlags & KV_MAP_EXISTING)
+        && pread(fd, &plan, sizeof(kvStore), 0) == sizeof(kvStore) && plan.magic == kvStoreMagic
+        && plan.initialized == 0) {
+        fprintf(stderr, "%s: its creator died before it was ready, creating it again\n", name);
+        if (ftruncate(fd, 0) < 0) {
+            perror("Could not reset store");
+            close(fd);
+            return -1;
+        }
+        info.st_size = 0;
+    }
+    
+    if (info.st_size == 0 && (options->mapFlags & KV_MAP_EXISTING)) {
+        fprintf(stderr, "%s is not a key-value store yet\n", name);
+        close(fd);
+        return -1;
+    } else if (info.st_size == 0) {
+        // A new store: size the shared memory object from the requested geometry (book keeping PLUS all slots
+        // PLUS the value arena). The arena is only reserved: tmpfs does not back the pages until a value is
+        // first written there. hugetlbfs files must be a whole number of huge pages.
+        memset(&plan, 0, sizeof(kvStore));
+        size_t fileSize = 0;
+        if (layout_plan(&plan, options) == 0) {
+            fileSize = plan.totalSize;
+            if (options->mapFlags & KV_MAP_HUGETLB) {
+                fileSize = (fileSize + info.st_blksize - 1) / info.st_blksize * info.st_blksize;
+            }
+        }
+        if (fileSize == 0 || ftruncate(fd, fileSize) < 0) {
+            close(fd);
+            table_unlink(0);
+            return -1;
+        }
+    } else {
+        // An existing store: its header says how big it is and how it is laid out
+        if (info.st_size < (off_t) sizeof(kvStore) || pread(fd, &plan, sizeof(kvStore), 0) != sizeof(kvStore)
+            || plan.magic != kvStoreMagic || plan.layoutVersion != kvLayoutVersion
+            || plan.totalSize > (uint64_t) info.st_size || plan.initialized == 0) {
+            fprintf(stderr, "%s is not a key-value store of layout version %d\n", name, kvLayoutVersion);
+            close(fd);
+            return -1;
+        }
+    }
+    
+    kvStoreInfoAddr = store_map(fd, plan.totalSize, options->mapFlags);
+    if (kvStoreInfoAddr == MAP_FAILED) {
+        perror("Error... Mapping shm");
+        kvStoreInfoAddr = NULL;
+        close(fd);
+        return -1;
+    }
+    
+    // Initialized the KV-store info (Book Keeping)
+    kvStore* kvStoreInfo = (kvStore *)kvStoreInfoAddr;
+    int recover = 0;
+    pthread_mutex_lock(&tablesLock);
+    layout = currentTable = table_add(0, kvStoreInfoAddr);
+    pthread_mutex_unlock(&tablesLock);
+    previousTable = NULL;
+    threadEpoch = 0;
+    if (kvStoreInfo->initialized == 0) {
+        *kvStoreInfo = plan;
+        layout_resolve(layout, kvStoreInfoAddr);
+        store_init();
+        recover = 1;
+    }
+    
+    // A durable store that was just created is rebuilt from its log before anyone else can attach to it
+    int result = 0;
+    if (kvStoreInfo->walPath[0] != '\0') {
+        result = wal_attach(recover);
+    }
+    if (result == 0) {
+        kvStoreInfo->initialized = 1;
+    }
+    // The mapping keeps the open file alive, so closing it alone would not drop the lock
+    flock(fd, LOCK_UN);
+    close(fd);
+    
+    // A store that was grown is used through its newest table
+    store_enter();
+    return result;
+}
+
+// Reads this process's /proc/self/smaps entry for the store mapping: the kernel page size and how much of it is
+// mapped with huge pages (PMD mappings for THP; hugetlbfs pages show up in KernelPageSize directly).
+static void mapping_pages(size_t *pageSize, size_t *hugeMappedBytes) {
+    FILE *smaps = fopen("/proc/self/smaps", "r");
+    char line[256];
+    int inStore = 0;
+    
+    *pageSize = sysconf(_SC_PAGESIZE);
+    *hugeMappedBytes = 0;
+    if (smaps == NULL) {
+        return;
+    }
+    while (fgets(line, sizeof(line), smaps) != NULL) {
+        unsigned long start, end, kilobytes;
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            inStore = start <= (unsigned long) layout->base && (unsigned long) layout->base < end;
+        } else if (inStore && sscanf(line, "KernelPageSize: %lu kB", &kilobytes) == 1) {
+            *pageSize = kilobytes * 1024;
+        } else if (inStore && (sscanf(line, "ShmemPmdMapped: %lu kB", &kilobytes) == 1
+                               || sscanf(line, "FilePmdMapped: %lu kB", &kilobytes) == 1)) {
+            *hugeMappedBytes += kilobytes * 1024;
+        }
+    }
+    fclose(smaps);
+    
+    if (*pageSize > (size_t) sysconf(_SC_PAGESIZE)) {
+        *hugeMappedBytes = layout->totalSize;
+    } else if (*hugeMappedBytes > 0) {
+        *pageSize = 2 * 1024 * 1024;
+    }
+}
+
+int kv_store_stats(kvStats *stats) {
+    if (kvStoreInfoAddr == NULL) {
+        return -1;
+    }
+    int pinned __attribute__((cleanup(store_unpin))) = store_pin();
+    mapping_pages(&stats->pageSize, &stats->hugeMappedBytes);
+    stats->totalSize = layout->totalSize;
+    stats->arenaUsed = __atomic_load_n(&((kvStore *)layout->base)->arenaTop, __ATOMIC_RELAXED) - arenaStart;
+    stats->mapFlags = storeMapFlags;
+    stats->pods = layout->pods;
+    stats->slotsPerPod = layout->slotsPerPod;
+    stats->hashFunction = layout->hashFunction;
+    stats->hashSeed = layout->hashSeed;
+    stats->placement = layout->placement;
+    stats->compressAbove = layout->compressAbove;
+    stats->orderedIndex = layout->orderedIndex;
+    stats->generation = layout->generation;
+    stats->growing = previousTable != NULL;
+    return 0;
+}
+
+int kv_store_pod_stats(int podNum, kvPodStats *stats) {
+    if (kvStoreInfoAddr == NULL) {
+        return -1;
+    }
+    int pinned __attribute__((cleanup(store_unpin))) = store_pin();
+    if (podNum < 0 || podNum >= layout->pods) {
+        return -1;
+    }
+    memset(stats, 0, sizeof(kvPodStats));
+    
+    pod_read_lock(podNum);
+    for (int bucket = 0; bucket < layout->indexBuckets; bucket++) {
+        int length = 0;
+        for (int slot = layout->indexHeads[podNum * layout->indexBuckets + bucket]; slot != noSlot;
+             slot = layout->slotNext[podNum * layout->slotsPerPod + slot]) {
+            // A key counts once, at its first slot in the chain
+            int seen = 0;
+            for (int other = layout->indexHeads[podNum * layout->indexBuckets + bucket]; other != slot && !seen;
+                 other = layout->slotNext[podNum * layout->slotsPerPod + other]) {
+                seen = strncmp(slot_addr(podNum, slot), slot_addr(podNum, other), layout->keyBytes) == 0;
+            }
+            stats->distinctKeys += !seen;
+            length++;
+        }
+        stats->live += length;
+        stats->chains += length > 0;
+        if (length > stats->longestChain) {
+            stats->longestChain = length;
+        }
+    }
+    pod_unlock(podNum);
+    return 0;
+}
+
+// The pod a key hashes to. Without a store attached, the one a store made by kv_store_create() would use.
+unsigned long hash(const char *str) {
+    if (kvStoreInfoAddr == NULL) {
+        return wy_hash((const unsigned char *) str, strnlen(str, keySize), 0) % numberOfPods;
+    }
+    store_enter();
+    return key_hash(str) % layout->pods;
+}
+
+// A slot that can be reused without evicting anything: never written, reclaimed, or expired.
+static int slot_free(unsigned long podNum, int slot) {
+    return *slot_value_offset(podNum, slot) == 0 || slot_expired(podNum, slot);
+}
+
+// Picks the slot the next write to the pod goes to and moves the pod's hand past it. Must be called with the pod
+// write lock held.
+//  FIFO:  the next slot in order, i.e. the oldest entry.
+//  CLOCK: second chance. The hand skips (and clears) slots whose reference bit was set by a read since it last
+//         passed, and stops at the first free or unreferenced one.
+//  LRU:   sampled approximation. Of kvEvictSamples slots from the hand onwards, the one read or written longest
+//         ago (by the pod's write count) is replaced; a free slot among them wins outright.
+static int pod_victim(unsigned long podNum) {
+    kvPodMeta *meta = &layout->podMeta[podNum];
+    uint32_t *access = &layout->slotAccess[podNum * layout->slotsPerPod];
+    int slot = meta->nextSlot;
+    
+    if (layout->evictionPolicy == KV_EVICT_CLOCK) {
+        // Two sweeps at most: the first clears every bit it passes
+        for (int i = 0; i < 2 * layout->slotsPerPod; i++) {
+            slot = (meta->nextSlot + i) % layout->slotsPerPod;
+            if (slot_free(podNum, slot) || access[slot] == 0) {
+                break;
+            }
+            __atomic_store_n(&access[slot], 0, __ATOMIC_RELAXED);
+        }
+    } else if (layout->evictionPolicy == KV_EVICT_LRU) {
+        uint32_t now = meta->seq >> 1;
+        for (int i = 0; i < kvEvictSamples; i++) {
+            int candidate = (meta->nextSlot + i) % layout->slotsPerPod;
+            if (slot_free(podNum, candidate)) {
+                slot = candidate;
+                break;
+            }
+            if (now - access[candidate] > now - access[slot]) {
+                slot = candidate;
+            }
+        }
+        // The samples not taken are aged by being passed over; they will be looked at again a lap later
+        meta->nextSlot = (meta->nextSlot + kvEvictSamples - 1) % layout->slotsPerPod;
+        return slot;
+    }
+    meta->nextSlot = slot;
+    return slot;
+}
+
+static void chunk_fill(uint32_t offset, const char *data, size_t length, uint16_t rawLength) {
+    arena_value(offset)->length = length;
+    arena_value(offset)->rawLength = rawLength;
+    memcpy(arena_value(offset)->data, data, length);
+    arena_value(offset)->data[length] = '\0';
+}
+
+// Makes room for a chunk of sizeClass once the arena is used up and the pod's free lists hold none: drops the
+// oldest entry of the pod (other than keep, the slot being written) whose chunk is at least that large, and hands
+// its chunk over. Chunks are never split or merged, so smaller entries are left alone since dropping them would
+// not help. Returns the chunk's offset, or 0 if the pod holds no such entry. Must be called with the pod write
+// lock held.
+static uint32_t pod_reclaim(unsigned long podNum, int keep, int sizeClass) {
+    for (int i = 0; i < layout->slotsPerPod; i++) {
+        int slot = (layout->podMeta[podNum].nextSlot + i) % layout->slotsPerPod;
+        uint32_t offset = *slot_value_offset(podNum, slot);
+        if (slot == keep || offset == 0 || arena_value(offset)->sizeClass < sizeClass) {
+            continue;
+        }
+        
+        uint32_t *slotExpiry = &layout->slotExpiry[podNum * layout->slotsPerPod + slot];
+        short bucket = layout->slotBuckets[podNum * layout->slotsPerPod + slot];
+        layout->podMeta[podNum].writingSlot = slot;
+        pod_seq_begin(podNum);
+        if (bucket != noSlot) {
+            __atomic_store_n(&layout->dropVersions[podNum * layout->indexBuckets + bucket], version_next(), __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&layout->slotVersions[podNum * layout->slotsPerPod + slot], 0, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        index_unlink(podNum, slot);
+        if (layout->orderedIndex) {
+            skip_unlink(podNum, slot);
+        }
+        __atomic_store_n(slot_value_offset(podNum, slot), 0, __ATOMIC_RELAXED);
+        memset(slot_addr(podNum, slot), 0, layout->keyStride);
+        layout->slotPrints[podNum * layout->slotsPerPod + slot] = 0;
+        layout->podMeta[podNum].ttlEntries -= *slotExpiry != 0;
+        *slotExpiry = 0;
+        layout->podMeta[podNum].live--;
+        pod_seq_end(podNum);
+        return offset;
+    }
+    return 0;
+}
+
+// Writes one entry into the next (oldest) slot of the pod. hash is key_hash(key); expiry is the wall clock second
+// the entry expires at, 0 for never; version is the entry's write version, 0 to draw a new one (a moved entry
+// keeps its own). Must be called with the pod write lock held.
+int pod_insert(unsigned long podNum, unsigned long hash, char *key, char *value, uint32_t expiry,
+                      uint64_t version) {
+    
+    size_t length = strlen(value);
+    int sizeClass = size_class(length);
+    if (sizeClass < 0) {
+        return -1;
+    }
+    
+    // Long values are stored compressed, but only when that gets them into a smaller chunk
+    const char *data = value;
+    size_t dataLength = length;
+    uint16_t rawLength = 0;
+    unsigned char packed[maxChunkSize];
+    if (layout->compressAbove > 0 && length > (size_t) layout->compressAbove) {
+        size_t packedLength = lz_compress((const unsigned char *) value, length, packed, length);
+        if (packedLength > 0 && size_class(packedLength) < sizeClass) {
+            data = (const char *) packed;
+            dataLength = packedLength;
+            rawLength = length;
+            sizeClass = size_class(packedLength);
+        }
+    }
+    
+    // pod_victim() returns an int which indicates the slot the next write goes to within the given pod.
+    int slot = pod_victim(podNum);
+    uint32_t *slotValue = slot_value_offset(podNum, slot);
+    uint32_t *slotExpiry = &layout->slotExpiry[podNum * layout->slotsPerPod + slot];
+    uint64_t *slotVersion = &layout->slotVersions[podNum * layout->slotsPerPod + slot];
+    short oldBucket = layout->slotBuckets[podNum * layout->slotsPerPod + slot];
+    
+    // Once the arena is used up the entry being replaced gives up its chunk if that is large enough, else older
+    // entries of the pod are dropped until one with a large enough chunk was.
+    uint32_t valueOffset = arena_alloc(podNum, sizeClass);
+    int reused = 0;
+    if (valueOffset == 0 && *slotValue != 0 && arena_value(*slotValue)->sizeClass >= sizeClass) {
+        valueOffset = *slotValue;
+        reused = 1;
+    } else if (valueOffset == 0) {
+        valueOffset = pod_reclaim(podNum, slot, sizeClass);
+        if (valueOffset == 0) {
+            return -1;
+        }
+    }
+    
+    // A new chunk is not reachable from any slot yet, so the value is copied in before the pod is marked busy.
+    if (!reused) {
+        chunk_fill(valueOffset, data, dataLength, rawLength);
+    }
+    
+    // Store the given key and value into the shared memory, replacing the slot's old entry in the index
+    layout->podMeta[podNum].writingSlot = slot;
+    pod_seq_begin(podNum);
+    uint64_t dropVersion = version_next();
+    if (version == 0) {
+        version = dropVersion;
+    }
+    if (*slotValue != 0 && oldBucket != noSlot) {
+        // Snapshots taken before this write can no longer see the entry it replaces
+        __atomic_store_n(&layout->dropVersions[podNum * layout->indexBuckets + oldBucket], dropVersion, __ATOMIC_RELAXED);
+    }
+    // The release fence keeps the cleared version ahead of the slot's new contents, which readers check it around
+    __atomic_store_n(slotVersion, 0, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    index_unlink(podNum, slot);
+    if (*slotValue != 0) {
+        if (layout->orderedIndex) {
+            skip_unlink(podNum, slot);
+        }
+        if (reused) {
+            chunk_fill(valueOffset, data, dataLength, rawLength);
+        } else {
+            arena_free(podNum, *slotValue);
+        }
+    } else {
+        layout->podMeta[podNum].live++;
+    }
+    layout->podMeta[podNum].ttlEntries += (expiry != 0) - (*slotExpiry != 0);
+    strncpy(slot_addr(podNum, slot), key, layout->keyBytes);
+    __atomic_store_n(slotExpiry, expiry, __ATOMIC_RELAXED);
+    __atomic_store_n(slotValue, valueOffset, __ATOMIC_RELAXED);
+    index_link(podNum, slot, hash_bucket(hash));
+    if (layout->orderedIndex) {
+        skip_link(podNum, slot);
+    }
+    layout->slotPrints[podNum * layout->slotsPerPod + slot] = hash_fingerprint(hash);
+    layout->slotAccess[podNum * layout->slotsPerPod + slot] = layout->evictionPolicy == KV_EVICT_LRU ? layout->podMeta[podNum].seq >> 1 : 0;
+    __atomic_store_n(slotVersion, version, __ATOMIC_RELEASE);
+    pod_seq_end(podNum);
+    
+    // Key-Value written into the pod, move the hand past the slot just written
+    layout->podMeta[podNum].nextSlot++;
+    
+    // If the current count value is greater than the pod size, we will loop back to the start of the pod
+    //  so that the next write will replace the existing (oldest) entry.
+    layout->podMeta[podNum].nextSlot = layout->podMeta[podNum].nextSlot % layout->slotsPerPod;
+    
+    return 0;
+}
+
+// Drops the pod's expired entries, returning their chunks to the pod's free lists and taking them out of the
+// index, so expired values stop taking up memory even in pods that are rarely written. The emptied slots are
+// refilled in FIFO order. Returns the number of entries dropped. Must be called with the pod write lock held.
+static int pod_expire(unsigned long podNum) {
+    uint32_t now = clock_seconds();
+    int reclaimed = 0;
+    
+    for (int slot = 0; slot < layout->slotsPerPod && layout->podMeta[podNum].ttlEntries > 0; slot++) {
+        uint32_t *slotExpiry = &layout->slotExpiry[podNum * layout->slotsPerPod + slot];
+        if (*slotExpiry == 0 || *slotExpiry > now) {
+            continue;
+        }
+        layout->podMeta[podNum].writingSlot = slot;
+        if (reclaimed++ == 0) {
+            pod_seq_begin(podNum);
+        }
+        __atomic_store_n(&layout->slotVersions[podNum * layout->slotsPerPod + slot], 0, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        index_unlink(podNum, slot);
+        if (layout->orderedIndex) {
+            skip_unlink(podNum, slot);
+        }
+        arena_free(podNum, *slot_value_offset(podNum, slot));
+        __atomic_store_n(slot_value_offset(podNum, slot), 0, __ATOMIC_RELAXED);
+        memset(slot_addr(podNum, slot), 0, layout->keyStride);
+        layout->slotPrints[podNum * layout->slotsPerPod + slot] = 0;
+        *slotExpiry = 0;
+        layout->podMeta[podNum].ttlEntries--;
+        layout->podMeta[podNum].live--;
+    }
+    if (reclaimed > 0) {
+        pod_seq_end(podNum);
+    }
+    return reclaimed;
+}
+
+// The pods a key's entries may be in, in lookup order: the pod hash() picks and, under two-choice placement, a
+// second one taken from other bits of the hash (never the same pod). Returns how many.
+static int key_pods(unsigned long hash, unsigned long *pods) {
+    pods[0] = hash % layout->pods;
+    if (layout->placement == KV_PLACE_ONE || layout->pods == 1) {
+        return 1;
+    }
+    pods[1] = (pods[0] + 1 + wy_mix(hash, wySecret[2]) % (layout->pods - 1)) % layout->pods;
+    return 2;
+}
+
+// Whether the pod holds a live entry for key. Without the pod lock this is only a hint (chain walks are bounded,
+// so it is safe); writers confirm it under the lock.
+static int pod_holds(unsigned long podNum, char *key) {
+    int slot;
+    return index_find_all(podNum, key, 0, &slot, 1) > 0;
+}
+
+// Picks the pod a write of key goes to with the write locks of both of its pods held: the one already holding the
+// key, else the one with fewer live entries. A new key placed in its second pod bumps the first pod's version
+// too, since that is the pod kv_store_watch() sleeps on for keys not stored yet.
+static unsigned long pod_choose(unsigned long first, unsigned long second, char *key) {
+    if (pod_holds(first, key)) {
+        return first;
+    }
+    if (pod_holds(second, key)) {
+        return second;
+    }
+    if (layout->podMeta[second].live < layout->podMeta[first].live) {
+        pod_seq_begin(first);
+        pod_seq_end(first);
+        return second;
+    }
+    return first;
+}
+
+// Returns the pod to write hash's key to with its write lock held. A key that is already stored stays in its pod
+// (found without a lock, confirmed under it); for a new key both candidate pods are locked, lower number first,
+// so that two writers of the same new key cannot place it in different pods.
+unsigned long pod_place(unsigned long hash, char *key) {
+    unsigned long pods[2];
+    
+    if (key_pods(hash, pods) == 1) {
+        pod_write_lock(pods[0]);
+        return pods[0];
+    }
+    for (int i = 0; i < 2; i++) {
+        if (pod_holds(pods[i], key)) {
+            pod_write_lock(pods[i]);
+            if (pod_holds(pods[i], key)) {
+                return pods[i];
+            }
+            pod_unlock(pods[i]);
+        }
+    }
+    
+#ifdef KV_GLOBAL_LOCK
+    // One lock covers every pod
+    pod_write_lock(pods[0]);
+    return pod_choose(pods[0], pods[1], key);
+#else
+    pod_write_lock(pods[0] < pods[1] ? pods[0] : pods[1]);
+    pod_write_lock(pods[0] < pods[1] ? pods[1] : pods[0]);
+    unsigned long podNum = pod_choose(pods[0], pods[1], key);
+    pod_unlock(podNum == pods[0] ? pods[1] : pods[0]);
+    return podNum;
+#endif
+}
+
+// Takes the write locks of both pods of a pair (the same pod twice under one-pod placement), lower number first
+// like pod_place().
+static void pod_pair_lock(unsigned long *pods) {
+#ifdef KV_GLOBAL_LOCK
+    pod_write_lock(pods[0]);
+#else
+    pod_write_lock(pods[0] < pods[1] ? pods[0] : pods[1]);
+    if (pods[0] != pods[1]) {
+        pod_write_lock(pods[0] < pods[1] ? pods[1] : pods[0]);
+    }
+#endif
+}
+
+static void pod_pair_unlock(unsigned long *pods) {
+    pod_unlock(pods[0]);
+#ifndef KV_GLOBAL_LOCK
+    if (pods[0] != pods[1]) {
+        pod_unlock(pods[1]);
+    }
+#endif
+}
+
+// Set once kv_store_grow() moved the pod's entries to the next table; the pod is never written again after that.
+int pod_moved(unsigned long podNum) {
+    return __atomic_load_n(&layout->podMeta[podNum].migrated, __ATOMIC_ACQUIRE);
+}
+
+// Moves the entries of pod podNum of table from into the current table (layout), oldest first so every key keeps
+// the order of its values, and marks the pod moved. The old pod stays write locked throughout, so a write to one
+// of its keys cannot reach the new table ahead of the key's older values; the new pods are locked one at a time
+// underneath it. Readers of the old pod are not disturbed, the entries are only copied. Returns -1 if an entry
+// does not fit into the current table: the pod is not marked moved then, and the next call carries on with that
+// entry, so none is copied twice.
+static int pod_migrate(kvLayout *from, unsigned long podNum) {
+    kvLayout *to = layout;
+    char key[from->keyBytes + 1];
+    int result = 0;
+    
+    layout = from;
+    pod_write_lock(podNum);
+    int moved = pod_moved(podNum);
+    int i = from->podMeta[podNum].migratedSlots;
+    for (; i < from->slotsPerPod && !moved && result == 0; i++) {
+        int slot = (from->podMeta[podNum].nextSlot + i) % from->slotsPerPod;
+        int torn = 0;
+        char *value;
+        
+        layout = from;
+        if (slot_free(podNum, slot) || (value = slot_value_dup(podNum, slot, &torn)) == NULL) {
+            continue;
+        }
+        memset(key, 0, sizeof(key));
+        memcpy(key, slot_addr(podNum, slot), from->keyBytes);
+        uint32_t expiry = from->slotExpiry[podNum * from->slotsPerPod + slot];
+        uint64_t version = from->slotVersions[podNum * from->slotsPerPod + slot];
+        
+        layout = to;
+        unsigned long keyHash = key_hash(key);
+        unsigned long newPod = pod_place(keyHash, key);
+        result = pod_insert(newPod, keyHash, key, value, expiry, version);
+        pod_unlock(newPod);
+        free(value);
+    }
+    layout = from;
+    if (result < 0) {
+        from->podMeta[podNum].migratedSlots = i - 1;
+    } else if (!moved) {
+        // Inside a write, so optimistic readers and watchers of the old pod notice
+        pod_seq_begin(podNum);
+        __atomic_store_n(&from->podMeta[podNum].migrated, 1, __ATOMIC_RELEASE);
+        pod_seq_end(podNum);
+    }
+    pod_unlock(podNum);
+    layout = to;
+    return result;
+}
+
+// Points this thread at the table holding key and returns the key's pod there, leaving key_hash(key) in *keyHash
+// unless it is NULL. The first of the key's pods that holds it wins; a key stored nowhere reads (and is watched)
+// at its first pod of the current table. While the store grows, the key's old pods that were not moved yet are
+// looked at first; a write (forWrite) moves them instead, so writes only ever go to the current table, and the
+// pod returned for a write is only a hint (see pod_place()). Returns -1 if a write could not move an old pod.
+static long key_route(char *key, unsigned long *keyHash, int forWrite) {
+    unsigned long pods[2];
+    store_enter();
+    unsigned long fullHash = key_hash(key);
+    kvLayout *from = previousTable;
+    
+    if (keyHash != NULL) {
+        *keyHash = fullHash;
+    }
+    if (from != NULL) {
+        layout = from;
+        int count = key_pods(fullHash, pods);
+        for (int i = 0; i < count; i++) {
+            if (__atomic_load_n(&from->podMeta[pods[i]].migrated, __ATOMIC_ACQUIRE)) {
+                continue;
+            }
+            if (forWrite) {
+                layout = currentTable;
+                if (pod_migrate(from, pods[i]) < 0) {
+                    return -1;
+                }
+                layout = from;
+            } else if (pod_holds(pods[i], key)) {
+                return pods[i];
+            }
+        }
+        layout = currentTable;
+    }
+    if (key_pods(fullHash, pods) == 2 && !forWrite && !pod_holds(pods[0], key) && pod_holds(pods[1], key)) {
+        return pods[1];
+    }
+    return pods[0];
+}
+
+typedef struct {
+    kvLayout *table;
+    unsigned long podNum;
+} kvPlace;
+
+// Lists the pods key's entries may be in, in the order readers try them: while the store grows its old pods that
+// were not moved yet, then its pods in the current table. Returns how many (at most 4).
+static int key_places(char *key, kvPlace *places) {
+    unsigned long pods[2];
+    int count = 0;
+    store_enter();
+    unsigned long fullHash = key_hash(key);
+    
+    if (previousTable != NULL) {
+        layout = previousTable;
+        for (int i = 0, n = key_pods(fullHash, pods); i < n; i++) {
+            if (!pod_moved(pods[i])) {
+                places[count++] = (kvPlace) { previousTable, pods[i] };
+            }
+        }
+        layout = currentTable;
+    }
+    for (int i = 0, n = key_pods(fullHash, pods); i < n; i++) {
+        places[count++] = (kvPlace) { currentTable, pods[i] };
+    }
+    return count;
+}
+
+// Grows are serialized by the root table's robust growLock. A grow that died holding it left at most a new table
+// that was never published, which the next grow discards, so there is nothing to repair.
+static void grow_lock(void) {
+    pthread_mutex_t *lock = &((kvStore *)kvStoreInfoAddr)->growLock;
+    if (pthread_mutex_lock(lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(lock);
+    }
+}
+
+static void grow_unlock(void) {
+    pthread_mutex_unlock(&((kvStore *)kvStoreInfoAddr)->growLock);
+}
+
+// Moves every pod of the previous table that was not moved yet, holding one old pod lock at a time, then retires
+// that table: the root epoch moves on so every process stops using it, and once the operations that may still be
+// using it are done its memory is given back. Also completes a grow that another process started but did not
+// finish. Returns -1, leaving the previous table in use, if a pod's entries do not fit into the current table.
+int store_finish_grow(void) {
+    kvStore *root = (kvStore *)kvStoreInfoAddr;
+    struct stat info;
+    int result = 0;
+    
+    store_pin();
+    kvLayout *from = previousTable;
+    uint32_t epoch = threadEpoch;
+    for (int podNum = 0; from != NULL && podNum < from->pods; podNum++) {
+        if (pod_migrate(from, podNum) < 0) {
+            fprintf(stderr, "Grow: the entries of pod %d do not fit into the grown table\n", podNum);
+            result = -1;
+            break;
+        }
+    }
+    store_unpin(NULL);
+    if (from == NULL || result < 0) {
+        return result;
+    }
+    
+    grow_lock();
+    if (root->epoch == epoch) {
+        __atomic_store_n(&root->epoch, epoch + 1, __ATOMIC_RELEASE);
+    }
+    grow_unlock();
+    store_quiesce(from->generation);
+    
+    // Only the header stays behind; the root table's is where every process finds the store
+    int fd = table_open(from->generation, O_RDWR);
+    if (fd >= 0) {
+        fstat(fd, &info);
+        off_t keep = (sizeof(kvStore) + info.st_blksize - 1) / info.st_blksize * info.st_blksize;
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, keep, from->totalSize - keep) < 0) {
+            perror("Could not release old table");
+        }
+        close(fd);
+    }
+    if (from->generation > 0) {
+        table_unlink(from->generation);
+    }
+    store_enter();
+    return 0;
+}
+
+int kv_store_grow(int pods, int slotsPerPod) {
+    kvStore *root = (kvStore *)kvStoreInfoAddr;
+    kvStore plan;
+    struct stat info;
+    
+    // One grow at a time: an unfinished one is completed first, whoever started it
+    for (;;) {
+        if (store_finish_grow() < 0) {
+            return -1;
+        }
+        grow_lock();
+        if ((root->epoch & 1) == 0) {
+            break;
+        }
+        grow_unlock();
+    }
+    
+    store_enter();
+    kvStore *current = (kvStore *)layout->base;
+    kvOptions options = { pods, slotsPerPod, current->geometry.keyBytes, current->geometry.valueBytes, storeMapFlags,
+                          NULL, NULL, layout->hashFunction, layout->hashSeed, layout->evictionPolicy,
+                          layout->placement, layout->compressAbove, layout->orderedIndex };
+    uint32_t generation = root->epoch / 2 + 1;
+    
+    memset(&plan, 0, sizeof(kvStore));
+    if ((uint64_t) pods * slotsPerPod < (uint64_t) layout->pods * layout->slotsPerPod || layout_plan(&plan, &options) < 0) {
+        fprintf(stderr, "A store can only grow to a valid, larger geometry\n");
+        grow_unlock();
+        return -1;
+    }
+    
+    // The new table is complete before the epoch makes it visible; anything left under its name by a grow that
+    // died before that point is discarded.
+    table_unlink(generation);
+    int fd = table_open(generation, O_CREAT | O_RDWR);
+    char *base = MAP_FAILED;
+    if (fd >= 0) {
+        fstat(fd, &info);
+        if (ftruncate(fd, (plan.totalSize + info.st_blksize - 1) / info.st_blksize * info.st_blksize) == 0) {
+            base = store_map(fd, plan.totalSize, storeMapFlags);
+        }
+        close(fd);
+    }
+    if (base == MAP_FAILED) {
+        perror("Could not create the grown table");
+        table_unlink(generation);
+        grow_unlock();
+        return -1;
+    }
+    
+    *(kvStore *)base = plan;
+    pthread_mutex_lock(&tablesLock);
+    layout = table_add(generation, base);
+    pthread_mutex_unlock(&tablesLock);
+    store_init();
+    ((kvStore *)base)->initialized = 1;
+    __atomic_store_n(&root->epoch, 2 * generation - 1, __ATOMIC_RELEASE);
+    grow_unlock();
+    
+    return store_finish_grow();
+}
+
+int kv_store_write(char *key, char *value) {
+    return kv_store_write_ttl(key, value, 0);
+}
+
+int kv_store_write_ttl(char *key, char *value, unsigned int ttl) {
+    return store_write(key, value, ttl > 0 ? clock_seconds() + ttl : 0);
+}
+
+// Writes one entry expiring at expiry (0 for never), logging it first in a durable store.
+int store_write(char *key, char *value, uint32_t expiry) {
+    int pinned __attribute__((cleanup(store_unpin))) = store_pin();
+    unsigned long keyHash;
+    unsigned long podNum;
+    uint64_t lsn = 0;
+    
+    // Determine the pod number a key belongs in. A grow started by another process may move the pod between
+    // routing and locking it; the key is routed again then.
+    for (;;) {
+        if (key_route(key, &keyHash, 1) < 0) {
+            return -1;
+        }
+        podNum = pod_place(keyHash, key);
+        if (!pod_moved(podNum)) {
+            break;
+        }
+        pod_unlock(podNum);
+    }
+    int result = pod_insert(podNum, keyHash, key, value, expiry, 0);
+    if (result == 0 && walFd >= 0) {
+        lsn = wal_log(key, value, expiry);
+        result = lsn > 0 ? 0 : -1;
+    }
+    pod_unlock(podNum);
+    
+    // A durable write only returns once it is on disk
+    if (lsn > 0) {
+        result = wal_commit(lsn);
+    }
+    return result;
+}
+
+// Hashes every key of a batch, fills in the pods it may be in (the same pod twice under one-pod placement) and
+// returns the batch indices grouped by that pair of pods: two counting sorts, by second pod then by first, both
+// stable so entries of the same pair keep their order. While hashing, the metadata each entry will touch is
+// prefetched so it is in cache by the time its pods are processed.
+static int *batch_group(char **keys, int count, unsigned long *hashes, unsigned long (*pods)[2]) {
+    int *podStarts = malloc(sizeof(int) * (layout->pods + 1));
+    int *bySecond = malloc(sizeof(int) * count);
+    int *order = malloc(sizeof(int) * count);
+    
+    for (int i = 0; i < count; i++) {
+        hashes[i] = key_hash(keys[i]);
+        if (key_pods(hashes[i], pods[i]) == 1) {
+            pods[i][1] = pods[i][0];
+        }
+        __builtin_prefetch(&layout->indexHeads[pods[i][0] * layout->indexBuckets + hash_bucket(hashes[i])]);
+        __builtin_prefetch(&layout->podMeta[pods[i][0]].seq);
+    }
+    for (int pass = 1; pass >= 0; pass--) {
+        int *sorted = pass == 1 ? bySecond : order;
+        memset(podStarts, 0, sizeof(int) * (layout->pods + 1));
+        for (int i = 0; i < count; i++) {
+            podStarts[pods[i][pass] + 1]++;
+        }
+        for (int p = 0; p < layout->pods; p++) {
+            podStarts[p + 1] += podStarts[p];
+        }
+        for (int i = 0; i < count; i++) {
+            int entry = pass == 1 ? i : bySecond[i];
+            sorted[podStarts[pods[entry][pass]]++] = entry;
+        }
+    }
+    free(bySecond);
+    free(podStarts);
+    return order;
+}
+
+int kv_store_write_batch(char **keys, char **values, int count) {
+    int result = 0;
+    
+    // While the store grows, the keys of one new pod can come from old pods in either table
+    int pinned __attribute__((cleanup(store_unpin))) = store_pin();
+    if (previousTable != NULL) {
+        for (int i = 0; i < count; i++) {
+            result |= store_write(keys[i], values[i], 0);
+        }
+        return result;
+    }
+    
+    unsigned long *hashes = malloc(sizeof(unsigned long) * count);
+    unsigned long (*pods)[2] = malloc(sizeof(*pods) * count);
+    int *order = batch_group(keys, count, hashes, pods);
+    int *deferred = malloc(sizeof(int) * count);
+    int deferredCount = 0;
+    char *records = NULL;
+    size_t capacity = 0;
+    uint64_t lsn = 0;
+    
+    // The locks of a pair of pods are taken once for all of the batch's entries that may go to them, and a durable
+    // store logs those with a single append. With both held, a new key is placed the way pod_place() would. The
+    // whole batch then waits for one flush.
+    for (int i = 0; i < count; ) {
+        unsigned long *pair = pods[order[i]];
+        size_t used = 0;
+        pod_pair_lock(pair);
+        int moved = pod_moved(pair[0]) || pod_moved(pair[1]);
+        for (; i < count && pods[order[i]][0] == pair[0] && pods[order[i]][1] == pair[1]; i++) {
+            int entry = order[i];
+            if (moved) {
+                // Another process moved the pods since, so the store grew: written one by one after the batch
+                deferred[deferredCount++] = entry;
+                continue;
+            }
+            unsigned long podNum = pair[0] == pair[1] ? pair[0] : pod_choose(pair[0], pair[1], keys[entry]);
+            if (pod_insert(podNum, hashes[entry], keys[entry], values[entry], 0, 0) < 0) {
+                result = -1;
+            } else if (walFd >= 0) {
+                used = wal_encode(&records, used, &capacity, keys[entry], values[entry], 0);
+            }
+        }
+        if (used > 0) {
+            uint64_t end = wal_append(records, used);
+            if (end == 0) {
+                result = -1;
+            } else {
+                lsn = end;
+            }
+        }
+        pod_pair_unlock(pair);
+    }
+    if (lsn > 0 && wal_commit(lsn) < 0) {
+        result = -1;
+    }
+    for (int d = 0; d < deferredCount; d++) {
+        result |= store_write(keys[deferred[d]], values[deferred[d]], 0);
+    }
+    
+    free(deferred);
+    free(records);
+    free(order);
+    free(pods);
+    free(hashes);
+    return result;
+}
 
-int kv_store_create(char *name) {
+// Reads the next value of key from one of the pods it may be in (layout).
+static char *pod_read(unsigned long podNum, char *key) {
     
-    // Creates and opens a new, or opens an existing, POSIX shared memory object.
-    int fd = shm_open(name, O_CREAT | O_RDWR, S_IRWXU);
-    if (fd < 0) {
-        perror("Error... Opening shm\n");
-        return -1;
+    // layout->readCursors[podNum] returns an int which indicates the point of search.
+    // The cursor only moves once a read succeeded, so a retried optimistic read starts from the same place.
+    int slot;
+    
+    if (readMode == KV_READ_OPTIMISTIC) {
+        for (int attempt = 0; attempt < kvSeqMaxRetries; attempt++) {
+            unsigned int seq = pod_seq_read_begin(podNum);
+            int torn = 0;
+            char *value = NULL;
+            
+            slot = pod_find(podNum, key, layout->readCursors[podNum]);
+            if (slot >= 0) {
+                value = slot_value_dup(podNum, slot, &torn);
+            }
+            if (!torn && pod_seq_read_valid(podNum, seq)) {
+                if (slot >= 0) {
+                    layout->readCursors[podNum] = (slot + 1) % layout->slotsPerPod;
+                }
+                return value;
+            }
+            free(value);
+        }
+        // The pod kept changing underneath us, take the lock instead of starving.
     }
     
-    // Resize the shared memory object to a specific length (Key-value store PLUS total size of all potential key-value pair
-    size_t sizeToAllocate = (sizeof(kvStore) + maxKeyValuePairs * keyValuePairSize);
-    ftruncate(fd, sizeToAllocate);
-    kvStoreInfoAddr = (char *) mmap(NULL, sizeToAllocate, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    // Initialize Semaphores then does error check.
-    mutex = sem_open("260606721_a2_mutex", O_CREAT, S_IRWXU ,1);
-    if (mutex == SEM_FAILED) {
-        perror("mutex semaphore failed.");
-        return(-1);
+    char *value = NULL;
+    int torn = 0;
+    
+    pod_read_lock(podNum);
+    
+    slot = pod_find(podNum, key, layout->readCursors[podNum]);
+    if (slot >= 0) {
+        value = slot_value_dup(podNum, slot, &torn);
+        layout->readCursors[podNum] = (slot + 1) % layout->slotsPerPod;
     }
     
-    db = sem_open("260606721_a2_db", O_CREAT, S_IRWXU, 1);
-    if (db == SEM_FAILED) {
-        perror("db semaphore failed.");
-        return -1;
+    pod_unlock(podNum);
+    
+    return value;
+}
+
+char *kv_store_read(char *key) {
+    int pinned __attribute__((cleanup(store_unpin))) = store_pin();
+    kvPlace places[4];
+    char *value = NULL;
+    
+    // Determine the pods a key may be in, and try them in order
+    int count = key_places(key, places);
+    for (int i = 0; i < count && value == NULL; i++) {
+        layout = places[i].table;
+        value = pod_read(places[i].podNum, key);
+    }
+    return value;
+}
+
+static void free_all(char **allValues) {
+    for (int i = 0; allValues[i] != NULL; i++) {
+        free(allValues[i]);
+    }
+    free(allValues);
+}
+
+// Copies every value stored under key in the pod, starting from the read cursor, into a NULL-terminated array.
+// Returns NULL if there are none; sets *torn if an optimistic reader saw the pod mid-update.
+static char **pod_copy_all(unsigned long podNum, char *key, int *torn) {
+    int slots[layout->slotsPerPod];
+    int valuesCount = pod_find_all(podNum, key, layout->readCursors[podNum], slots, layout->slotsPerPod);
+    
+    // No values found within the store
+    if (valuesCount == 0) {
+        return NULL;
     }
     
-    // Initialize a local variable kvStoreInfo so we can access the attributes within
-    kvStore* kvStoreInfo = (kvStore *)kvStoreInfoAddr;
+    char **allValues = calloc(valuesCount + 1, sizeof(char *));
+    for (int i = 0; i < valuesCount && !*torn; i++) {
+        allValues[i] = slot_value_dup(podNum, slots[i], torn);
+    }
+    return allValues;
+}
 
-    // Initialized the KV-store info (Book Keeping)
-    if (kvStoreInfo->initialized == 0) {
-        for (int i = 0; i < numberOfPods; i++) {
-            kvStoreInfo->podNums[i] = 0;
+// Copies the values key had in the pod at version, without the pod lock, into a NULL-terminated array (NULL if
+// there are none). Every slot is read between two loads of its version, so a slot rewritten meanwhile is skipped
+// rather than torn; entries written after version are skipped too. Skipping lost nothing unless the pod dropped
+// an entry of the key's chain since version, which sets *tooOld. The fingerprints are used to find the slots
+// whatever the lookup mode, since the index chains may be mid-update.
+static char **pod_copy_at(unsigned long podNum, char *key, uint64_t version, int *tooOld) {
+    int slots[layout->slotsPerPod];
+    int valuesCount = 0;
+    
+    // Once the pod's counter is even, every write to it that drew a version up to ours has completed. One that
+    // stays odd was left by a dead writer, and passing through the lock repairs the pod.
+    if (pod_seq_read_begin(podNum) & 1) {
+        pod_write_lock(podNum);
+        pod_unlock(podNum);
+    }
+    int candidates = fingerprint_find_all(podNum, key, layout->readCursors[podNum], slots, layout->slotsPerPod);
+    char **allValues = candidates > 0 ? calloc(candidates + 1, sizeof(char *)) : NULL;
+    
+    for (int i = 0; i < candidates; i++) {
+        uint64_t *slotVersion = &layout->slotVersions[podNum * layout->slotsPerPod + slots[i]];
+        uint64_t seen = __atomic_load_n(slotVersion, __ATOMIC_ACQUIRE);
+        int torn = 0;
+        
+        if (seen == 0 || seen > version || !slot_matches(podNum, slots[i], key)) {
+            continue;
         }
-        for (int j = 0; j < podSize; j++) {
-            kvStoreInfo->podSlots[j] = 0;
+        char *value = slot_value_dup(podNum, slots[i], &torn);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (torn || value == NULL || __atomic_load_n(slotVersion, __ATOMIC_RELAXED) != seen) {
+            free(value);
+            continue;
+        }
+        allValues[valuesCount++] = value;
+        if (layout->evictionPolicy != KV_EVICT_FIFO) {
+            slot_touch(podNum, slots[i]);
         }
-        kvStoreInfo->initialized = 1;
-        kvStoreInfo->readCounter = 0;
     }
     
-    close(fd);
-    return 0;
+    // A writer marks the chain before it touches the slot, so a slot seen changing above has its mark seen here
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t dropped = __atomic_load_n(&layout->dropVersions[podNum * layout->indexBuckets + key_bucket(key)], __ATOMIC_RELAXED);
+    if (dropped > version) {
+        *tooOld = 1;
+    }
+    if (valuesCount == 0 || *tooOld) {
+        if (allValues != NULL) {
+            free_all(allValues);
+        }
+        return NULL;
+    }
+    return allValues;
 }
 
-unsigned long hash(const char *str) {
-    unsigned long hash = 5381;
-    int c;
+static char **pod_read_all(unsigned long podNum, char *key) {
     
-    while(c = *str++) {
-        hash = ((hash << 5) + hash) + c;
+    char **allValues;
+    int torn = 0;
+    
+    // Each try reads as of the latest write; only an eviction from the key's own chain since then sends it back
+    if (readMode == KV_READ_OPTIMISTIC) {
+        for (int attempt = 0; attempt < kvSeqMaxRetries; attempt++) {
+            int tooOld = 0;
+            allValues = pod_copy_at(podNum, key, version_now(), &tooOld);
+            if (!tooOld) {
+                return allValues;
+            }
+        }
+    }
+    
+    // The read lock is held for the whole scan so a writer cannot slip in between two matches.
+    pod_read_lock(podNum);
+    allValues = pod_copy_all(podNum, key, &torn);
+    pod_unlock(podNum);
+    
+    return allValues;
+}
+
+// All of a key's entries are in one pod, so the first pod holding any has them all
+char **kv_store_read_all(char *key) {
+    int pinned __attribute__((cleanup(store_unpin))) = store_pin();
+    kvPlace places[4];
+    char **allValues = NULL;
+    
+    int count = key_places(key, places);
+    for (int i = 0; i < count && allValues == NULL; i++) {
+        layout = places[i].table;
+        allValues = pod_read_all(places[i].podNum, key);
+    }
+    return allValues;
+}
+
+int kv_store_snapshot_begin(kvSnapshotHandle *snapshot) {
+    if (kvStoreInfoAddr == NULL) {
+        return -1;
     }
-    hash = (hash > 0) ? hash : -(hash);
-    return hash % numberOfPods;
+    snapshot->version = version_now();
+    return 0;
 }
 
-int kv_store_write(char *key, char *value) {
+// A moved pod's entries keep their versions in the new table, so a snapshot reads across a grow like any other.
+int kv_store_snapshot_read_all(const kvSnapshotHandle *snapshot, char *key, char ***values) {
+    kvPlace places[4];
+    int tooOld = 0;
+    int valuesCount = 0;
     
-    // Determine the pod number a key belongs in
-    unsigned long podNum = hash(key);
+    *values = NULL;
+    if (kvStoreInfoAddr == NULL) {
+        return -1;
+    }
+    int pinned __attribute__((cleanup(store_unpin))) = store_pin();
+    int count = key_places(key, places);
+    for (int i = 0; i < count && *values == NULL && !tooOld; i++) {
+        layout = places[i].table;
+        *values = pod_copy_at(places[i].podNum, key, snapshot->version, &tooOld);
+    }
+    layout = currentTable;
+    if (tooOld) {
+        return -1;
+    }
+    while (*values != NULL && (*values)[valuesCount] != NULL) {
+        valuesCount++;
+    }
+    return valuesCount;
+}
+
+// Reads the batch entries order[first..last) which all live in podNum, advancing a private copy of the read
+// cursor so successive reads of a key still walk its values; the advanced cursor is left in *cursorOut for the
+// caller to publish once the group is known to be clean. Returns 0, or 1 if an optimistic reader saw the pod
+// mid-update (results are then freed).
+static int pod_read_group(unsigned long podNum, char **keys, int *order, int first, int last, char **results,
+                          int *cursorOut) {
+    int cursor = layout->readCursors[podNum];
+    int torn = 0;
     
-    // Determine the starting location of the pod that contains the key
-    size_t podLocation = podSize * keyValuePairSize * podNum;
+    for (int i = first; i < last && !torn; i++) {
+        int slot = pod_find(podNum, keys[order[i]], cursor);
+        results[order[i]] = NULL;
+        if (slot >= 0) {
+            results[order[i]] = slot_value_dup(podNum, slot, &torn);
+            cursor = (slot + 1) % layout->slotsPerPod;
+        }
+    }
+    if (torn) {
+        for (int i = first; i < last; i++) {
+            free(results[order[i]]);
+            results[order[i]] = NULL;
+        }
+        return 1;
+    }
+    *cursorOut = cursor;
+    return 0;
+}
 
-    // Initailize kvStoreInfo to access podNums
-    kvStore* kvStoreInfo = (kvStore *)kvStoreInfoAddr;
+char **kv_store_read_batch(char **keys, int count) {
     
-    // kvStoreInfo->podNums[podNum] returns an int which indicates the number of key-value pair within the given pod.
-    size_t offset = keyValuePairSize * kvStoreInfo->podNums[podNum];
+    // While the store grows, the keys of one new pod can live in old pods of either table
+    int pinned __attribute__((cleanup(store_unpin))) = store_pin();
+    if (previousTable != NULL) {
+        char **results = calloc(count, sizeof(char *));
+        for (int i = 0; i < count; i++) {
+            results[i] = kv_store_read(keys[i]);
+        }
+        return results;
+    }
     
-    sem_wait(db);
+    unsigned long *hashes = malloc(sizeof(unsigned long) * count);
+    unsigned long (*pods)[2] = malloc(sizeof(*pods) * count);
+    int *order = batch_group(keys, count, hashes, pods);
+    char **results = calloc(count, sizeof(char *));
     
-    // Store the given key and value into the shared memory
-    memcpy(kvStoreInfoAddr + sizeof(kvStore) + offset + podLocation, key, keySize);
-    memcpy(kvStoreInfoAddr + sizeof(kvStore) + offset + podLocation + keySize, value , valueSize);
+    // One optimistic pass (or one read lock) per pod covers all of the batch's keys in that pod, their first one
+    for (int i = 0; i < count; ) {
+        unsigned long podNum = pods[order[i]][0];
+        int first = i;
+        int done = 0;
+        int cursor;
+        
+        while (i < count && pods[order[i]][0] == podNum) {
+            i++;
+        }
+        for (int attempt = 0; readMode == KV_READ_OPTIMISTIC && attempt < kvSeqMaxRetries && !done; attempt++) {
+            unsigned int seq = pod_seq_read_begin(podNum);
+            if (pod_read_group(podNum, keys, order, first, i, results, &cursor) == 0) {
+                done = pod_seq_read_valid(podNum, seq);
+                if (!done) {
+                    for (int j = first; j < i; j++) {
+                        free(results[order[j]]);
+                        results[order[j]] = NULL;
+                    }
+                }
+            }
+        }
+        if (!done) {
+            // A value torn even under the lock is a damaged chunk; the cursor then stays where it was
+            cursor = layout->readCursors[podNum];
+            pod_read_lock(podNum);
+            pod_read_group(podNum, keys, order, first, i, results, &cursor);
+            pod_unlock(podNum);
+        }
+        layout->readCursors[podNum] = cursor;
+    }
     
-    // Key-Value written into the pod, increment the count of key-value pairs within this pod
-    kvStoreInfo->podNums[podNum]++;
+    // Keys placed in their second pod were not found in the first, which is not probed again
+    for (int i = 0; i < count; i++) {
+        if (results[i] == NULL && pods[i][1] != pods[i][0]) {
+            results[i] = pod_read(pods[i][1], keys[i]);
+        }
+    }
     
-    // If the current count value is greater than the pod size, we will loop back to the start of the pod
-    //  so that the next write will replace the existing (oldest) entry.
-    kvStoreInfo->podNums[podNum] = kvStoreInfo->podNums[podNum] % podSize;
+    free(order);
+    free(pods);
+    free(hashes);
+    return results;
+}
 
-    sem_post(db);
+static int pod_read_lease(unsigned long podNum, char *key, kvLease *lease) {
+    
+    // The view is only handed out once it was taken between two equal, even sequence numbers
+    for (int attempt = 0; attempt < kvSeqMaxRetries; attempt++) {
+        unsigned int seq = pod_seq_read_begin(podNum);
+        int torn = 0;
+        int slot = pod_find(podNum, key, layout->readCursors[podNum]);
+        
+        if (slot >= 0) {
+            if (lease->buffer == NULL && slot_compressed(podNum, slot)) {
+                lease->buffer = malloc(maxValueSize + 1);
+            }
+            lease->value = slot_value_view(podNum, slot, lease->buffer, &lease->length, &torn);
+        }
+        if (!torn && pod_seq_read_valid(podNum, seq)) {
+            if (slot < 0) {
+                return -1;
+            }
+            lease->podNum = podNum;
+            lease->seq = seq;
+            lease->podSeq = &layout->podMeta[podNum].seq;
+            layout->readCursors[podNum] = (slot + 1) % layout->slotsPerPod;
+            return 0;
+        }
+        sched_yield();
+    }
     
+    // The pod kept changing underneath us (or its writer died, which the lock repairs): the value is copied into
+    // the lease's buffer under the lock instead, and a lease checked against its own counter never goes stale.
+    int torn = 0;
+    pod_read_lock(podNum);
+    int slot = pod_find(podNum, key, layout->readCursors[podNum]);
+    if (slot >= 0) {
+        if (lease->buffer == NULL) {
+            lease->buffer = malloc(maxValueSize + 1);
+        }
+        const char *value = slot_value_view(podNum, slot, lease->buffer, &lease->length, &torn);
+        if (value != NULL && value != lease->buffer) {
+            memcpy(lease->buffer, value, lease->length + 1);
+        }
+        layout->readCursors[podNum] = (slot + 1) % layout->slotsPerPod;
+    }
+    pod_unlock(podNum);
+    if (slot < 0 || torn) {
+        return -1;
+    }
+    lease->value = lease->buffer;
+    lease->podNum = podNum;
+    lease->seq = 0;
+    lease->podSeq = &lease->seq;
     return 0;
 }
 
-// Reference: Section 2.5.2 of the course textbook
-char *kv_store_read(char *key) {
+int kv_store_read_lease(char *key, kvLease *lease) {
+    int pinned __attribute__((cleanup(store_unpin))) = store_pin();
+    kvPlace places[4];
+    
+    lease->buffer = NULL;
+    int count = key_places(key, places);
+    for (int i = 0; i < count; i++) {
+        layout = places[i].table;
+        if (pod_read_lease(places[i].podNum, key, lease) == 0) {
+            return 0;
+        }
+    }
+    // A miss hands out nothing to release
+    free(lease->buffer);
+    lease->buffer = NULL;
+    return -1;
+}
+
+// The lease remembers the pod's counter itself, since the store may have grown (and this thread moved on to
+// another table) since the view was taken.
+int kv_store_lease_valid(kvLease *lease) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (lease->seq & 1) == 0 && __atomic_load_n(lease->podSeq, __ATOMIC_RELAXED) == lease->seq;
+}
+
+void kv_store_lease_release(kvLease *lease) {
+    free(lease->buffer);
+    lease->buffer = NULL;
+    lease->value = NULL;
+    lease->length = 0;
+}
+
+unsigned int kv_store_version(char *key) {
+    int pinned __attribute__((cleanup(store_unpin))) = store_pin();
+    return pod_seq_read_begin(key_route(key, NULL, 0));
+}
 
-    sem_post(mutex);
-    sem_post(db);
+unsigned int kv_store_watch(char *key, unsigned int lastVersion, int timeoutMs) {
+    int pinned __attribute__((cleanup(store_unpin))) = store_pin();
+    unsigned long podNum = key_route(key, NULL, 0);
+    store_pin_table();
+    kvPodMeta *meta = &layout->podMeta[podNum];
+    struct timespec deadline, remaining;
+    unsigned int seq;
     
-    // Get exclusive access to readCounter
-    sem_wait(mutex);
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeoutMs / 1000;
+    deadline.tv_nsec += (timeoutMs % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
     
-    kvStore* kvStoreInfo = (kvStore *)kvStoreInfoAddr;
-    size_t readCounter = kvStoreInfo->readCounter;
-    readCounter++;
-    if (readCounter == 1) {
-        sem_wait(db);
+    // Writers only make the wake-up system call while somebody is registered here
+    __atomic_add_fetch(&meta->watchers, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+        seq = __atomic_load_n(&meta->seq, __ATOMIC_SEQ_CST);
+        if ((seq & 1) == 0 && seq != lastVersion) {
+            break;
+        }
+        
+        // An odd number means a write is under way; its end changes the word and wakes us like any other
+        const struct timespec *timeout = NULL;
+        if (timeoutMs >= 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            remaining.tv_sec = deadline.tv_sec - now.tv_sec;
+            remaining.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+            if (remaining.tv_nsec < 0) {
+                remaining.tv_sec--;
+                remaining.tv_nsec += 1000000000L;
+            }
+            if (remaining.tv_sec < 0) {
+                seq = lastVersion;
+                break;
+            }
+            timeout = &remaining;
+        }
+        futex(&meta->seq, FUTEX_WAIT, seq, timeout);
     }
-    sem_post(mutex);
-
-    // Determine the pod number a key belongs in
-    unsigned long podNum = hash(key);
+    __atomic_sub_fetch(&meta->watchers, 1, __ATOMIC_SEQ_CST);
     
-    // Find the head of a specific pod by multiplying the pod number with size of pod
-    size_t podLocation = podSize * keyValuePairSize * podNum;
+    return seq;
+}
 
-    size_t offset;
+// Copies every value stored under key in the pod, in read-cursor order, into buffer as consecutive NUL-terminated
+// strings. Returns the number of values, or -1 if they need more than bufferSize bytes (*needed says how many).
+static int pod_copy_into(unsigned long podNum, char *key, char *buffer, size_t bufferSize, size_t *needed, int *torn) {
+    int slots[layout->slotsPerPod];
+    int valuesCount = pod_find_all(podNum, key, layout->readCursors[podNum], slots, layout->slotsPerPod);
+    size_t used = 0;
+    
+    char scratch[maxValueSize + 1];
+    
+    for (int i = 0; i < valuesCount && !*torn; i++) {
+        size_t length = 0;
+        const char *value = slot_value_view(podNum, slots[i], scratch, &length, torn);
+        if (value != NULL && used + length + 1 <= bufferSize) {
+            memcpy(buffer + used, value, length);
+            buffer[used + length] = '\0';
+        }
+        used += length + 1;
+    }
+    *needed = used;
+    return used <= bufferSize ? valuesCount : -1;
+}
 
-    for (int i = 0; i < podSize; i++) {
-        // kvStoreInfo->podSlots[podNum] returns an int which indicates the point of search.
-        offset = keyValuePairSize * kvStoreInfo->podSlots[podNum];
-        if (memcmp(kvStoreInfoAddr + sizeof(kvStore) + offset + podLocation, key, strlen(key)) == 0) {
-            
-            kvStoreInfo->podSlots[podNum]++;
-            kvStoreInfo->podSlots[podNum] = kvStoreInfo->podSlots[podNum] % podSize;
-            
-            sem_wait(mutex);
-            readCounter--;
-            if (readCounter == 0) {
-                sem_post(db);
+static int pod_read_all_into(unsigned long podNum, char *key, char *buffer, size_t bufferSize, size_t *needed) {
+    
+    int valuesCount;
+    int torn = 0;
+    
+    if (readMode == KV_READ_OPTIMISTIC) {
+        for (int attempt = 0; attempt < kvSeqMaxRetries; attempt++) {
+            unsigned int seq = pod_seq_read_begin(podNum);
+            torn = 0;
+            valuesCount = pod_copy_into(podNum, key, buffer, bufferSize, needed, &torn);
+            if (!torn && pod_seq_read_valid(podNum, seq)) {
+                return valuesCount;
             }
-            sem_post(mutex);
-            
-            char *value = strdup((char *) (kvStoreInfoAddr + sizeof(kvStore) + offset + podLocation + keySize));
-            
-            return value;
-        } else {
-            kvStoreInfo->podSlots[podNum]++;
-            kvStoreInfo->podSlots[podNum] = kvStoreInfo->podSlots[podNum] % podSize;
         }
+        torn = 0;
     }
     
-    sem_wait(mutex);
-    readCounter--;
-    if (readCounter == 0) {
-        sem_post(db);
+    pod_read_lock(podNum);
+    valuesCount = pod_copy_into(podNum, key, buffer, bufferSize, needed, &torn);
+    pod_unlock(podNum);
+    
+    return valuesCount;
+}
+
+int kv_store_read_all_into(char *key, char *buffer, size_t bufferSize, size_t *needed) {
+    int pinned __attribute__((cleanup(store_unpin))) = store_pin();
+    kvPlace places[4];
+    int valuesCount = 0;
+    
+    int count = key_places(key, places);
+    for (int i = 0; i < count && valuesCount == 0; i++) {
+        layout = places[i].table;
+        valuesCount = pod_read_all_into(places[i].podNum, key, buffer, bufferSize, needed);
     }
-    sem_post(mutex);
+    return valuesCount;
+}
+
+// The values are copied out first, optimistically or under the read lock like kv_store_read_all_into(), and the
+// callback runs on the copies with no lock held, so a slow callback never holds up the pod's writers.
+static int pod_read_all_each(unsigned long podNum, char *key, int (*callback)(const char *value, size_t length, void *arg),
+                             void *arg) {
     
-    return NULL;
+    size_t bufferSize = 4096;
+    size_t needed;
+    char *buffer = malloc(bufferSize);
+    int valuesCount;
+    int visited = 0;
+    size_t used = 0;
+    
+    while ((valuesCount = pod_read_all_into(podNum, key, buffer, bufferSize, &needed)) < 0) {
+        bufferSize = needed;
+        buffer = realloc(buffer, bufferSize);
+    }
+    while (visited < valuesCount) {
+        size_t length = strlen(buffer + used);
+        visited++;
+        if (callback(buffer + used, length, arg) != 0) {
+            break;
+        }
+        used += length + 1;
+    }
+    free(buffer);
+    
+    return visited;
 }
 
-char **kv_store_read_all(char *key) {
+int kv_store_read_all_each(char *key, int (*callback)(const char *value, size_t length, void *arg), void *arg) {
+    int pinned __attribute__((cleanup(store_unpin))) = store_pin();
+    kvPlace places[4];
+    int visited = 0;
     
-    char *value;
-    char **allValues = malloc(sizeof(char *));
-    int valuesCount = 0;
+    int count = key_places(key, places);
+    for (int i = 0; i < count && visited == 0; i++) {
+        layout = places[i].table;
+        visited = pod_read_all_each(places[i].podNum, key, callback, arg);
+    }
+    return visited;
+}
 
-    // Get exclusive access to readCounter
-    sem_wait(mutex);
-    kvStore* kvStoreInfo = (kvStore *)kvStoreInfoAddr;
-    size_t readCounter = kvStoreInfo->readCounter;
-    readCounter++;
-    if (readCounter == 1) {
-        sem_wait(db);
+int kv_store_scan_range(kvScan *scan, const char *from, const char *to) {
+    scan->from = from != NULL ? strdup(from) : NULL;
+    scan->to = to != NULL ? strdup(to) : NULL;
+    scan->last = NULL;
+    scan->done = 0;
+    return 0;
+}
+
+// A prefix is the range from the prefix itself up to the first string after every key starting with it: the
+// prefix with its last byte below 0xff incremented and the rest cut off.
+int kv_store_scan_prefix(kvScan *scan, const char *prefix) {
+    char *to = strdup(prefix);
+    int end = strlen(to) - 1;
+    
+    while (end >= 0 && (unsigned char) to[end] == 0xff) {
+        end--;
+    }
+    if (end >= 0) {
+        to[end]++;
+        to[end + 1] = '\0';
+    }
+    kv_store_scan_range(scan, prefix, end >= 0 ? to : NULL);
+    free(to);
+    return 0;
+}
+
+void kv_store_scan_close(kvScan *scan) {
+    free(scan->from);
+    free(scan->to);
+    free(scan->last);
+    scan->from = scan->to = scan->last = NULL;
+}
+
+// Whether key lies after the scan's last key (or from its start on) and before both its end and bound.
+static int scan_wants(const kvScan *scan, const char *bound, const char *key) {
+    if (scan->last != NULL ? strncmp(key, scan->last, layout->keyBytes) <= 0
+                           : scan->from != NULL && strncmp(key, scan->from, layout->keyBytes) < 0) {
+        return 0;
+    }
+    return (scan->to == NULL || strncmp(key, scan->to, layout->keyBytes) < 0)
+        && (bound == NULL || strncmp(key, bound, layout->keyBytes) < 0);
+}
+
+static int scan_merge(char *results, int count, int maxKeys, const char *found, int foundCount, size_t stride);
+
+// Copies the pod's next distinct keys in order into keys (stride bytes each, NUL terminated), up to maxKeys of
+// them: those the scan wants (scan_wants()), where bound is the largest key the batch can still use (NULL while
+// it has room). Returns how many; a link that cannot be right sets *torn. Without the ordered index every slot of
+// the pod is looked at and the smallest keys kept.
+static int pod_scan_keys(unsigned long podNum, const kvScan *scan, const char *bound, char *keys, size_t stride,
+                         int maxKeys, int *torn) {
+    short prev[kvSkipLevels];
+    char key[stride];
+    int count = 0;
+    
+    if (!layout->orderedIndex) {
+        for (int slot = 0; slot < layout->slotsPerPod; slot++) {
+            if (slot_free(podNum, slot)) {
+                continue;
+            }
+            memcpy(key, slot_addr(podNum, slot), layout->keyBytes);
+            key[layout->keyBytes] = '\0';
+            if (scan_wants(scan, bound, key)) {
+                count = scan_merge(keys, count, maxKeys, key, 1, stride);
+            }
+        }
+        return count;
+    }
+    
+    if (scan->last != NULL || scan->from != NULL) {
+        // Ties go before every slot of an inclusive start and after every slot of the last key returned
+        int keySlot = scan->last != NULL ? layout->slotsPerPod : -1;
+        if (skip_find(podNum, scan->last != NULL ? scan->last : scan->from, keySlot, prev) < 0) {
+            *torn = 1;
+            return 0;
+        }
+    } else {
+        prev[0] = noSlot;
+    }
+    
+    int slot = *skip_link_at(podNum, prev[0], 0);
+    for (int steps = 0; slot != noSlot && count < maxKeys; steps++) {
+        if (slot < 0 || slot >= layout->slotsPerPod || steps > layout->slotsPerPod) {
+            *torn = 1;
+            break;
+        }
+        memcpy(key, slot_addr(podNum, slot), layout->keyBytes);
+        key[layout->keyBytes] = '\0';
+        if (!scan_wants(scan, bound, key)) {
+            break;
+        }
+        if (!slot_expired(podNum, slot) && (count == 0 || strcmp(key, keys + (count - 1) * stride) != 0)) {
+            memcpy(keys + count * stride, key, stride);
+            count++;
+        }
+        slot = skip_next(podNum, slot)[0];
+    }
+    return count;
+}
+
+static int pod_scan(unsigned long podNum, const kvScan *scan, const char *bound, char *keys, size_t stride,
+                    int maxKeys) {
+    int count;
+    int torn = 0;
+    
+    if (readMode == KV_READ_OPTIMISTIC) {
+        for (int attempt = 0; attempt < kvSeqMaxRetries; attempt++) {
+            unsigned int seq = pod_seq_read_begin(podNum);
+            torn = 0;
+            count = pod_scan_keys(podNum, scan, bound, keys, stride, maxKeys, &torn);
+            if (!torn && pod_seq_read_valid(podNum, seq)) {
+                return count;
+            }
+        }
     }
-    sem_post(mutex);
     
-    // Determine the pod number a key belongs in
-    unsigned long podNum = hash(key);
+    pod_read_lock(podNum);
+    count = pod_scan_keys(podNum, scan, bound, keys, stride, maxKeys, &torn);
+    pod_unlock(podNum);
     
-    // Find the head of a specific pod by multiplying the pod number with size of pod
-    size_t podLocation = podSize * keyValuePairSize * podNum;
+    return count;
+}
+
+// Merges found sorted keys into the batch's sorted results, keeping the maxKeys smallest and each key once.
+// Returns the new number of results.
+static int scan_merge(char *results, int count, int maxKeys, const char *found, int foundCount, size_t stride) {
+    for (int i = 0; i < foundCount; i++) {
+        const char *key = found + i * stride;
+        int low = 0, high = count;
+        while (low < high) {
+            int middle = (low + high) / 2;
+            if (strcmp(results + middle * stride, key) < 0) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        if (low == maxKeys) {
+            break;
+        }
+        if (low < count && strcmp(results + low * stride, key) == 0) {
+            continue;
+        }
+        int moved = (count < maxKeys ? count : maxKeys - 1) - low;
+        memmove(results + (low + 1) * stride, results + low * stride, moved * stride);
+        memcpy(results + low * stride, key, stride);
+        count += count < maxKeys;
+    }
+    return count;
+}
+
+int kv_store_scan_next(kvScan *scan, char **keys, int maxKeys) {
+    if (kvStoreInfoAddr == NULL || maxKeys < 1) {
+        return -1;
+    }
+    if (scan->done) {
+        return 0;
+    }
+    if (maxKeys > kvScanMaxBatch) {
+        maxKeys = kvScanMaxBatch;
+    }
+    int pinned __attribute__((cleanup(store_unpin))) = store_pin();
     
-    size_t offset;
+    // Tables keep the store's key size when it grows
+    size_t stride = layout->keyBytes + 1;
+    char *results = malloc(stride * maxKeys * 2);
+    char *found = results + stride * maxKeys;
+    kvLayout *scanned[2] = { previousTable, currentTable };
+    int count = 0;
     
-    // Similar to read but instead of returning a single value, store the result in an array and return it at the end
-    for (int i = 0; i < podSize; i++) {
-        // kvStoreInfo->podSlots[podNum] returns an int which indicates the point of search.
-        offset = keyValuePairSize * kvStoreInfo->podSlots[podNum];
-        if (memcmp(kvStoreInfoAddr + sizeof(kvStore) + offset + podLocation, key, strlen(key)) == 0) {
-            kvStoreInfo->podSlots[podNum]++;
-            kvStoreInfo->podSlots[podNum] = kvStoreInfo->podSlots[podNum] % podSize;
-            
-            sem_wait(mutex);
-            readCounter--;
-            if (readCounter == 0) {
-                sem_post(db);
+    // While the store grows the old pods not moved yet come first: a pod moved after that is found in the new table
+    for (int t = 0; t < 2; t++) {
+        if (scanned[t] == NULL) {
+            continue;
+        }
+        layout = scanned[t];
+        for (unsigned long podNum = 0; podNum < (unsigned long) layout->pods; podNum++) {
+            if (layout == previousTable && pod_moved(podNum)) {
+                continue;
             }
-            sem_post(mutex);
-            
-            valuesCount++;
-            allValues = realloc(allValues , sizeof(char *) * (valuesCount));
-            value = strdup((char *) (kvStoreInfoAddr + sizeof(kvStore) + offset + podLocation + keySize));
-            
-            allValues[valuesCount - 1] = value;
-        } else {
-            kvStoreInfo->podSlots[podNum]++;
-            kvStoreInfo->podSlots[podNum] = kvStoreInfo->podSlots[podNum] % podSize;
+            const char *bound = count == maxKeys ? results + (maxKeys - 1) * stride : NULL;
+            int foundCount = pod_scan(podNum, scan, bound, found, stride, maxKeys);
+            count = scan_merge(results, count, maxKeys, found, foundCount, stride);
         }
     }
+    layout = currentTable;
     
-    sem_wait(mutex);
-    readCounter--;
-    if (readCounter == 0) {
-        sem_post(db);
+    for (int i = 0; i < count; i++) {
+        keys[i] = strdup(results + i * stride);
+    }
+    if (count > 0) {
+        free(scan->last);
+        scan->last = strdup(keys[count - 1]);
     }
-    sem_post(mutex);
+    scan->done = count < maxKeys;
+    free(results);
+    return count;
+}
+
+// Serializes the live entries of one pod, oldest first, as [u16 key length][key][u32 value length][value]
+// [u32 expiry]. Expired entries are left out. Must be called with the pod read lock held. Returns the number of entries; *payload is malloc'd.
+uint32_t pod_serialize(unsigned long podNum, char **payload, size_t *payloadBytes) {
+    size_t capacity = 4096;
+    size_t used = 0;
+    uint32_t entries = 0;
+    char scratch[maxValueSize + 1];
+    int torn = 0;
     
-    // No values found within the store
-    if (valuesCount == 0) {
-        return NULL;
+    *payload = malloc(capacity);
+    for (int i = 0; i < layout->slotsPerPod; i++) {
+        // nextSlot points at the next slot to be overwritten, i.e. the oldest entry
+        int slot = (layout->podMeta[podNum].nextSlot + i) % layout->slotsPerPod;
+        size_t length;
+        if (*slot_value_offset(podNum, slot) == 0 || slot_expired(podNum, slot)) {
+            continue;
+        }
+        const char *value = slot_value_view(podNum, slot, scratch, &length, &torn);
+        uint16_t keyLength = strnlen(slot_addr(podNum, slot), layout->keyBytes);
+        uint32_t valueLength = length;
+        uint32_t expiry = layout->slotExpiry[podNum * layout->slotsPerPod + slot];
+        
+        while (used + sizeof(keyLength) + keyLength + sizeof(valueLength) + valueLength + sizeof(expiry) > capacity) {
+            capacity *= 2;
+            *payload = realloc(*payload, capacity);
+        }
+        memcpy(*payload + used, &keyLength, sizeof(keyLength));
+        used += sizeof(keyLength);
+        memcpy(*payload + used, slot_addr(podNum, slot), keyLength);
+        used += keyLength;
+        memcpy(*payload + used, &valueLength, sizeof(valueLength));
+        used += sizeof(valueLength);
+        memcpy(*payload + used, value, valueLength);
+        used += valueLength;
+        memcpy(*payload + used, &expiry, sizeof(expiry));
+        used += sizeof(expiry);
+        entries++;
+    }
+    *payloadBytes = used;
+    return entries;
+}
+
+int kv_store_expire(int podNum) {
+    int pinned __attribute__((cleanup(store_unpin))) = store_pin();
+    if (podNum < 0 || podNum >= layout->pods) {
+        return -1;
+    }
+    // Pods that never saw a TTL are skipped without taking their lock
+    if (__atomic_load_n(&layout->podMeta[podNum].ttlEntries, __ATOMIC_RELAXED) == 0) {
+        return 0;
     }
+    pod_write_lock(podNum);
+    int reclaimed = pod_expire(podNum);
+    pod_unlock(podNum);
+    return reclaimed;
+}
+
+static pthread_t sweeper;
+static int sweeperRunning;
+static int sweepIntervalMs;
+
+// Walks all pods every sweepIntervalMs, holding only one pod lock at a time.
+static void *sweeper_main(void *arg) {
+    (void) arg;
+    struct timespec pause = { sweepIntervalMs / 1000, (sweepIntervalMs % 1000) * 1000000L };
     
-    return allValues;
+    while (__atomic_load_n(&sweeperRunning, __ATOMIC_RELAXED)) {
+        store_enter();
+        for (int podNum = 0; podNum < layout->pods && __atomic_load_n(&sweeperRunning, __ATOMIC_RELAXED); podNum++) {
+            kv_store_expire(podNum);
+        }
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+int kv_store_sweeper_start(int intervalMs) {
+    if (sweeperRunning || intervalMs <= 0) {
+        return -1;
+    }
+    sweepIntervalMs = intervalMs;
+    sweeperRunning = 1;
+    if (pthread_create(&sweeper, NULL, sweeper_main, NULL) != 0) {
+        perror("Could not start sweeper");
+        sweeperRunning = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void kv_store_sweeper_stop(void) {
+    if (sweeperRunning) {
+        __atomic_store_n(&sweeperRunning, 0, __ATOMIC_RELAXED);
+        pthread_join(sweeper, NULL);
+    }
 }
 
 int kv_delete_db(){
     
-    // Unlink the semaphores
-    sem_unlink("260606721_a2_db");
-    sem_unlink("260606721_a2_mutex");
+    if (kvStoreInfoAddr == NULL) {
+        return(-1);
+    }
     
     // Removes the memory mapped earlier via mmap(...)
-    if(munmap(kvStoreInfoAddr, sizeof(kvStore) + maxKeyValuePairs * keyValuePairSize) == -1){
+    kv_store_sweeper_stop();
+    
+    // The log is durable data and stays behind; only this process's descriptor goes
+    if (walFd >= 0) {
+        close(walFd);
+        walFd = -1;
+    }
+    
+    // Every table this process mapped goes. The newest one (and, mid-grow, the one before it) is unlinked along
+    // with the root; older ones were unlinked when they were released.
+    uint32_t epoch = ((kvStore *)kvStoreInfoAddr)->epoch;
+    int result = 0;
+    pthread_mutex_lock(&tablesLock);
+    while (tables != NULL) {
+        kvLayout *table = tables;
+        tables = table->older;
+        if (munmap(table->base, table->totalSize) == -1) {
+            result = -1;
+        }
+        free(table->readCursors);
+        free(table);
+    }
+    pthread_mutex_unlock(&tablesLock);
+    layout = currentTable = previousTable = NULL;
+    kvStoreInfoAddr = NULL;
+    if (result < 0) {
         perror("Could not delete store");
         return(-1);
     }
     
-    shm_unlink(DATA_BASE_NAME);
+    for (uint32_t generation = epoch / 2; generation <= (epoch + 1) / 2; generation++) {
+        if (generation > 0) {
+            table_unlink(generation);
+        }
+    }
+    table_unlink(0);
+#ifdef KV_GLOBAL_LOCK
+    sem_unlink(kvGlobalSemName);
+#endif
     
     return(0);
 }
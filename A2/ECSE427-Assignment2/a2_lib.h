@@ -17,34 +17,362 @@
 #include <string.h>
 #include <fcntl.h>
 #include <semaphore.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <limits.h>
+
+// A zero-copy view of one value inside the mapped store. The bytes may be overwritten by a later write to the
+// same pod or a grow moving it; check kv_store_lease_valid() after using them and retry the read if it returns 0.
+// A value stored compressed, or read while writers kept changing the pod, is copied into a buffer owned by the
+// lease instead, so every lease kv_store_read_lease() returned 0 for must be handed to kv_store_lease_release()
+// once the caller is done with it.
+typedef struct {
+    const char *value;
+    size_t length;
+    unsigned long podNum;
+    unsigned int seq;
+    const unsigned int *podSeq;                         // the pod's sequence counter, or seq for a copied value
+    char *buffer;                                       // holds the expanded value of a compressed entry, or NULL
+} kvLease;
+
+// Ordered scans. kv_store_scan_prefix() and kv_store_scan_range() walk the keys of the whole store in byte order:
+// kv_store_scan_next() returns the next batch of at most maxKeys distinct keys (malloc'd, at most kvScanMaxBatch per
+// call) after the last one returned, and 0 once the range is exhausted (after a batch that came back short). Every
+// batch visits each pod once, under its lock or an optimistic read, and sees the store as it is at that moment, so a
+// scan is not a snapshot. Expired entries are skipped. A store created with kvOptions.orderedIndex keeps each pod's
+// entries in a skiplist sorted by key, so a batch only touches the keys it returns (plus a few per pod to find them);
+// without it every slot of every pod is looked at. Keeping the skiplists costs each write a search of its pod's list.
+typedef struct {
+    char *from;                                         // first key of the range, NULL from the smallest key
+    char *to;                                           // end of the range (excluded), NULL for no end
+    char *last;                                         // last key returned so far, NULL before the first batch
+    int done;                                           // a batch came back short, the range holds no more keys
+} kvScan;
+
+// Point-in-time reads. Every write stamps its slot with the next value of a store-wide version counter, and a pod
+// that drops an entry to make room records the version that dropped it. kv_store_read_all() returns the key's
+// values as they were at one version: it copies them without the pod lock, slot by slot, and only tries again
+// (or, after kvSeqMaxRetries tries, takes the read lock) if an entry it needed was dropped meanwhile, so writers
+// to the pod that replace other keys' entries are neither blocked nor a reason to retry. kv_store_snapshot_begin()
+// fixes a version for later reads: kv_store_snapshot_read_all() returns the number of values key had then (values
+// written since are left out) and the values in *values, NULL-terminated, or NULL if there were none. The store
+// keeps no old versions, so once an entry the answer needs was evicted it returns -1: the snapshot is too old for
+// that key. Expiry is judged when the read happens. A snapshot holds nothing and needs no release.
+typedef struct {
+    uint64_t version;                                   // latest write the snapshot sees
+} kvSnapshotHandle;
+
+// Geometry of a store. kv_store_create() uses the compile-time defaults below; kv_store_create_with() lets the
+// creator size the store to its working set. Processes attaching to an existing store always use the geometry
+// recorded in its header. slotsPerPod must be a multiple of 64 and at most 32704.
+typedef struct {
+    int pods;                                           // number of pods within the KV-Store
+    int slotsPerPod;                                    // number of KV-Pairs per pod
+    int keyBytes;                                       // bytes reserved per key; a key this long has no NUL
+    int valueBytes;                                     // typical value length, used to size the value arena
+} kvGeometry;
+
+// How this process maps the store (kvOptions.mapFlags). KV_MAP_HUGETLB keeps the store in a file under
+// hugetlbDir (a hugetlbfs mount, e.g. /dev/hugepages) instead of POSIX shm, so every process attaching to it
+// must pass the same flag and directory. KV_MAP_THP asks for transparent huge pages on the shm mapping, which
+// only takes effect when /sys/kernel/mm/transparent_hugepage/shmem_enabled allows it. KV_MAP_POPULATE faults the
+// whole store in up front (including the reserved arena). KV_MAP_MLOCK pins pages in RAM as they are touched.
+// KV_MAP_EXISTING only attaches: kv_store_create_with() fails instead of creating a store that does not exist.
+#define KV_MAP_HUGETLB 1
+#define KV_MAP_THP 2
+#define KV_MAP_POPULATE 4
+#define KV_MAP_MLOCK 8
+#define KV_MAP_EXISTING 16
+
+// Hash functions for kvOptions.hashFunction. KV_HASH_WY is a wyhash-style word-at-a-time hash and the default;
+// KV_HASH_DJB2 is the original byte-at-a-time djb2. Both are seeded with kvOptions.hashSeed.
+#define KV_HASH_WY 0
+#define KV_HASH_DJB2 1
+
+// Eviction policies for kvOptions.evictionPolicy, deciding which slot of a pod a write replaces. KV_EVICT_FIFO
+// (the default) always replaces the oldest entry. KV_EVICT_CLOCK gives entries read since the clock hand last
+// passed a second chance. KV_EVICT_LRU replaces the least recently used of kvEvictSamples slots.
+#define KV_EVICT_FIFO 0
+#define KV_EVICT_CLOCK 1
+#define KV_EVICT_LRU 2
+#define kvEvictSamples 8
+
+// Placements for kvOptions.placement, deciding which pod a key lives in. KV_PLACE_TWO_CHOICE (the default) gives
+// every key two candidate pods from different bits of its hash: all of a key's entries stay in the one already
+// holding it, and a new key goes to the one with fewer live entries, so pods fill evenly and a store holds close
+// to its full capacity before writes start evicting. Lookups check both. KV_PLACE_ONE pins each key to hash().
+#define KV_PLACE_TWO_CHOICE 0
+#define KV_PLACE_ONE 1
+
+// Options of kv_store_create_with(). Compression: with compressAbove set, values longer than that many bytes are
+// stored compressed with a small LZ4-style compressor whenever that fits them into a smaller chunk of the arena;
+// the chunk is flagged so every read expands it again. Text-like values typically shrink 2-5x, which cuts the
+// arena's resident memory and the bytes reads copy. Incompressible values are stored as they are. 0 (the
+// default) never compresses.
+typedef struct {
+    int pods;
+    int slotsPerPod;
+    int keyBytes;
+    int valueBytes;
+    int mapFlags;                                       // KV_MAP_* flags
+    const char *hugetlbDir;                             // directory for KV_MAP_HUGETLB, /dev/hugepages if NULL
+    const char *walPath;                                // write-ahead log making the store durable, none if NULL
+    int hashFunction;                                   // KV_HASH_* function placing keys in pods
+    uint64_t hashSeed;                                  // seed for it; pick a random one against adversarial keys
+    int evictionPolicy;                                 // KV_EVICT_* policy choosing which entry a full pod drops
+    int placement;                                      // KV_PLACE_* rule choosing the pod of a new key
+    int compressAbove;                                  // compress values longer than this many bytes, 0 never
+    int orderedIndex;                                   // 1 keeps the per-pod skiplists behind fast scans
+} kvOptions;
+
+typedef struct {
+    size_t pageSize;                                    // effective page size backing the store
+    size_t hugeMappedBytes;                             // bytes of the store currently mapped by huge pages
+    size_t totalSize;                                   // bytes of the whole store
+    size_t arenaUsed;                                   // bytes of the value arena handed out so far
+    int mapFlags;                                       // KV_MAP_* flags this process mapped the store with
+    int pods;
+    int slotsPerPod;
+    int hashFunction;                                   // KV_HASH_* function of the store
+    uint64_t hashSeed;
+    int placement;                                      // KV_PLACE_* rule of the store
+    int compressAbove;                                  // values longer than this are compressed, 0 never
+    int orderedIndex;                                   // 1 if the store keeps the skiplists behind scans
+    int generation;                                     // times the store was grown
+    int growing;                                        // 1 while entries are being moved to the newest table
+} kvStats;
+
+// Occupancy of one pod, for spotting hot pods (kv_stat). A full pod evicts its oldest entry on every write.
+typedef struct {
+    int live;                                           // slots holding a value
+    int distinctKeys;                                   // different keys among them
+    int chains;                                         // non-empty index chains
+    int longestChain;                                   // entries in the longest index chain
+} kvPodStats;
 
 int kv_store_create(char *name);
+int kv_store_create_with(char *name, const kvOptions *options);
+int kv_store_stats(kvStats *stats);
+int kv_store_pod_stats(int podNum, kvPodStats *stats);
+
+// Online resize. kv_store_grow() gives the store a new table with more pods and/or slots and carries the
+// entries over to it pod by pod while other processes keep reading and writing. Until a pod was moved its keys
+// are still read from the old table; a write to one of them moves its pod first. Attached processes pick up the
+// new table on their next operation. The old table's memory is released once every pod was moved and no
+// operation that started before that is still under way. If an entry does not fit into the new table, the grow
+// stops and returns -1 with the old table still in use: writes to the keys of a pod that was not moved fail until
+// it can be, and the next kv_store_grow(), kv_store_snapshot() or kv_store_restore() tries to finish the grow. The
+// hash function, seed, key size, eviction policy and placement stay those of the store.
+int kv_store_grow(int pods, int slotsPerPod);
+
 int kv_store_write(char *key, char *value);
+
+// Expiry. kv_store_write_ttl() writes an entry that stops being returned ttl seconds later (0 never expires).
+// Expired entries are skipped by every lookup straight away; kv_store_expire() reclaims a pod's expired slots and
+// kv_store_sweeper_start() runs a thread doing that for every pod each intervalMs, one pod lock at a time.
+int kv_store_write_ttl(char *key, char *value, unsigned int ttl);
+int kv_store_expire(int podNum);
+int kv_store_sweeper_start(int intervalMs);
+void kv_store_sweeper_stop(void);
+
 char *kv_store_read(char *key);
 char **kv_store_read_all(char *key);
+int kv_store_write_batch(char **keys, char **values, int count);
+char **kv_store_read_batch(char **keys, int count);
+int kv_store_read_lease(char *key, kvLease *lease);
+int kv_store_lease_valid(kvLease *lease);
+void kv_store_lease_release(kvLease *lease);
+
+// Change notification. Versions are per pod: kv_store_version() returns the current version of key's pod and
+// kv_store_watch() sleeps on a futex until it differs from lastVersion, returning the new version, or returns
+// lastVersion once timeoutMs passes (-1 waits forever). Writes to other keys of the same pod also wake watchers,
+// so callers re-read the key and watch again with the version they got.
+unsigned int kv_store_version(char *key);
+unsigned int kv_store_watch(char *key, unsigned int lastVersion, int timeoutMs);
+
+int kv_store_read_all_into(char *key, char *buffer, size_t bufferSize, size_t *needed);
+int kv_store_read_all_each(char *key, int (*callback)(const char *value, size_t length, void *arg), void *arg);
+int kv_store_scan_prefix(kvScan *scan, const char *prefix);
+int kv_store_scan_range(kvScan *scan, const char *from, const char *to);
+int kv_store_scan_next(kvScan *scan, char **keys, int maxKeys);
+void kv_store_scan_close(kvScan *scan);
+int kv_store_snapshot(const char *path);
+int kv_store_restore(const char *path);
+int kv_store_snapshot_begin(kvSnapshotHandle *snapshot);
+int kv_store_snapshot_read_all(const kvSnapshotHandle *snapshot, char *key, char ***values);
 int kv_delete_db(void);
+int kv_store_read_mode(int mode);
+int kv_store_lookup_mode(int mode);
 unsigned long hash(const char *str);
 
 #define DATA_BASE_NAME "my_database"
 
+// Default geometry used by kv_store_create()
 #define keySize 32
-#define valueSize 256
-#define keyValuePairSize (keySize + valueSize)          // (keySize + valueSize)
+#define valueSize 256                                   // typical value budget, used to size the value arena
 
 #define numberOfPods 256                                // number of pods within the KV-Store
 #define podSize 256                                     // number of KV-Pairs per pod
 #define maxKeyValuePairs (numberOfPods * podSize)       // (numberOfPods * podSize)
 
+// Each pod keeps a small chained hash index from key to slots (one chain per slot) so lookups do not sweep
+// the whole pod.
+#define noSlot -1                                       // empty chain / unused slot marker
+
+// The ordered index is a skiplist per pod linking slots by number: kvSkipLevels links per slot, a slot's height
+// taken from its number with a 1 in 4 chance of each extra level.
+#define kvSkipLevels 8
+#define kvScanMaxBatch 1024
+
+// Lookup strategies for kv_store_lookup_mode(): the per-pod index, a SIMD scan of the per-slot 1-byte
+// fingerprints (only candidates get a full key compare), or the plain linear scan of every slot.
+#define KV_LOOKUP_INDEX 0
+#define KV_LOOKUP_FINGERPRINT 1
+#define KV_LOOKUP_SCAN 2
+
+// Read modes for kv_store_read_mode(). Optimistic reads (the default) take no lock: they copy the slot and retry
+// if the pod's sequence counter moved, falling back to the pod lock after kvSeqMaxRetries attempts.
+#define KV_READ_LOCKED 0
+#define KV_READ_OPTIMISTIC 1
+#define kvSeqMaxRetries 64
+
+// Pod locks are robust process-shared mutexes: a lock whose owner died is handed to the next process, which
+// repairs the pod first. On machines with more than one CPU a contended lock is retried up to kvLockSpins times,
+// with growing pauses, before the process sleeps on it.
+#define kvLockSpins 100
+
+// Every operation under way holds one of kvMaxUsers slots in the root header, naming the oldest table it may
+// touch. After the last pod of a grow was moved, the old table is only released once no slot names it any more;
+// slots of processes that died are cleared then. Operations beyond that many wait for a slot to free up.
+#define kvMaxUsers 256
+
+typedef struct {
+    uint64_t user;                                      // pid << 32 | oldest generation it may touch + 1, 0 if free
+} __attribute__((aligned(64))) kvUser;
+
+// Values live out of line in a shared arena carved into size-class chunks: 16 byte steps up to 512 bytes,
+// then coarser classes up to maxChunkSize. Each pod recycles the chunks of the values it overwrites. A compressed
+// value keeps its compressed bytes in data and its original length in rawLength.
+#define valueClasses 38
+#define maxChunkSize 4096
+#define maxValueSize (maxChunkSize - sizeof(kvValue) - 1)  // longest storable value, not counting the NUL
+#define arenaStart 8                                    // first chunk offset, 0 means no value
+
 typedef struct {
-    char key[keySize];
-    char value[valueSize];
-} kvPair;
+    uint32_t length;                                    // bytes of data, not counting the terminating NUL
+    uint16_t sizeClass;                                 // size class of the chunk holding it
+    uint16_t rawLength;                                 // length before compression, 0 if stored as is
+    char data[];                                        // the value itself, NUL terminated
+} kvValue;
 
+// A pod's write-side book keeping, padded to whole cache lines so writers of neighbouring pods never invalidate
+// each other's lines.
 typedef struct {
-    int podNums[numberOfPods];
-    int podSlots[podSize];
-    int readCounter;
+    pthread_mutex_t lock;                               // robust, see kvLockSpins
+    unsigned int seq;                                   // odd while a writer is active
+    int nextSlot;                                       // next slot to write, i.e. the oldest entry
+    int writingSlot;                                    // slot the write in progress changes, noSlot if none
+    unsigned int watchers;                              // processes sleeping in kv_store_watch() on seq
+    int ttlEntries;                                     // slots holding an entry written with a TTL
+    int migrated;                                       // entries were moved to the next table by kv_store_grow()
+    int migratedSlots;                                  // slots already copied by a move that could not finish
+    int live;                                           // slots holding a value, for two-choice placement
+    uint32_t freeChunks[valueClasses];                  // free list head of each size class
+} __attribute__((aligned(64))) kvPodMeta;
+
+// The shared memory object starts with this header. It records the geometry and where every region lives, so
+// attaching processes can map the store without knowing how it was created. Every region starts on a cache
+// line. A slot's key (keySize bytes rounded up to 8) and the 32-bit arena offset of its value (0 if empty) live
+// in two separate arrays, so key scans only touch keys. A grown store is a chain of such tables: generation 0 is
+// the object the store was created as (the root, whose header every process starts from) and generation g is
+// "<name>.<g>".
+#define kvStoreMagic 0x6b765354                         // "kvST"
+#define kvLayoutVersion 19
+
+typedef struct {
+    uint32_t magic;
+    uint32_t layoutVersion;
+    kvGeometry geometry;
+    int hashFunction;                                   // KV_HASH_* function placing keys in pods
+    uint64_t hashSeed;
+    int evictionPolicy;                                 // KV_EVICT_* policy
+    int placement;                                      // KV_PLACE_* rule
+    int compressAbove;                                  // values longer than this are compressed, 0 never
+    int orderedIndex;                                   // 1 if the skip regions below are kept
+    uint64_t totalSize;                                 // bytes of the whole shared memory object
+    uint64_t arenaSize;                                 // reserved (sparse) bytes for values
+    uint64_t keyStride;                                 // bytes per key
+    uint64_t podMetaOffset;                             // kvPodMeta[numberOfPods]
+    uint64_t indexHeadsOffset;                          // short[numberOfPods][podSize], first slot of each chain
+    uint64_t slotNextOffset;                            // short[numberOfPods][podSize], next slot in the chain
+    uint64_t slotPrevOffset;                            // short[numberOfPods][podSize], previous slot in the chain
+    uint64_t slotBucketsOffset;                         // short[numberOfPods][podSize], chain of a slot or noSlot
+    uint64_t slotPrintsOffset;                          // unsigned char[numberOfPods][podSize], 0 if empty
+    uint64_t keysOffset;                                // char[numberOfPods][podSize][keyStride], the keys
+    uint64_t valueOffsetsOffset;                        // uint32_t[numberOfPods][podSize], arena offset of each value
+    uint64_t slotExpiryOffset;                          // uint32_t[numberOfPods][podSize], expiry second or 0
+    uint64_t slotAccessOffset;                          // uint32_t[numberOfPods][podSize], CLOCK bit or LRU stamp
+    uint64_t skipHeadsOffset;                           // short[numberOfPods][kvSkipLevels], first slot of each level
+    uint64_t skipNextOffset;                            // short[numberOfPods][podSize][kvSkipLevels], next slots
+    uint64_t skipPrevOffset;                            // short[numberOfPods][podSize], previous slot on the bottom level
+    uint64_t slotVersionsOffset;                        // uint64_t[numberOfPods][podSize], write version or 0
+    uint64_t dropVersionsOffset;                        // uint64_t[numberOfPods][podSize], last eviction per chain
+    uint64_t arenaOffset;                               // the value arena
+    uint64_t arenaTop;                                  // next never-used byte of the arena
+    uint32_t epoch;                                     // root table only: 2 * generation, minus 1 while growing
+    char walPath[PATH_MAX];                             // write-ahead log of a durable store, empty if none
+    pthread_mutex_t walLock;                            // serializes appends to the log
+    pthread_mutex_t growLock;                           // root table only: robust, one grow at a time
+    pthread_cond_t walFlushedCond;                      // broadcast whenever walFlushed moves
+    uint64_t walAppended;                               // bytes of log written so far
+    uint64_t walFlushed;                                // bytes of log known to be on disk
+    uint64_t walBase;                                   // log position of the first byte of the log file
+    uint64_t walCheckpointBase;                         // walBase once the checkpoint under way renamed its log
+    uint32_t walGeneration;                             // bumped whenever a checkpoint replaced the log file
+    int walCheckpointing;                               // a checkpoint is about to rename its log over the log
+    int walFlushing;                                    // a writer is running fdatasync for the group
     int initialized;
+    uint64_t writeVersion __attribute__((aligned(64))); // root table only: version of the latest write, on its own
+                                                        // line since every write bumps it
+    kvUser users[kvMaxUsers];                           // root table only: operations under way, see kvMaxUsers
 } kvStore;
 
+// Snapshot files start with a kvSnapshotHeader, followed by one kvSnapshotPod record per pod and its payload:
+// the pod's entries, oldest first, as [u16 key length][key][u32 value length][value][u32 expiry second or 0].
+// Every record carries a CRC-32 of itself and its payload. Snapshots are written to "<path>.tmp" and renamed over
+// path once flushed. kv_store_restore() returns -1 if entries did not fit into the store, e.g. one whose arena is
+// too small for the snapshot's values, and creating a durable store fails if the writes of its log do not fit.
+#define kvSnapshotMagic 0x6b76534e                      // "kvSN"
+#define kvSnapshotVersion 2
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    kvGeometry geometry;                                // geometry of the store the snapshot was taken from
+    uint32_t pods;                                      // number of pod records that follow
+    uint32_t crc;                                       // CRC-32 of the fields above
+} kvSnapshotHeader;
+
+typedef struct {
+    uint32_t podNum;
+    uint32_t entries;
+    uint32_t payloadBytes;
+    uint32_t crc;                                       // CRC-32 of the fields above and the payload
+} kvSnapshotPod;
+
+// Durable stores append every write to their log as a kvWalRecord followed by the key and the value (no NULs),
+// and only return once an fdatasync covering the record finished. Writers waiting at the same time share one
+// fdatasync (group commit). Creating a store whose log already holds records replays them into the new store;
+// replay stops at the first torn or damaged record and cuts the log there. kv_store_snapshot() of a durable store
+// checkpoints the log: it is replaced by a checkpoint record, whose value is the snapshot's absolute path,
+// followed by the records written since the snapshot started copying pods, and replay restores the snapshot first.
+#define kvWalCheckpoint UINT32_MAX                      // keyLength of a checkpoint record
+
+typedef struct {
+    uint32_t crc;                                       // CRC-32 of the fields below, the key and the value
+    uint32_t keyLength;
+    uint32_t valueLength;
+    uint32_t expiry;                                    // wall clock second the entry expires at, 0 for never
+} kvWalRecord;
+
 #endif /* a2_lib_h */
@@ -0,0 +1,172 @@
+//
+//  a2_lz.c
+//  ECSE427-Assignment2
+//
+//  The codec of values stored compressed (see kvOptions.compressAbove): a self-contained LZ4 block compressor and
+//  a decompressor safe to run on bytes a writer may be changing.
+//
+
+#include "a2_internal.h"
+
+// Values are compressed in the LZ4 block format: a sequence of [token][literals][16-bit match offset], where the
+// token's high nibble is the literal count and its low one the match length minus lzMinMatch, each extended by
+// bytes of 255 when it is 15. The last sequence only carries literals. Values are at most maxValueSize bytes, so
+// every offset fits and positions fit the 16-bit match table.
+#define lzMinMatch 4
+#define lzHashBits 12
+
+static uint32_t lz_read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t lz_read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Copies length bytes eight at a time, so it may write up to 7 bytes past to + length and read as far past from.
+// The two may overlap as long as from is at least 8 bytes behind to.
+static void lz_copy8(char *to, const char *from, size_t length) {
+    for (size_t i = 0; i < length; i += 8) {
+        memcpy(to + i, from + i, 8);
+    }
+}
+
+static void lz_put_length(unsigned char *out, size_t *used, size_t length) {
+    for (length -= 15; length >= 255; length -= 255) {
+        out[(*used)++] = 255;
+    }
+    out[(*used)++] = length;
+}
+
+// Appends one sequence to out. Returns -1 once it would not fit in capacity bytes.
+static int lz_put_sequence(unsigned char *out, size_t capacity, size_t *used, const unsigned char *literals,
+                           size_t literalCount, size_t offset, size_t matchLength) {
+    size_t extra = matchLength > 0 ? matchLength - lzMinMatch : 0;
+    
+    if (*used + literalCount + literalCount / 255 + extra / 255 + 5 > capacity) {
+        return -1;
+    }
+    out[(*used)++] = (literalCount < 15 ? literalCount : 15) << 4 | (extra < 15 ? extra : 15);
+    if (literalCount >= 15) {
+        lz_put_length(out, used, literalCount);
+    }
+    memcpy(out + *used, literals, literalCount);
+    *used += literalCount;
+    if (matchLength > 0) {
+        out[(*used)++] = offset & 0xff;
+        out[(*used)++] = offset >> 8;
+        if (extra >= 15) {
+            lz_put_length(out, used, extra);
+        }
+    }
+    return 0;
+}
+
+// Compresses length bytes of in into out with greedy hash-table matching. Returns the compressed length, or 0 if
+// it would not come out shorter than capacity bytes. Runs of unmatched bytes are skipped over faster and faster,
+// so incompressible values give up quickly.
+size_t lz_compress(const unsigned char *in, size_t length, unsigned char *out, size_t capacity) {
+    uint16_t table[1 << lzHashBits];
+    size_t anchor = 0, pos = 0, used = 0;
+    
+    memset(table, 0, sizeof(table));
+    while (pos + lzMinMatch <= length) {
+        uint32_t word = lz_read32(in + pos);
+        uint32_t bucket = (word * 2654435761u) >> (32 - lzHashBits);
+        size_t candidate = table[bucket];
+        
+        table[bucket] = pos;
+        if (candidate >= pos || lz_read32(in + candidate) != word) {
+            pos += 1 + ((pos - anchor) >> 5);
+            continue;
+        }
+        size_t matchLength = lzMinMatch;
+        while (pos + matchLength + 8 <= length && lz_read64(in + candidate + matchLength) == lz_read64(in + pos + matchLength)) {
+            matchLength += 8;
+        }
+        while (pos + matchLength < length && in[candidate + matchLength] == in[pos + matchLength]) {
+            matchLength++;
+        }
+        if (lz_put_sequence(out, capacity, &used, in + anchor, pos - anchor, pos - candidate, matchLength) < 0) {
+            return 0;
+        }
+        pos += matchLength;
+        anchor = pos;
+    }
+    if (lz_put_sequence(out, capacity, &used, in + anchor, length - anchor, 0, 0) < 0 || used >= capacity) {
+        return 0;
+    }
+    return used;
+}
+
+static int lz_get_length(const unsigned char *in, size_t length, size_t *pos, size_t *value) {
+    unsigned char next;
+    do {
+        if (*pos >= length) {
+            return -1;
+        }
+        next = in[(*pos)++];
+        *value += next;
+    } while (next == 255);
+    return 0;
+}
+
+// Expands a block written by lz_compress() into out. Every length and offset is checked, since optimistic readers
+// may hand it a chunk being overwritten. Returns the expanded length, or -1 if the block is not a valid one
+// expanding to at most capacity bytes.
+long lz_decompress(const unsigned char *in, size_t length, char *out, size_t capacity) {
+    size_t pos = 0, used = 0;
+    
+    while (pos < length) {
+        unsigned char token = in[pos++];
+        size_t literalCount = token >> 4;
+        if (literalCount == 15 && lz_get_length(in, length, &pos, &literalCount) < 0) {
+            return -1;
+        }
+        if (literalCount > length - pos || literalCount > capacity - used) {
+            return -1;
+        }
+        if (literalCount <= 16 && pos + 16 <= length && used + 16 <= capacity) {
+            memcpy(out + used, in + pos, 16);
+        } else if (pos + literalCount + 8 <= length && used + literalCount + 8 <= capacity) {
+            lz_copy8(out + used, (const char *) in + pos, literalCount);
+        } else {
+            memcpy(out + used, in + pos, literalCount);
+        }
+        pos += literalCount;
+        used += literalCount;
+        if (pos == length) {
+            break;
+        }
+        
+        if (length - pos < 2) {
+            return -1;
+        }
+        size_t offset = in[pos] | in[pos + 1] << 8;
+        size_t matchLength = token & 15;
+        pos += 2;
+        if (matchLength == 15 && lz_get_length(in, length, &pos, &matchLength) < 0) {
+            return -1;
+        }
+        matchLength += lzMinMatch;
+        if (offset == 0 || offset > used || matchLength > capacity - used) {
+            return -1;
+        }
+        // A match may overlap the bytes it produces, which repeats them
+        if (offset >= 8 && used + matchLength + 8 <= capacity) {
+            lz_copy8(out + used, out + used - offset, matchLength);
+        } else if (offset >= matchLength) {
+            memcpy(out + used, out + used - offset, matchLength);
+        } else {
+            for (size_t i = 0; i < matchLength; i++) {
+                out[used + i] = out[used + i - offset];
+            }
+        }
+        used += matchLength;
+    }
+    return used;
+}
@@ -0,0 +1,614 @@
+//
+//  a2_persist.c
+//  ECSE427-Assignment2
+//
+//  Durability of the store: the write-ahead log of a durable store (appends, group commit, replay on creation and
+//  checkpoints) and snapshot files (kv_store_snapshot() and kv_store_restore()). The pods themselves are written
+//  through a2_lib.c.
+//
+
+#define _GNU_SOURCE
+#include "a2_internal.h"
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+
+int walFd = -1;                                         // this process's descriptor of the store's log
+static uint32_t walGeneration;                          // the log file walFd refers to, see kvStore.walGeneration
+
+// Bitwise CRC-32 (IEEE), table driven. Used to checksum snapshot files.
+uint32_t crc32_update(uint32_t crc, const void *data, size_t length) {
+    static uint32_t table[256];
+    const unsigned char *bytes = data;
+    
+    if (table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc = table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Appends the log record of one write to *buffer, growing it as needed. Returns the new length of the buffer.
+size_t wal_encode(char **buffer, size_t used, size_t *capacity, char *key, char *value, uint32_t expiry) {
+    kvWalRecord record;
+    
+    record.expiry = expiry;
+    record.keyLength = strnlen(key, layout->keyBytes);
+    record.valueLength = strlen(value);
+    size_t length = sizeof(record) + record.keyLength + record.valueLength;
+    while (used + length > *capacity) {
+        *capacity = *capacity > 0 ? *capacity * 2 : 4096;
+        *buffer = realloc(*buffer, *capacity);
+    }
+    
+    char *out = *buffer + used;
+    memcpy(out + sizeof(record), key, record.keyLength);
+    memcpy(out + sizeof(record) + record.keyLength, value, record.valueLength);
+    record.crc = crc32_update(0, &record.keyLength, sizeof(record) - offsetof(kvWalRecord, keyLength));
+    record.crc = crc32_update(record.crc, out + sizeof(record), record.keyLength + record.valueLength);
+    memcpy(out, &record, sizeof(record));
+    return used + length;
+}
+
+// Makes the log file a checkpoint renamed into place the current one. Every record appended so far is in it and
+// flushed. Called with the log lock held.
+static void wal_switch(uint64_t base) {
+    kvStore *kvStoreInfo = (kvStore *)kvStoreInfoAddr;
+    
+    kvStoreInfo->walBase = base;
+    kvStoreInfo->walFlushed = kvStoreInfo->walAppended;
+    kvStoreInfo->walGeneration++;
+    pthread_cond_broadcast(&kvStoreInfo->walFlushedCond);
+}
+
+// The log positions only ever move forward after the bytes they cover were written, so a process dying with the
+// log lock held leaves nothing to repair, except for a checkpoint: whether it got to rename its log into place is
+// told by its temporary file being gone. A process whose walFd still refers to a log file a checkpoint replaced
+// reopens it, onto the same descriptor so other threads never see it closed.
+static void wal_lock(void) {
+    kvStore *kvStoreInfo = (kvStore *)kvStoreInfoAddr;
+    
+    if (pthread_mutex_lock(&kvStoreInfo->walLock) == EOWNERDEAD) {
+        if (kvStoreInfo->walCheckpointing) {
+            char tempPath[PATH_MAX + 4];
+            snprintf(tempPath, sizeof(tempPath), "%s.tmp", kvStoreInfo->walPath);
+            if (unlink(tempPath) < 0 && errno == ENOENT) {
+                wal_switch(kvStoreInfo->walCheckpointBase);
+            }
+            kvStoreInfo->walCheckpointing = 0;
+        }
+        pthread_mutex_consistent(&kvStoreInfo->walLock);
+    }
+    if (walGeneration != kvStoreInfo->walGeneration) {
+        int fd = open(kvStoreInfo->walPath, O_RDWR);
+        if (fd >= 0 && dup2(fd, walFd) >= 0) {
+            walGeneration = kvStoreInfo->walGeneration;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+// Writes encoded records to the end of the log and returns the log position just past them, 0 on failure.
+// Called with the pod write lock held, so the log sees each pod's writes in the order they were applied.
+uint64_t wal_append(const char *buffer, size_t length) {
+    kvStore *kvStoreInfo = (kvStore *)kvStoreInfoAddr;
+    
+    wal_lock();
+    uint64_t offset = kvStoreInfo->walAppended;
+    size_t written = 0;
+    while (written < length) {
+        ssize_t n = pwrite(walFd, buffer + written, length - written, offset - kvStoreInfo->walBase + written);
+        if (n < 0) {
+            perror("Could not append to log");
+            pthread_mutex_unlock(&kvStoreInfo->walLock);
+            return 0;
+        }
+        written += n;
+    }
+    kvStoreInfo->walAppended = offset + length;
+    pthread_mutex_unlock(&kvStoreInfo->walLock);
+    
+    return offset + length;
+}
+
+// Waits until the log is on disk up to position lsn. The first waiter to find no flush running becomes the
+// flusher: a single fdatasync then covers every record appended so far, including those of writers that queued
+// up behind it. Called without any pod lock held.
+int wal_commit(uint64_t lsn) {
+    kvStore *kvStoreInfo = (kvStore *)kvStoreInfoAddr;
+    int result = 0;
+    
+    wal_lock();
+    while (kvStoreInfo->walFlushed < lsn) {
+        if (!kvStoreInfo->walFlushing) {
+            uint64_t target = kvStoreInfo->walAppended;
+            kvStoreInfo->walFlushing = 1;
+            pthread_mutex_unlock(&kvStoreInfo->walLock);
+            
+            int synced = fdatasync(walFd);
+            
+            wal_lock();
+            kvStoreInfo->walFlushing = 0;
+            if (synced == 0 && target > kvStoreInfo->walFlushed) {
+                kvStoreInfo->walFlushed = target;
+            }
+            pthread_cond_broadcast(&kvStoreInfo->walFlushedCond);
+            if (synced < 0) {
+                perror("Could not flush log");
+                result = -1;
+                break;
+            }
+        } else {
+            // The flusher may have died before it could wake anybody; flushing again is always safe
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 100 * 1000 * 1000;
+            if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000 * 1000 * 1000;
+            }
+            int waited = pthread_cond_timedwait(&kvStoreInfo->walFlushedCond, &kvStoreInfo->walLock, &deadline);
+            if (waited == EOWNERDEAD) {
+                pthread_mutex_consistent(&kvStoreInfo->walLock);
+            }
+            if (waited == ETIMEDOUT || waited == EOWNERDEAD) {
+                kvStoreInfo->walFlushing = 0;
+            }
+        }
+    }
+    pthread_mutex_unlock(&kvStoreInfo->walLock);
+    return result;
+}
+
+// Logs a single write. Must be called with the pod write lock held; returns the position to wal_commit().
+uint64_t wal_log(char *key, char *value, uint32_t expiry) {
+    char *buffer = NULL;
+    size_t capacity = 0;
+    size_t length = wal_encode(&buffer, 0, &capacity, key, value, expiry);
+    uint64_t lsn = wal_append(buffer, length);
+    free(buffer);
+    return lsn;
+}
+
+// Applies every intact record of the log to the (new) store and cuts off a torn tail, so appends continue right
+// after the last good record.
+static int wal_replay(void) {
+    kvStore *kvStoreInfo = (kvStore *)kvStoreInfoAddr;
+    struct stat info;
+    size_t offset = 0;
+    char *file = NULL;
+    
+    fstat(walFd, &info);
+    if (info.st_size > 0) {
+        file = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, walFd, 0);
+        if (file == MAP_FAILED) {
+            perror("Could not map log");
+            return -1;
+        }
+        madvise(file, info.st_size, MADV_SEQUENTIAL);
+    }
+    
+    char *key = malloc(layout->keyBytes + 1);
+    int result = 0;
+    long dropped = 0;
+    while (offset + sizeof(kvWalRecord) <= (size_t) info.st_size) {
+        kvWalRecord record;
+        memcpy(&record, file + offset, sizeof(record));
+        int checkpoint = offset == 0 && record.keyLength == kvWalCheckpoint;
+        size_t keyLength = checkpoint ? 0 : record.keyLength;
+        size_t length = sizeof(record) + keyLength + record.valueLength;
+        if ((checkpoint ? record.valueLength >= PATH_MAX : keyLength > (size_t) layout->keyBytes)
+            || offset + length > (size_t) info.st_size) {
+            break;
+        }
+        const char *data = file + offset + sizeof(record);
+        uint32_t crc = crc32_update(0, &record.keyLength, sizeof(record) - offsetof(kvWalRecord, keyLength));
+        if (crc32_update(crc, data, keyLength + record.valueLength) != record.crc) {
+            break;
+        }
+        
+        if (checkpoint) {
+            // The snapshot holds every write logged before it, and is restored without logging them again
+            char *path = strndup(data, record.valueLength);
+            int fd = walFd;
+            walFd = -1;
+            result = kv_store_restore(path);
+            walFd = fd;
+            if (result < 0) {
+                fprintf(stderr, "Log %s: could not restore its checkpoint %s\n", kvStoreInfo->walPath, path);
+            }
+            free(path);
+            if (result < 0) {
+                break;
+            }
+            offset += length;
+            continue;
+        }
+        
+        memset(key, 0, layout->keyBytes + 1);
+        memcpy(key, data, record.keyLength);
+        char *value = strndup(data + record.keyLength, record.valueLength);
+        unsigned long keyHash = key_hash(key);
+        unsigned long podNum = pod_place(keyHash, key);
+        dropped += pod_insert(podNum, keyHash, key, value, record.expiry, 0) < 0;
+        pod_unlock(podNum);
+        free(value);
+        
+        offset += length;
+    }
+    free(key);
+    if (file != NULL) {
+        munmap(file, info.st_size);
+    }
+    if (result < 0) {
+        return -1;
+    }
+    // A store too small for what its log holds would silently lose acknowledged writes
+    if (dropped > 0) {
+        fprintf(stderr, "Log %s: %ld logged writes do not fit into the store\n", kvStoreInfo->walPath, dropped);
+        return -1;
+    }
+    
+    if (offset < (size_t) info.st_size) {
+        fprintf(stderr, "Log %s: dropped %zu bytes of torn or damaged records\n", kvStoreInfo->walPath,
+                (size_t) info.st_size - offset);
+        if (ftruncate(walFd, offset) < 0 || fdatasync(walFd) < 0) {
+            perror("Could not cut log");
+            return -1;
+        }
+    }
+    kvStoreInfo->walAppended = offset;
+    kvStoreInfo->walFlushed = offset;
+    kvStoreInfo->walBase = 0;
+    return 0;
+}
+
+// Opens the store's log in this process, replaying it first when the store was just created.
+int wal_attach(int recover) {
+    kvStore *kvStoreInfo = (kvStore *)kvStoreInfoAddr;
+    
+    walGeneration = kvStoreInfo->walGeneration;
+    walFd = open(kvStoreInfo->walPath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    if (walFd < 0) {
+        perror("Could not open log");
+        return -1;
+    }
+    return recover ? wal_replay() : 0;
+}
+
+static int write_fully(int fd, const void *data, size_t length) {
+    const char *bytes = data;
+    while (length > 0) {
+        ssize_t written = write(fd, bytes, length);
+        if (written < 0) {
+            return -1;
+        }
+        bytes += written;
+        length -= written;
+    }
+    return 0;
+}
+
+// Makes a rename into path's directory durable.
+static void fsync_parent(const char *path) {
+    char dir[PATH_MAX];
+    strncpy(dir, path, sizeof(dir) - 1);
+    dir[sizeof(dir) - 1] = '\0';
+    char *slash = strrchr(dir, '/');
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else if (slash == dir) {
+        dir[1] = '\0';
+    } else {
+        *slash = '\0';
+    }
+    int dirFd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (dirFd >= 0) {
+        fsync(dirFd);
+        close(dirFd);
+    }
+}
+
+// Replaces the log by a checkpoint record naming the snapshot at path, which holds every write logged before log
+// position cut, followed by the records logged since. The new log is written next to the old one and renamed over
+// it, so a crash leaves one or the other in place; appends wait for the log lock meanwhile.
+static int wal_checkpoint(const char *path, uint64_t cut) {
+    kvStore *kvStoreInfo = (kvStore *)kvStoreInfoAddr;
+    char snapshotPath[PATH_MAX];
+    char tempPath[PATH_MAX + 4];
+    
+    if (realpath(path, snapshotPath) == NULL) {
+        perror("Could not resolve snapshot path");
+        return -1;
+    }
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", kvStoreInfo->walPath);
+    
+    wal_lock();
+    kvWalRecord record = { 0, kvWalCheckpoint, strlen(snapshotPath), 0 };
+    record.crc = crc32_update(0, &record.keyLength, sizeof(record) - offsetof(kvWalRecord, keyLength));
+    record.crc = crc32_update(record.crc, snapshotPath, record.valueLength);
+    size_t headLength = sizeof(record) + record.valueLength;
+    size_t tailLength = kvStoreInfo->walAppended - cut;
+    char *log = malloc(headLength + tailLength);
+    memcpy(log, &record, sizeof(record));
+    memcpy(log + sizeof(record), snapshotPath, record.valueLength);
+    
+    int failed = pread(walFd, log + headLength, tailLength, cut - kvStoreInfo->walBase) != (ssize_t) tailLength;
+    int fd = failed ? -1 : open(tempPath, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+    failed = fd < 0 || write_fully(fd, log, headLength + tailLength) || fsync(fd) < 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!failed) {
+        kvStoreInfo->walCheckpointBase = kvStoreInfo->walAppended - (headLength + tailLength);
+        kvStoreInfo->walCheckpointing = 1;
+        failed = rename(tempPath, kvStoreInfo->walPath) < 0;
+        if (!failed) {
+            wal_switch(kvStoreInfo->walCheckpointBase);
+        }
+        kvStoreInfo->walCheckpointing = 0;
+    }
+    if (failed) {
+        perror("Could not checkpoint log");
+        unlink(tempPath);
+    }
+    pthread_mutex_unlock(&kvStoreInfo->walLock);
+    free(log);
+    
+    if (!failed) {
+        fsync_parent(kvStoreInfo->walPath);
+    }
+    return failed ? -1 : 0;
+}
+
+int kv_store_snapshot(const char *path) {
+    
+    char tempPath[PATH_MAX];
+    kvSnapshotHeader header;
+    
+    // Every entry is in one table once a grow under way finished
+    if (store_finish_grow() < 0) {
+        return -1;
+    }
+    int pinned __attribute__((cleanup(store_unpin))) = store_pin();
+    
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+    int fd = open(tempPath, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        perror("Could not create snapshot");
+        return -1;
+    }
+    
+    memset(&header, 0, sizeof(header));
+    header.magic = kvSnapshotMagic;
+    header.version = kvSnapshotVersion;
+    header.geometry = ((kvStore *)layout->base)->geometry;
+    header.pods = layout->pods;
+    header.crc = crc32_update(0, &header, offsetof(kvSnapshotHeader, crc));
+    int failed = write_fully(fd, &header, sizeof(header));
+    
+    // Each pod is copied out under its read lock, so writers only ever wait for one pod's memcpy; the file
+    // write happens after the lock is dropped. A durable store first fences the log position the log is cut at:
+    // every write logged before it was made under its pod's lock, so it is in the pod by the time that pod is
+    // copied. Writes logged after it may or may not be copied; replaying them over the snapshot is harmless.
+    uint64_t cut = 0;
+    if (walFd >= 0) {
+        wal_lock();
+        cut = ((kvStore *)kvStoreInfoAddr)->walAppended;
+        pthread_mutex_unlock(&((kvStore *)kvStoreInfoAddr)->walLock);
+    }
+    for (int podNum = 0; podNum < layout->pods; podNum++) {
+        kvSnapshotPod record;
+        char *payload = NULL;
+        size_t payloadBytes;
+        
+        memset(&record, 0, sizeof(record));
+        pod_read_lock(podNum);
+        record.entries = pod_serialize(podNum, &payload, &payloadBytes);
+        pod_unlock(podNum);
+        record.payloadBytes = payloadBytes;
+        record.podNum = podNum;
+        record.crc = crc32_update(crc32_update(0, &record, offsetof(kvSnapshotPod, crc)), payload, record.payloadBytes);
+        failed = failed || write_fully(fd, &record, sizeof(record)) || write_fully(fd, payload, record.payloadBytes);
+        free(payload);
+    }
+    
+    // Only a completely written and flushed snapshot replaces the previous one
+    if (failed || fsync(fd) < 0) {
+        perror("Could not write snapshot");
+        close(fd);
+        unlink(tempPath);
+        return -1;
+    }
+    close(fd);
+    if (rename(tempPath, path) < 0) {
+        perror("Could not replace snapshot");
+        unlink(tempPath);
+        return -1;
+    }
+    
+    // Make the rename itself durable, then drop the log records the snapshot holds
+    fsync_parent(path);
+    return walFd >= 0 ? wal_checkpoint(path, cut) : 0;
+}
+
+// Parses the entry at *used in a pod record's payload and moves *used past it. Returns -1 if the entry runs past
+// payloadBytes or its value is longer than any the store holds.
+static int snapshot_entry(const char *payload, size_t payloadBytes, size_t *used, const char **key, uint16_t *keyLength,
+                          const char **value, uint32_t *valueLength, uint32_t *expiry) {
+    if (payloadBytes - *used < sizeof(*keyLength)) {
+        return -1;
+    }
+    memcpy(keyLength, payload + *used, sizeof(*keyLength));
+    *used += sizeof(*keyLength);
+    if (payloadBytes - *used < *keyLength + sizeof(*valueLength)) {
+        return -1;
+    }
+    *key = payload + *used;
+    *used += *keyLength;
+    memcpy(valueLength, payload + *used, sizeof(*valueLength));
+    *used += sizeof(*valueLength);
+    if (*valueLength > maxValueSize || payloadBytes - *used < *valueLength + sizeof(*expiry)) {
+        return -1;
+    }
+    *value = payload + *used;
+    *used += *valueLength;
+    memcpy(expiry, payload + *used, sizeof(*expiry));
+    *used += sizeof(*expiry);
+    return 0;
+}
+
+// Walks the pod records of a mapped snapshot. With apply set, the entries are written into the store, otherwise
+// the records are only checked against their checksums and lengths. Returns -1 on a damaged or truncated file,
+// or if entries did not fit into the store (the others are still restored).
+static int snapshot_walk(const char *file, size_t fileSize, int apply) {
+    const kvSnapshotHeader *header = (const kvSnapshotHeader *) file;
+    size_t offset = sizeof(kvSnapshotHeader);
+    long lockedPod = -1;
+    uint64_t lsn = 0;
+    long dropped = 0;
+    
+    for (uint32_t p = 0; p < header->pods; p++) {
+        kvSnapshotPod record;
+        if (offset + sizeof(record) > fileSize) {
+            return -1;
+        }
+        memcpy(&record, file + offset, sizeof(record));
+        offset += sizeof(record);
+        if (offset + record.payloadBytes > fileSize) {
+            return -1;
+        }
+        const char *payload = file + offset;
+        offset += record.payloadBytes;
+        
+        const char *entryKey;
+        const char *entryValue;
+        uint16_t keyLength;
+        uint32_t valueLength;
+        uint32_t expiry;
+        size_t used = 0;
+        
+        if (!apply) {
+            if (crc32_update(crc32_update(0, &record, offsetof(kvSnapshotPod, crc)), payload, record.payloadBytes) != record.crc) {
+                return -1;
+            }
+            // A record whose checksum matches can still describe entries longer than itself
+            for (uint32_t e = 0; e < record.entries; e++) {
+                if (snapshot_entry(payload, record.payloadBytes, &used, &entryKey, &keyLength, &entryValue, &valueLength,
+                                   &expiry) < 0) {
+                    return -1;
+                }
+            }
+            if (used != record.payloadBytes) {
+                return -1;
+            }
+            continue;
+        }
+        
+        // Entries are re-inserted oldest first, so every pod ends up in the same FIFO order as when it was saved
+        // even if the store has a different geometry. The target pod stays locked across consecutive entries.
+        for (uint32_t e = 0; e < record.entries; e++) {
+            char key[layout->keyBytes + 1];
+            
+            if (snapshot_entry(payload, record.payloadBytes, &used, &entryKey, &keyLength, &entryValue, &valueLength,
+                               &expiry) < 0) {
+                break;
+            }
+            memset(key, 0, layout->keyBytes + 1);
+            memcpy(key, entryKey, keyLength < layout->keyBytes ? keyLength : layout->keyBytes);
+            char *value = strndup(entryValue, valueLength);
+            
+            unsigned long keyHash = key_hash(key);
+            long podNum = keyHash % layout->pods;
+            if (podNum != lockedPod || layout->placement == KV_PLACE_TWO_CHOICE) {
+                // Under two-choice placement the pod depends on what is stored already, so every entry is placed
+                if (lockedPod >= 0) {
+                    pod_unlock(lockedPod);
+                }
+                podNum = pod_place(keyHash, key);
+                lockedPod = podNum;
+            }
+            if (pod_moved(podNum)) {
+                // Another process started growing the store; the entry is routed to the new table instead
+                pod_unlock(podNum);
+                lockedPod = -1;
+                kvLayout *table = layout;
+                dropped += store_write(key, value, expiry) < 0;
+                layout = table;
+                free(value);
+                continue;
+            }
+            if (pod_insert(podNum, keyHash, key, value, expiry, 0) < 0) {
+                dropped++;
+            } else if (walFd >= 0) {
+                lsn = wal_log(key, value, expiry);
+            }
+            free(value);
+        }
+    }
+    if (lockedPod >= 0) {
+        pod_unlock(lockedPod);
+    }
+    
+    // Restoring into a durable store is only done once the log holds every restored entry
+    int result = lsn > 0 ? wal_commit(lsn) : 0;
+    if (dropped > 0) {
+        fprintf(stderr, "Restore: %ld entries did not fit into the store\n", dropped);
+        result = -1;
+    }
+    return result;
+}
+
+int kv_store_restore(const char *path) {
+    
+    struct stat info;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Could not open snapshot");
+        return -1;
+    }
+    fstat(fd, &info);
+    if (info.st_size < (off_t) sizeof(kvSnapshotHeader)) {
+        fprintf(stderr, "%s is not a snapshot\n", path);
+        close(fd);
+        return -1;
+    }
+    
+    char *file = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        perror("Could not map snapshot");
+        return -1;
+    }
+    madvise(file, info.st_size, MADV_SEQUENTIAL);
+    
+    // Nothing is applied unless the whole file checks out, and then into a single table
+    if (store_finish_grow() < 0) {
+        munmap(file, info.st_size);
+        return -1;
+    }
+    int pinned __attribute__((cleanup(store_unpin))) = store_pin();
+    const kvSnapshotHeader *header = (const kvSnapshotHeader *) file;
+    int result = -1;
+    if (header->magic != kvSnapshotMagic || header->version != kvSnapshotVersion
+        || crc32_update(0, header, offsetof(kvSnapshotHeader, crc)) != header->crc
+        || snapshot_walk(file, info.st_size, 0) < 0) {
+        fprintf(stderr, "%s is damaged or not a snapshot\n", path);
+    } else {
+        result = snapshot_walk(file, info.st_size, 1);
+    }
+    
+    munmap(file, info.st_size);
+    return result;
+}
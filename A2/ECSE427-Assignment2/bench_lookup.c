@@ -0,0 +1,68 @@
+//
+//  bench_lookup.c
+//  ECSE427-Assignment2
+//
+//  Single-process microbenchmark of kv_store_read hit and miss latency for each lookup strategy:
+//  the original linear scan, the SIMD fingerprint scan and the per-pod hashed index.
+//
+//  Usage: ./os_bench_lookup [keys stored] [reads per measurement]
+//
+
+#include <time.h>
+#include "a2_lib.h"
+
+static double now_nanoseconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void make_key(char *key, const char *prefix, int i) {
+    memset(key, 0, keySize);
+    snprintf(key, keySize, "%s-%d", prefix, i);
+}
+
+// Average nanoseconds per kv_store_read over reads lookups of keys drawn from [0, keys).
+static double time_reads(const char *prefix, int keys, int reads) {
+    char key[keySize];
+    double start = now_nanoseconds();
+
+    for (int i = 0; i < reads; i++) {
+        make_key(key, prefix, (i * 7919) % keys);
+        free(kv_store_read(key));
+    }
+    return (now_nanoseconds() - start) / reads;
+}
+
+int main(int argc, char **argv) {
+    int keys = argc > 1 ? atoi(argv[1]) : maxKeyValuePairs / 2;
+    int reads = argc > 2 ? atoi(argv[2]) : 200000;
+    const char *names[] = { "scan", "fingerprint", "index" };
+    int modes[] = { KV_LOOKUP_SCAN, KV_LOOKUP_FINGERPRINT, KV_LOOKUP_INDEX };
+    char key[keySize];
+    char value[valueSize];
+
+    shm_unlink(DATA_BASE_NAME);
+    if (kv_store_create(DATA_BASE_NAME) < 0) {
+        return 1;
+    }
+
+    memset(value, 'v', valueSize);
+    value[valueSize - 1] = '\0';
+    for (int i = 0; i < keys; i++) {
+        make_key(key, "hit", i);
+        kv_store_write(key, value);
+    }
+
+    printf("%d keys stored, %d reads per measurement\n", keys, reads);
+    printf("%12s %12s %12s\n", "lookup", "hit ns/op", "miss ns/op");
+    for (int m = 0; m < 3; m++) {
+        kv_store_lookup_mode(modes[m]);
+        double hit = time_reads("hit", keys, reads);
+        double miss = time_reads("miss", keys, reads);
+        printf("%12s %12.1f %12.1f\n", names[m], hit, miss);
+    }
+
+    kv_delete_db();
+    return 0;
+}
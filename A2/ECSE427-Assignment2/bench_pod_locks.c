@@ -0,0 +1,81 @@
+//
+//  bench_pod_locks.c
+//  ECSE427-Assignment2
+//
+//  Multi-process write scaling benchmark. Built twice by "make bench_locks":
+//  os_bench_pod uses the per-pod locks, os_bench_global is built with
+//  -DKV_GLOBAL_LOCK and takes the original store-wide "260606721_a2_db"
+//  semaphore for every operation.
+//
+//  Usage: ./os_bench_pod [max processes] [writes per process]
+//
+
+#include <sys/wait.h>
+#include <time.h>
+#include "a2_lib.h"
+
+#define benchKeyLength 16
+#define benchValueLength 64
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Each writer uses its own key prefix, so processes mostly land on different pods.
+static void run_writer(int id, int writes) {
+    char key[keySize];
+    char value[valueSize];
+
+    memset(value, 'v', benchValueLength);
+    value[benchValueLength] = '\0';
+
+    for (int i = 0; i < writes; i++) {
+        memset(key, 0, keySize);
+        // Writer ids stay far below 1000, which keeps the key inside benchKeyLength
+        snprintf(key, benchKeyLength, "w%d-%d", id % 1000, i % 4096);
+        kv_store_write(key, value);
+    }
+}
+
+int main(int argc, char **argv) {
+    int maxProcesses = argc > 1 ? atoi(argv[1]) : 8;
+    int writes = argc > 2 ? atoi(argv[2]) : 200000;
+
+    shm_unlink(DATA_BASE_NAME);
+    if (kv_store_create(DATA_BASE_NAME) < 0) {
+        return 1;
+    }
+
+#ifdef KV_GLOBAL_LOCK
+    printf("lock mode: global semaphore\n");
+#else
+    printf("lock mode: per-pod lock\n");
+#endif
+    printf("%10s %14s\n", "processes", "writes/sec");
+
+    for (int processes = 1; processes <= maxProcesses; processes *= 2) {
+        fflush(stdout);
+        double start = now_seconds();
+
+        for (int p = 0; p < processes; p++) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                run_writer(p, writes);
+                exit(0);
+            } else if (pid < 0) {
+                perror("fork failed");
+                return 1;
+            }
+        }
+        while (wait(NULL) > 0) {
+        }
+
+        double elapsed = now_seconds() - start;
+        printf("%10d %14.0f\n", processes, (double) processes * writes / elapsed);
+    }
+
+    kv_delete_db();
+    return 0;
+}
@@ -0,0 +1,141 @@
+//
+//  bench_server.c
+//  ECSE427-Assignment2
+//
+//  What going through kv_server costs against mapping the store. Built twice by "make bench_server":
+//  os_bench_shm links the store library, os_bench_socket links kv_client.c (-DKV_CLIENT) and starts ./kv_server on a
+//  socket of its own for the run. Both time single reads and writes, batched reads per key, and the read
+//  throughput of several processes at once.
+//
+//  Usage: ./os_bench_shm [operations] [max processes]
+//
+
+#include <sys/wait.h>
+#include <signal.h>
+#include <time.h>
+#include "a2_lib.h"
+
+#define benchKeys 4096
+#define benchValueLength 64
+#define benchBatch 64
+#define benchSocket "/tmp/kv_bench_server.sock"
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_key(char *key, int i) {
+    memset(key, 0, keySize);
+    snprintf(key, keySize, "bench-key-%d", i % benchKeys);
+}
+
+static void run_reader(int operations) {
+    char key[keySize];
+
+    for (int i = 0; i < operations; i++) {
+        bench_key(key, i * 7919);
+        free(kv_store_read(key));
+    }
+}
+
+#ifdef KV_CLIENT
+// Starts kv_server and waits until it accepts connections.
+static pid_t server_start(void) {
+    setenv("KV_SERVER_SOCKET", benchSocket, 1);
+    unlink(benchSocket);
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl("./kv_server", "kv_server", benchSocket, (char *) NULL);
+        perror("Could not start ./kv_server");
+        exit(1);
+    }
+    for (int tries = 0; tries < 1000 && access(benchSocket, F_OK) < 0; tries++) {
+        usleep(1000);
+    }
+    return pid;
+}
+#endif
+
+int main(int argc, char **argv) {
+    int operations = argc > 1 ? atoi(argv[1]) : 200000;
+    int maxProcesses = argc > 2 ? atoi(argv[2]) : 8;
+    char key[keySize];
+    char value[valueSize];
+
+#ifdef KV_CLIENT
+    pid_t server = server_start();
+    printf("access: kv_server socket\n");
+#else
+    printf("access: shared memory\n");
+#endif
+
+    shm_unlink(DATA_BASE_NAME);
+    if (kv_store_create(DATA_BASE_NAME) < 0) {
+        return 1;
+    }
+    memset(value, 'v', benchValueLength);
+    value[benchValueLength] = '\0';
+
+    double start = now_seconds();
+    for (int i = 0; i < operations; i++) {
+        bench_key(key, i);
+        kv_store_write(key, value);
+    }
+    printf("%-24s %10.0f ns/op\n", "write", (now_seconds() - start) / operations * 1e9);
+
+    start = now_seconds();
+    run_reader(operations);
+    printf("%-24s %10.0f ns/op\n", "read", (now_seconds() - start) / operations * 1e9);
+
+    char *keys[benchBatch];
+    for (int i = 0; i < benchBatch; i++) {
+        keys[i] = malloc(keySize);
+    }
+    start = now_seconds();
+    for (int done = 0; done < operations; done += benchBatch) {
+        for (int i = 0; i < benchBatch; i++) {
+            bench_key(keys[i], (done + i) * 7919);
+        }
+        char **values = kv_store_read_batch(keys, benchBatch);
+        for (int i = 0; i < benchBatch; i++) {
+            free(values[i]);
+        }
+        free(values);
+    }
+    printf("%-24s %10.0f ns/key\n", "read_batch of 64", (now_seconds() - start) / operations * 1e9);
+    for (int i = 0; i < benchBatch; i++) {
+        free(keys[i]);
+    }
+
+    printf("\n%10s %14s\n", "processes", "reads/sec");
+    for (int processes = 1; processes <= maxProcesses; processes *= 2) {
+        fflush(stdout);
+        start = now_seconds();
+
+        for (int p = 0; p < processes; p++) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                run_reader(operations);
+                exit(0);
+            } else if (pid < 0) {
+                perror("fork failed");
+                return 1;
+            }
+        }
+        for (int p = 0; p < processes; p++) {
+            wait(NULL);
+        }
+
+        double elapsed = now_seconds() - start;
+        printf("%10d %14.0f\n", processes, (double) processes * operations / elapsed);
+    }
+
+    kv_delete_db();
+#ifdef KV_CLIENT
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+#endif
+    return 0;
+}
@@ -0,0 +1,1507 @@
+/* Tests of the store's internals that test1 and test2 cannot reach through the API alone.
+ * a2_lib.c is compiled into this file, so its static helpers can be called directly; a2_persist.c and a2_lz.c
+ * are linked in.
+ */
+
+#include "a2_lib.c"
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#define __TEST3_SHARED_MEM_NAME__ "/KV_TEST3"
+
+static int errors;
+
+static void check(int passed, const char *what) {
+    if (!passed) {
+        printf("FAILED: %s\n", what);
+        errors++;
+    }
+}
+
+static void test_key(char *key, const char *prefix, int i) {
+    memset(key, 0, keySize);
+    snprintf(key, keySize, "%s-%d", prefix, i);
+}
+
+// Values of 1000 bytes use 1024 byte chunks, roughly twice what a default store budgets per slot, so the arena
+// runs out about halfway through the slots. Writes past that point must recycle chunks of the entries they
+// replace instead of failing for good.
+static void arena_fill_test(void) {
+    char key[keySize];
+    char value[1001];
+    char small[201];
+    int failed = 0;
+
+    printf("-----------Arena fill-----------\n");
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    if (kv_store_create(__TEST3_SHARED_MEM_NAME__) < 0) {
+        check(0, "kv_store_create");
+        return;
+    }
+    memset(value, 'a', 1000);
+    value[1000] = '\0';
+    memset(small, 'b', 200);
+    small[200] = '\0';
+
+    for (int i = 0; i < 3 * maxKeyValuePairs; i++) {
+        test_key(key, "fill", i);
+        value[0] = 'a' + i % 26;
+        failed += kv_store_write(key, value) != 0;
+    }
+    kvStats stats;
+    kv_store_stats(&stats);
+    check(stats.arenaUsed + maxChunkSize > (size_t) podSize * numberOfPods * (valueSize + 16) * 2,
+          "1000 byte values should use up the arena");
+    check(failed == 0, "writes of 1000 byte values once the arena is full");
+
+    // Smaller values fit the chunks the large ones leave behind
+    failed = 0;
+    for (int i = 0; i < maxKeyValuePairs; i++) {
+        test_key(key, "small", i);
+        failed += kv_store_write(key, small) != 0;
+    }
+    check(failed == 0, "writes of 200 byte values into a full arena");
+
+    // The latest writes are all readable
+    for (int i = maxKeyValuePairs - 64; i < maxKeyValuePairs; i++) {
+        test_key(key, "small", i);
+        char *read = kv_store_read(key);
+        check(read != NULL && strcmp(read, small) == 0, "reading back a value written into a full arena");
+        free(read);
+    }
+    test_key(key, "fill", 3 * maxKeyValuePairs - 1);
+    kv_store_write(key, value);
+    char *read = kv_store_read(key);
+    check(read != NULL && strcmp(read, value) == 0, "reading back a 1000 byte value written into a full arena");
+    free(read);
+
+    kv_delete_db();
+}
+
+// Damages for restore_test(), given the first pod record of the snapshot and its payload.
+static void damage_payload(kvSnapshotPod *record, char *payload) {
+    payload[record->payloadBytes / 2] ^= 0x5a;
+}
+
+static void damage_length(kvSnapshotPod *record, char *payload) {
+    uint16_t keyLength;
+    uint32_t valueLength = record->payloadBytes;
+
+    memcpy(&keyLength, payload, sizeof(keyLength));
+    memcpy(payload + sizeof(keyLength) + keyLength, &valueLength, sizeof(valueLength));
+    record->crc = crc32_update(crc32_update(0, record, offsetof(kvSnapshotPod, crc)), payload, record->payloadBytes);
+}
+
+// Fills value (of size bytes) with text the LZ codec cannot shrink much.
+static void big_value(char *value, size_t size) {
+    for (size_t i = 0; i + 1 < size; i++) {
+        value[i] = 'a' + (i * 7 + i / 26) % 26;
+    }
+    value[size - 1] = '\0';
+}
+
+static int restore_count(const char *prefix, int count, const char *value) {
+    char key[keySize];
+    int found = 0;
+
+    for (int i = 0; i < count; i++) {
+        test_key(key, prefix, i);
+        char *read = kv_store_read(key);
+        found += read != NULL && strcmp(read, value) == 0;
+        free(read);
+    }
+    return found;
+}
+
+// Restores a good snapshot into a fresh store, then checks that damaged copies of it are refused as a whole:
+// a flipped payload byte, a truncated file, and a record whose checksum was recomputed over an entry claiming
+// more bytes than the record holds. The snapshot is taken from a single pod store, so its only record holds every
+// entry, and restored into a default one. Last, a restore into a store too small for the snapshot must fail.
+static void restore_test(void) {
+    const char *path = "/tmp/kv_test3.snapshot";
+    kvOptions options = { .pods = 1, .slotsPerPod = 1024, .keyBytes = keySize, .valueBytes = valueSize };
+    char key[keySize];
+    char value[] = "restored value";
+    struct stat info;
+
+    printf("-----------Snapshot restore-----------\n");
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    if (kv_store_create_with(__TEST3_SHARED_MEM_NAME__, &options) < 0) {
+        check(0, "kv_store_create");
+        return;
+    }
+    for (int i = 0; i < 1000; i++) {
+        test_key(key, "snap", i);
+        kv_store_write(key, value);
+    }
+    check(kv_store_snapshot(path) == 0, "kv_store_snapshot");
+    kv_delete_db();
+
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    kv_store_create(__TEST3_SHARED_MEM_NAME__);
+    check(kv_store_restore(path) == 0, "restoring a good snapshot");
+    check(restore_count("snap", 1000, value) == 1000, "every entry of a good snapshot is restored");
+    kv_delete_db();
+
+    int fd = open(path, O_RDWR);
+    fstat(fd, &info);
+    char *file = malloc(info.st_size);
+    check(read(fd, file, info.st_size) == info.st_size, "reading the snapshot back");
+    close(fd);
+    kvSnapshotPod *record = (kvSnapshotPod *) (file + sizeof(kvSnapshotHeader));
+    char *payload = (char *) (record + 1);
+
+    struct {
+        const char *what;
+        size_t length;
+        void (*damage)(kvSnapshotPod *record, char *payload);
+    } cases[] = {
+        { "a snapshot with a corrupted payload byte is refused", info.st_size, damage_payload },
+        { "a truncated snapshot is refused", info.st_size - 3, NULL },
+        { "a snapshot entry longer than its record is refused", info.st_size, damage_length },
+    };
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        char *copy = malloc(info.st_size);
+        memcpy(copy, file, info.st_size);
+        if (cases[c].damage != NULL) {
+            cases[c].damage((kvSnapshotPod *) (copy + ((char *) record - file)), copy + (payload - file));
+        }
+        fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+        check(write(fd, copy, cases[c].length) == (ssize_t) cases[c].length, "writing a damaged snapshot");
+        close(fd);
+        free(copy);
+
+        shm_unlink(__TEST3_SHARED_MEM_NAME__);
+        kv_store_create(__TEST3_SHARED_MEM_NAME__);
+        check(kv_store_restore(path) < 0, cases[c].what);
+        check(restore_count("snap", 1000, value) == 0, "nothing of a damaged snapshot is restored");
+        kv_delete_db();
+    }
+    free(file);
+    unlink(path);
+
+    // Entries of 2000 bytes are spread over 64 pods of a store whose arena budgets a single byte per slot, so
+    // some pods have no chunk left to reclaim; the restore must say it lost entries instead of succeeding
+    char big[2001];
+    big_value(big, sizeof(big));
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    kv_store_create_with(__TEST3_SHARED_MEM_NAME__, &options);
+    for (int i = 0; i < 500; i++) {
+        test_key(key, "big", i);
+        kv_store_write(key, big);
+    }
+    check(kv_store_snapshot(path) == 0, "kv_store_snapshot of large values");
+    kv_delete_db();
+
+    kvOptions small = { .pods = 64, .slotsPerPod = 64, .keyBytes = keySize, .valueBytes = 1 };
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    kv_store_create_with(__TEST3_SHARED_MEM_NAME__, &small);
+    check(kv_store_restore(path) < 0, "a restore into a store too small for the snapshot fails");
+    int restored = restore_count("big", 500, big);
+    check(restored > 0 && restored < 500, "the entries that fit are still restored");
+    kv_delete_db();
+    unlink(path);
+}
+
+static off_t file_size(const char *path) {
+    struct stat info;
+    return stat(path, &info) < 0 ? -1 : info.st_size;
+}
+
+// A child writes to a durable store and is killed; every write it got an answer for must come back when the
+// store is created again from its log, and half a record the kill left at the end of the log must be cut off.
+// Then a snapshot checkpoints the log, which must shrink, and creating the store again restores the snapshot
+// and replays the writes logged after it, including those of a process that had the old log open and those made
+// while the snapshot was being taken.
+static void wal_test(void) {
+    const char *walPath = "/tmp/kv_test3.wal";
+    const char *snapshotPath = "/tmp/kv_test3.wal.snapshot";
+    kvOptions options = { .pods = 64, .slotsPerPod = 256, .keyBytes = keySize, .valueBytes = valueSize,
+                          .walPath = walPath };
+    char key[keySize];
+    char value[] = "logged value";
+
+    printf("-----------Log replay-----------\n");
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    unlink(walPath);
+    if (kv_store_create_with(__TEST3_SHARED_MEM_NAME__, &options) < 0) {
+        check(0, "kv_store_create_with a log");
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        for (int i = 0; i < 500; i++) {
+            test_key(key, "wal", i);
+            if (kv_store_write(key, value) != 0) {
+                _exit(1);
+            }
+        }
+        kill(getpid(), SIGKILL);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    check(WIFSIGNALED(status), "the writer was killed after all its writes succeeded");
+    kv_delete_db();
+
+    off_t logged = file_size(walPath);
+    int fd = open(walPath, O_WRONLY | O_APPEND);
+    kvWalRecord torn = { 0x12345678, 4, 100, 0 };
+    check(write(fd, &torn, sizeof(torn)) == sizeof(torn), "appending a torn record");
+    close(fd);
+
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    check(kv_store_create_with(__TEST3_SHARED_MEM_NAME__, &options) == 0, "creating the store from its log");
+    check(restore_count("wal", 500, value) == 500, "every acknowledged write is replayed from the log");
+    check(file_size(walPath) == logged, "the torn record is cut off the log");
+
+    check(kv_store_snapshot(snapshotPath) == 0, "snapshot of a durable store");
+    check(file_size(walPath) < logged / 10, "the snapshot checkpoints the log");
+    // Written by another process, which opened the log before the checkpoint replaced it
+    pid = fork();
+    if (pid == 0) {
+        for (int i = 0; i < 100; i++) {
+            test_key(key, "after", i);
+            kv_store_write(key, value);
+        }
+        _exit(0);
+    }
+    waitpid(pid, &status, 0);
+    // Written while a second snapshot copies the pods, so some land in it and the others only in the log
+    pid = fork();
+    if (pid == 0) {
+        for (int i = 0; i < 2000; i++) {
+            test_key(key, "during", i);
+            kv_store_write(key, value);
+        }
+        _exit(0);
+    }
+    check(kv_store_snapshot(snapshotPath) == 0, "snapshot of a durable store while it is written");
+    waitpid(pid, &status, 0);
+    kv_delete_db();
+
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    check(kv_store_create_with(__TEST3_SHARED_MEM_NAME__, &options) == 0, "creating the store from a checkpoint");
+    check(restore_count("wal", 500, value) == 500, "the writes before the checkpoint come back from the snapshot");
+    check(restore_count("after", 100, value) == 100, "the writes after the checkpoint are replayed from the log");
+    check(restore_count("during", 2000, value) == 2000, "the writes made during the snapshot come back");
+    kv_delete_db();
+    unlink(walPath);
+    unlink(snapshotPath);
+
+    // A log holding more than a smaller store can take must not come back with writes silently missing
+    char big[2001];
+    big_value(big, sizeof(big));
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    kv_store_create_with(__TEST3_SHARED_MEM_NAME__, &options);
+    for (int i = 0; i < 500; i++) {
+        test_key(key, "big", i);
+        kv_store_write(key, big);
+    }
+    kv_delete_db();
+
+    kvOptions small = { .pods = 64, .slotsPerPod = 64, .keyBytes = keySize, .valueBytes = 1, .walPath = walPath };
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    check(kv_store_create_with(__TEST3_SHARED_MEM_NAME__, &small) < 0,
+          "creating a store too small for the writes of its log fails");
+    kv_delete_db();
+    unlink(walPath);
+}
+
+// A process that dies inside an LRU write leaves the slot it was changing half written. The LRU hand does not
+// point at that slot, so recovery must drop the slot the write recorded and keep every other entry.
+static void recover_test(void) {
+    kvOptions options = { .pods = 1, .slotsPerPod = 64, .keyBytes = keySize, .valueBytes = valueSize,
+                          .evictionPolicy = KV_EVICT_LRU };
+    char key[keySize];
+    char value[] = "recovered value";
+
+    printf("-----------LRU recovery-----------\n");
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    if (kv_store_create_with(__TEST3_SHARED_MEM_NAME__, &options) < 0) {
+        check(0, "kv_store_create_with LRU eviction");
+        return;
+    }
+    for (int i = 0; i < 64; i++) {
+        test_key(key, "lru", i);
+        kv_store_write(key, value);
+    }
+
+    // The write being torn goes to slot 10 while the hand rests on slot 0
+    int torn = 10;
+    char tornKey[keySize];
+    memcpy(tornKey, slot_addr(0, torn), keySize);
+    layout->podMeta[0].nextSlot = 0;
+    layout->podMeta[0].writingSlot = torn;
+    pod_seq_begin(0);
+    slot_addr(0, torn)[0] ^= 0x20;
+    pod_recover(0);
+
+    char *read = kv_store_read(tornKey);
+    check(read == NULL, "the slot being written is dropped");
+    free(read);
+    check(slot_free(0, torn), "the slot being written is emptied");
+    check(!slot_free(0, 0), "the entry under the LRU hand survives");
+    check(restore_count("lru", 64, value) == 63, "every other entry survives recovery");
+    kv_delete_db();
+}
+
+static int lz_round_trip(const char *in, size_t length) {
+    unsigned char packed[maxChunkSize];
+    char out[maxChunkSize + 8];
+
+    size_t packedLength = lz_compress((const unsigned char *) in, length, packed, length);
+    if (packedLength == 0) {
+        return 1;
+    }
+    return lz_decompress(packed, packedLength, out, sizeof(out)) == (long) length && memcmp(in, out, length) == 0;
+}
+
+// Writes value to a single pod store and reads it back. Returns whether it came back unchanged, and in *compressed
+// whether it was stored compressed.
+static int lz_store_round_trip(const char *key, const char *value, int *compressed) {
+    kv_store_write((char *) key, (char *) value);
+    *compressed = slot_compressed(0, pod_find(0, (char *) key, 0));
+    char *read = kv_store_read((char *) key);
+    int same = read != NULL && strcmp(read, value) == 0;
+    free(read);
+    return same;
+}
+
+// Compression round trips of data it cannot shrink, data it shrinks the most and values of the longest length,
+// then of values just below, at and just above the store's compressAbove. The decoder must refuse a match whose
+// offset points before the start of the output.
+static void lz_test(void) {
+    const int compressAbove = 256;
+    kvOptions options = { .pods = 1, .slotsPerPod = 64, .keyBytes = keySize, .valueBytes = valueSize,
+                          .compressAbove = compressAbove };
+    char data[maxValueSize + 1];
+    int compressed;
+
+    printf("-----------Compression-----------\n");
+    for (size_t i = 0; i < maxValueSize; i++) {
+        data[i] = rand();
+    }
+    check(lz_round_trip(data, maxValueSize), "round trip of random bytes");
+    memset(data, 'z', maxValueSize);
+    check(lz_round_trip(data, maxValueSize), "round trip of a single repeated byte");
+    for (size_t i = 0; i < maxValueSize; i++) {
+        data[i] = "the quick brown fox "[i % 20] + (i % 97 == 0);
+    }
+    check(lz_round_trip(data, maxValueSize), "round trip of maxValueSize bytes of text");
+
+    unsigned char packed[64];
+    char out[64];
+    const char *repeated = "abcdabcdabcdabcdabcdabcdabcdabcd";
+    size_t packedLength = lz_compress((const unsigned char *) repeated, 32, packed, 32);
+    check(packedLength > 0 && packed[0] >> 4 == 4, "a repeated pattern starts with 4 literals and a match");
+    packed[6] = 0;
+    packed[5] = 5;
+    check(lz_decompress(packed, packedLength, out, sizeof(out)) < 0, "a match offset past the output is refused");
+    packed[5] = 0;
+    check(lz_decompress(packed, packedLength, out, sizeof(out)) < 0, "a match offset of 0 is refused");
+
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    if (kv_store_create_with(__TEST3_SHARED_MEM_NAME__, &options) < 0) {
+        check(0, "kv_store_create_with compression");
+        return;
+    }
+    for (int length = compressAbove - 1; length <= compressAbove + 1; length++) {
+        memset(data, 'c', length);
+        data[length] = '\0';
+        char key[keySize];
+        test_key(key, "threshold", length);
+        check(lz_store_round_trip(key, data, &compressed), "round trip of a value around compressAbove");
+        check(compressed == (length > compressAbove), "only values longer than compressAbove are compressed");
+    }
+    for (size_t i = 0; i < maxValueSize; i++) {
+        data[i] = 'a' + rand() % 26;
+    }
+    data[maxValueSize] = '\0';
+    check(lz_store_round_trip("random", data, &compressed), "round trip of a random maxValueSize value");
+    memset(data, 'z', maxValueSize);
+    check(lz_store_round_trip("same", data, &compressed) && compressed, "round trip of a compressed maxValueSize value");
+    kv_delete_db();
+}
+
+static int value_cmp(const void *a, const void *b) {
+    return strcmp(*(char **) a, *(char **) b);
+}
+
+// Writes the entries to a fresh store one by one or as one batch, then returns each key's values as
+// kv_store_read_all() gives them, sorted so the two ways can be compared.
+static char ***batch_fill(char **keys, char **values, int count, int batched) {
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    if (kv_store_create(__TEST3_SHARED_MEM_NAME__) < 0) {
+        return NULL;
+    }
+    if (batched) {
+        check(kv_store_write_batch(keys, values, count) == 0, "kv_store_write_batch");
+    } else {
+        for (int i = 0; i < count; i++) {
+            kv_store_write(keys[i], values[i]);
+        }
+    }
+    char ***all = malloc(sizeof(char **) * count);
+    for (int i = 0; i < count; i++) {
+        all[i] = kv_store_read_all(keys[i]);
+        int n = 0;
+        while (all[i] != NULL && all[i][n] != NULL) {
+            n++;
+        }
+        if (n > 0) {
+            qsort(all[i], n, sizeof(char *), value_cmp);
+        }
+    }
+    return all;
+}
+
+// A batch of writes leaves the same values behind as the same writes made one by one, and a batch of reads
+// returns what single reads do, for keys in either of their pods and for keys not stored.
+static void batch_test(void) {
+    const int count = 400;
+    char *keys[count];
+    char *values[count];
+    int same = 1;
+
+    printf("-----------Batches-----------\n");
+    for (int i = 0; i < count; i++) {
+        keys[i] = calloc(1, keySize);
+        values[i] = malloc(32);
+        test_key(keys[i], "batch", i % (count / 2));
+        snprintf(values[i], 32, "value-%d", i);
+    }
+    char ***single = batch_fill(keys, values, count, 0);
+    kv_delete_db();
+    char ***batch = batch_fill(keys, values, count, 1);
+    for (int i = 0; single != NULL && batch != NULL && i < count; i++) {
+        for (int v = 0; single[i] != NULL && single[i][v] != NULL; v++) {
+            same = same && batch[i] != NULL && batch[i][v] != NULL && strcmp(single[i][v], batch[i][v]) == 0;
+        }
+        same = same && (single[i] == NULL) == (batch[i] == NULL);
+    }
+    check(same, "a batch of writes stores what single writes do");
+
+    // Half the keys are read that were never written
+    char *readKeys[count];
+    for (int i = 0; i < count; i++) {
+        readKeys[i] = calloc(1, keySize);
+        test_key(readKeys[i], i % 2 ? "batch" : "missing", i / 2);
+    }
+    char **read = kv_store_read_batch(readKeys, count);
+    int found = 0, wrong = 0;
+    for (int i = 0; i < count; i++) {
+        char *single = kv_store_read(readKeys[i]);
+        found += read[i] != NULL;
+        wrong += (read[i] == NULL) != (single == NULL)
+            || (read[i] != NULL && strncmp(read[i], "value-", 6) != 0);
+        free(single);
+        free(read[i]);
+        free(readKeys[i]);
+    }
+    free(read);
+    check(found == count / 2, "a batch of reads finds the stored keys and only those");
+    check(wrong == 0, "a batch of reads returns what single reads do");
+    kv_delete_db();
+
+    for (int i = 0; i < count; i++) {
+        for (int v = 0; single != NULL && single[i] != NULL && single[i][v] != NULL; v++) {
+            free(single[i][v]);
+        }
+        for (int v = 0; batch != NULL && batch[i] != NULL && batch[i][v] != NULL; v++) {
+            free(batch[i][v]);
+        }
+        free(single != NULL ? single[i] : NULL);
+        free(batch != NULL ? batch[i] : NULL);
+        free(keys[i]);
+        free(values[i]);
+    }
+    free(single);
+    free(batch);
+}
+
+// A lease shows the value it was taken on until the pod is written again. One taken while a write never seems to
+// end is a copy that stays valid, and a lease of a missing key holds nothing.
+static void lease_test(void) {
+    kvOptions options = { .pods = 1, .slotsPerPod = 64, .keyBytes = keySize, .valueBytes = valueSize,
+                          .compressAbove = 64 };
+    char key[keySize];
+    char packed[201];
+    kvLease lease;
+
+    printf("-----------Leases-----------\n");
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    if (kv_store_create_with(__TEST3_SHARED_MEM_NAME__, &options) < 0) {
+        check(0, "kv_store_create_with");
+        return;
+    }
+    test_key(key, "lease", 0);
+    kv_store_write(key, "first");
+    check(kv_store_read_lease(key, &lease) == 0 && lease.length == 5 && strcmp(lease.value, "first") == 0,
+          "a lease shows the value");
+    check(kv_store_lease_valid(&lease), "a lease is valid until the pod is written");
+    kv_store_write(key, "second");
+    check(!kv_store_lease_valid(&lease), "an overwrite invalidates the lease");
+    kv_store_lease_release(&lease);
+
+    memset(packed, 'p', 200);
+    packed[200] = '\0';
+    test_key(key, "lease", 1);
+    kv_store_write(key, packed);
+    check(kv_store_read_lease(key, &lease) == 0 && lease.buffer != NULL && strcmp(lease.value, packed) == 0,
+          "a lease of a compressed value holds it expanded");
+    kv_store_lease_release(&lease);
+
+    // A writer that never finishes sends the reader to the lock, which is free here
+    pod_seq_begin(0);
+    check(kv_store_read_lease(key, &lease) == 0 && lease.value == lease.buffer && strcmp(lease.value, packed) == 0,
+          "a lease taken under a busy pod is a copy");
+    pod_seq_end(0);
+    kv_store_write(key, "third");
+    check(kv_store_lease_valid(&lease) && strcmp(lease.value, packed) == 0, "a copied lease stays valid");
+    kv_store_lease_release(&lease);
+
+    test_key(key, "lease", 2);
+    check(kv_store_read_lease(key, &lease) < 0 && lease.buffer == NULL, "a lease of a missing key holds nothing");
+    kv_delete_db();
+}
+
+static int growDone;
+
+// Counts the keys of grow_test() holding the value their writer wrote.
+static int grow_count(int writers, int keys) {
+    char key[keySize];
+    char value[32];
+    int found = 0;
+
+    for (int w = 0; w < writers; w++) {
+        for (int i = 0; i < keys; i++) {
+            test_key(key, "grow", w * keys + i);
+            snprintf(value, sizeof(value), "value-%d", w * keys + i);
+            char *read = kv_store_read(key);
+            found += read != NULL && strcmp(read, value) == 0;
+            free(read);
+        }
+    }
+    return found;
+}
+
+static void *grow_thread(void *arg) {
+    int *pods = arg;
+    check(kv_store_grow(*pods, 128) == 0, "kv_store_grow while an operation is under way");
+    __atomic_store_n(&growDone, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Writers in other processes keep going while the store grows, and every key they wrote is found after it. The
+// old table is only released once no operation that may still use it is under way, which an operation of a
+// process that died does not hold up.
+static void grow_test(void) {
+    kvOptions options = { .pods = 64, .slotsPerPod = 128, .keyBytes = keySize, .valueBytes = valueSize };
+    char key[keySize];
+    char value[32];
+    char table[64];
+    int writers = 4;
+    int keys = 1000;
+
+    printf("-----------Grow-----------\n");
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    if (kv_store_create_with(__TEST3_SHARED_MEM_NAME__, &options) < 0) {
+        check(0, "kv_store_create_with");
+        return;
+    }
+    for (int w = 0; w < writers; w++) {
+        if (fork() == 0) {
+            for (int i = 0; i < keys; i++) {
+                test_key(key, "grow", w * keys + i);
+                snprintf(value, sizeof(value), "value-%d", w * keys + i);
+                kv_store_write(key, value);
+            }
+            _exit(0);
+        }
+    }
+    check(kv_store_grow(128, 128) == 0, "kv_store_grow under concurrent writers");
+    while (wait(NULL) > 0) {
+    }
+    check(grow_count(writers, keys) == writers * keys, "every key written during a grow is found");
+
+    // This thread's operation keeps the next grow from releasing the table it started on
+    pthread_t grower;
+    int pods = 256;
+    store_pin();
+    pthread_create(&grower, NULL, grow_thread, &pods);
+    struct timespec pause = { 0, 200 * 1000 * 1000 };
+    nanosleep(&pause, NULL);
+    check(!__atomic_load_n(&growDone, __ATOMIC_ACQUIRE), "a grow waits for operations on its old table");
+    store_unpin(NULL);
+    pthread_join(grower, NULL);
+    snprintf(table, sizeof(table), "%s.1", __TEST3_SHARED_MEM_NAME__);
+    int fd = shm_open(table, O_RDWR, 0);
+    check(fd < 0, "the old table is released once its operations are done");
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    // A process that died in the middle of an operation leaves its user slot taken
+    pid_t pid = fork();
+    if (pid == 0) {
+        store_pin();
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+    check(kv_store_grow(512, 128) == 0, "a grow is not held up by an operation of a dead process");
+    check(grow_count(writers, keys) == writers * keys, "growing again keeps every value");
+    kv_delete_db();
+}
+
+// Finds a key named after prefix whose pod is podNum.
+static void pod_key(char *key, const char *prefix, unsigned long podNum) {
+    for (int i = 0; ; i++) {
+        test_key(key, prefix, i);
+        if (hash(key) == podNum) {
+            return;
+        }
+    }
+}
+
+static double elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static void *pod_holder(void *arg) {
+    unsigned long podNum = *(unsigned long *) arg;
+    struct timespec hold = { 0, 300 * 1000 * 1000 };
+
+    store_enter();
+    pod_write_lock(podNum);
+    nanosleep(&hold, NULL);
+    pod_unlock(podNum);
+    return NULL;
+}
+
+// Pods are locked one by one: a write to another pod goes through while a pod is held, and a write to the held
+// pod waits for it.
+static void lock_test(void) {
+    kvOptions options = { .pods = 16, .slotsPerPod = 64, .keyBytes = keySize, .valueBytes = valueSize,
+                          .placement = KV_PLACE_ONE };
+    char held[keySize];
+    char other[keySize];
+    unsigned long podNum = 3;
+    struct timespec start;
+    struct timespec settle = { 0, 50 * 1000 * 1000 };
+    pthread_t holder;
+
+    printf("-----------Pod locks-----------\n");
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    if (kv_store_create_with(__TEST3_SHARED_MEM_NAME__, &options) < 0) {
+        check(0, "kv_store_create_with");
+        return;
+    }
+    pod_key(held, "held", podNum);
+    pod_key(other, "other", podNum + 1);
+    pthread_create(&holder, NULL, pod_holder, &podNum);
+    nanosleep(&settle, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    check(kv_store_write(other, "value") == 0 && elapsed_ms(&start) < 100, "a write to another pod does not wait");
+    check(kv_store_write(held, "value") == 0 && elapsed_ms(&start) > 150, "a write to a held pod waits for it");
+    pthread_join(holder, NULL);
+    kv_delete_db();
+}
+
+static int writerRunning;
+
+// Overwrites key with values whose every byte and length follow from one counter, so a torn read shows.
+static void *seq_writer(void *arg) {
+    char *key = arg;
+    char value[200];
+
+    for (int i = 0; __atomic_load_n(&writerRunning, __ATOMIC_ACQUIRE); i++) {
+        int length = 1 + i % 150;
+        memset(value, 'a' + length % 26, length);
+        value[length] = '\0';
+        kv_store_write(key, value);
+    }
+    return NULL;
+}
+
+// Reads take no lock: one goes through while the pod is held, unlike in KV_READ_LOCKED mode, and one that finds a
+// write never ending falls back to the lock. Reads racing a writer never return a torn value.
+static void seqlock_test(void) {
+    kvOptions options = { .pods = 16, .slotsPerPod = 64, .keyBytes = keySize, .valueBytes = valueSize,
+                          .placement = KV_PLACE_ONE };
+    char key[keySize];
+    unsigned long podNum = 5;
+    struct timespec start;
+    struct timespec settle = { 0, 50 * 1000 * 1000 };
+    pthread_t thread;
+
+    printf("-----------Optimistic reads-----------\n");
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    if (kv_store_create_with(__TEST3_SHARED_MEM_NAME__, &options) < 0) {
+        check(0, "kv_store_create_with");
+        return;
+    }
+    pod_key(key, "seq", podNum);
+    kv_store_write(key, "value");
+
+    pthread_create(&thread, NULL, pod_holder, &podNum);
+    nanosleep(&settle, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char *read = kv_store_read(key);
+    check(read != NULL && strcmp(read, "value") == 0 && elapsed_ms(&start) < 100, "a read does not wait for the pod lock");
+    free(read);
+    pthread_join(thread, NULL);
+
+    kv_store_read_mode(KV_READ_LOCKED);
+    pthread_create(&thread, NULL, pod_holder, &podNum);
+    nanosleep(&settle, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    read = kv_store_read(key);
+    check(read != NULL && elapsed_ms(&start) > 150, "a locked read waits for the pod lock");
+    free(read);
+    pthread_join(thread, NULL);
+    kv_store_read_mode(KV_READ_OPTIMISTIC);
+
+    // A writer that never finishes sends the reader to the lock, which is free here
+    pod_seq_begin(podNum);
+    read = kv_store_read(key);
+    check(read != NULL && strcmp(read, "value") == 0, "a read under a write that never ends takes the lock");
+    free(read);
+    pod_seq_end(podNum);
+
+    int torn = 0;
+    __atomic_store_n(&writerRunning, 1, __ATOMIC_RELEASE);
+    pthread_create(&thread, NULL, seq_writer, key);
+    for (int i = 0; i < 20000; i++) {
+        read = kv_store_read(key);
+        size_t length = read != NULL && strcmp(read, "value") != 0 ? strlen(read) : 0;
+        size_t same = 0;
+        while (same < length && read[same] == (char) ('a' + length % 26)) {
+            same++;
+        }
+        torn += same < length;
+        free(read);
+    }
+    __atomic_store_n(&writerRunning, 0, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    check(torn == 0, "reads racing a writer never return a torn value");
+    kv_delete_db();
+}
+
+// kv_store_read_all() of key in the current lookup mode, as one string of its values in the order they came.
+static char *lookup_join(const char *key) {
+    char **values = kv_store_read_all((char *) key);
+    size_t length = 1;
+    for (int i = 0; values != NULL && values[i] != NULL; i++) {
+        length += strlen(values[i]) + 1;
+    }
+    char *joined = calloc(1, length);
+    for (int i = 0; values != NULL && values[i] != NULL; i++) {
+        strcat(joined, values[i]);
+        strcat(joined, "|");
+        free(values[i]);
+    }
+    free(values);
+    return joined;
+}
+
+// Counts the keys named after prefix whose values differ between lookup mode and the linear scan.
+static int lookup_mismatches(int mode, const char *prefix, int count) {
+    char key[keySize];
+    int mismatches = 0;
+
+    for (int i = 0; i < count; i++) {
+        test_key(key, prefix, i);
+        kv_store_lookup_mode(KV_LOOKUP_SCAN);
+        char *expected = lookup_join(key);
+        kv_store_lookup_mode(mode);
+        char *found = lookup_join(key);
+        mismatches += strcmp(expected, found) != 0;
+        free(expected);
+        free(found);
+    }
+    kv_store_lookup_mode(KV_LOOKUP_INDEX);
+    return mismatches;
+}
+
+// A single pod is overwritten several times over, so index chains keep losing and gaining slots; the index must
+// find exactly what a scan of every slot finds, for keys with several values, evicted keys and missing ones.
+static void index_test(void) {
+    kvOptions options = { .pods = 1, .slotsPerPod = 64, .keyBytes = keySize, .valueBytes = valueSize };
+    char key[keySize];
+    char value[32];
+    kvPodStats stats;
+
+    printf("-----------Slot index-----------\n");
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    if (kv_store_create_with(__TEST3_SHARED_MEM_NAME__, &options) < 0) {
+        check(0, "kv_store_create_with");
+        return;
+    }
+    for (int i = 0; i < 300; i++) {
+        test_key(key, "index", i % 50 + (i / 100) * 10);
+        snprintf(value, sizeof(value), "value-%d", i);
+        kv_store_write(key, value);
+    }
+    check(lookup_mismatches(KV_LOOKUP_INDEX, "index", 80) == 0, "index lookups find what a scan finds");
+    check(kv_store_pod_stats(0, &stats) == 0 && stats.live == 64 && stats.longestChain <= stats.live,
+          "the index chains cover the full pod");
+    test_key(key, "index", 0);
+    char *read = kv_store_read(key);
+    check(read == NULL, "an evicted key is not found through the index");
+    free(read);
+    kv_delete_db();
+}
+
+// Fingerprint lookups find what a scan of every slot finds, also for two keys sharing a fingerprint, and every
+// vector scan of the fingerprints marks the same slots as the plain loop.
+static void fingerprint_test(void) {
+    kvOptions options = { .pods = 1, .slotsPerPod = 256, .keyBytes = keySize, .valueBytes = valueSize };
+    char key[keySize];
+    char twin[keySize];
+    char value[32];
+    unsigned char prints[256];
+    uint64_t expected[4];
+
+    printf("-----------Fingerprints-----------\n");
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    if (kv_store_create_with(__TEST3_SHARED_MEM_NAME__, &options) < 0) {
+        check(0, "kv_store_create_with");
+        return;
+    }
+    for (int i = 0; i < 600; i++) {
+        test_key(key, "print", i % 200);
+        snprintf(value, sizeof(value), "value-%d", i);
+        kv_store_write(key, value);
+    }
+    check(lookup_mismatches(KV_LOOKUP_FINGERPRINT, "print", 250) == 0, "fingerprint lookups find what a scan finds");
+
+    test_key(key, "twin", 0);
+    for (int i = 1; ; i++) {
+        test_key(twin, "twin", i);
+        if (key_fingerprint(twin) == key_fingerprint(key)) {
+            break;
+        }
+    }
+    kv_store_lookup_mode(KV_LOOKUP_FINGERPRINT);
+    kv_store_write(key, "first twin");
+    char *read = kv_store_read(twin);
+    check(read == NULL, "a key sharing a stored key's fingerprint is not found");
+    free(read);
+    kv_store_write(twin, "second twin");
+    read = kv_store_read(twin);
+    check(read != NULL && strcmp(read, "second twin") == 0, "keys sharing a fingerprint are told apart");
+    free(read);
+    kv_store_lookup_mode(KV_LOOKUP_INDEX);
+
+    for (int i = 0; i < 256; i++) {
+        prints[i] = rand() % 4;
+    }
+    for (unsigned char print = 0; print < 4; print++) {
+        fingerprint_scan_scalar(prints, print, expected);
+#if defined(__x86_64__)
+        uint64_t found[4];
+        fingerprint_scan_sse2(prints, print, found);
+        check(memcmp(expected, found, sizeof(found)) == 0, "the SSE2 fingerprint scan marks the same slots");
+        if (__builtin_cpu_supports("avx2")) {
+            fingerprint_scan_avx2(prints, print, found);
+            check(memcmp(expected, found, sizeof(found)) == 0, "the AVX2 fingerprint scan marks the same slots");
+        }
+#endif
+    }
+    kv_delete_db();
+}
+
+// A process attaching with the default geometry uses the one recorded in the store, down to keys as long as the
+// store's keyBytes. Invalid geometries are refused.
+static void geometry_test(void) {
+    kvOptions options = { .pods = 8, .slotsPerPod = 128, .keyBytes = 64, .valueBytes = 100, .hashSeed = 7 };
+    kvOptions invalid = { .pods = 8, .slotsPerPod = 100, .keyBytes = 64, .valueBytes = 100 };
+    char longKey[65];
+    char childKey[65];
+    kvStats stats;
+
+    printf("-----------Geometry-----------\n");
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    check(kv_store_create_with(__TEST3_SHARED_MEM_NAME__, &invalid) < 0, "slotsPerPod off a multiple of 64 is refused");
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    if (kv_store_create_with(__TEST3_SHARED_MEM_NAME__, &options) < 0) {
+        check(0, "kv_store_create_with");
+        return;
+    }
+    memset(longKey, 'k', 64);
+    longKey[64] = '\0';
+    memset(childKey, 'c', 64);
+    childKey[64] = '\0';
+    kv_store_write(longKey, "long key");
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        kv_store_create(__TEST3_SHARED_MEM_NAME__);
+        char *read = kv_store_read(longKey);
+        int ok = kv_store_stats(&stats) == 0 && stats.pods == 8 && stats.slotsPerPod == 128 && stats.hashSeed == 7
+                 && read != NULL && strcmp(read, "long key") == 0 && kv_store_write(childKey, "child") == 0;
+        _exit(ok ? 0 : 1);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "an attaching process uses the recorded geometry");
+    char *read = kv_store_read(childKey);
+    check(read != NULL && strcmp(read, "child") == 0, "a key of keyBytes bytes written by another process is read");
+    free(read);
+    kv_delete_db();
+}
+
+// Spread of the keys "spread-0" ... over the pods of the store: the most keys any pod got.
+static int hash_spread(int keys, int pods) {
+    char key[keySize];
+    int *counts = calloc(pods, sizeof(int));
+    int most = 0;
+
+    for (int i = 0; i < keys; i++) {
+        test_key(key, "spread", i);
+        unsigned long podNum = hash(key);
+        if (podNum < (unsigned long) pods && ++counts[podNum] > most) {
+            most = counts[podNum];
+        }
+    }
+    free(counts);
+    return most;
+}
+
+// hash() without a store is the default store's placement. Both hash functions spread keys evenly over the pods,
+// the seed changes where keys go, and djb2 is the original function when unseeded.
+static void hash_test(void) {
+    kvOptions options = { .pods = 64, .slotsPerPod = 64, .keyBytes = keySize, .valueBytes = valueSize,
+                          .placement = KV_PLACE_ONE };
+    char key[keySize];
+    int keys = 64000;
+
+    printf("-----------Hashing-----------\n");
+    test_key(key, "spread", 0);
+    unsigned long unattached = hash(key);
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    kv_store_create(__TEST3_SHARED_MEM_NAME__);
+    check(hash(key) == unattached, "hash() without a store places keys like a default store");
+    kv_delete_db();
+
+    unsigned long placed[2][100];
+    for (int seed = 0; seed < 2; seed++) {
+        options.hashSeed = seed * 12345;
+        shm_unlink(__TEST3_SHARED_MEM_NAME__);
+        kv_store_create_with(__TEST3_SHARED_MEM_NAME__, &options);
+        check(hash_spread(keys, options.pods) < 2 * keys / options.pods, "wyhash spreads keys evenly");
+        for (int i = 0; i < 100; i++) {
+            test_key(key, "spread", i);
+            placed[seed][i] = hash(key);
+        }
+        kv_delete_db();
+    }
+    int moved = 0;
+    for (int i = 0; i < 100; i++) {
+        moved += placed[0][i] != placed[1][i];
+    }
+    check(moved > 50, "another seed places keys elsewhere");
+
+    options.hashFunction = KV_HASH_DJB2;
+    options.hashSeed = 0;
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    kv_store_create_with(__TEST3_SHARED_MEM_NAME__, &options);
+    check(hash_spread(keys, options.pods) < 2 * keys / options.pods, "djb2 spreads keys evenly");
+    unsigned long djb2 = 5381;
+    for (const char *c = "djb2"; *c != '\0'; c++) {
+        djb2 = djb2 * 33 + *c;
+    }
+    check(hash("djb2") == djb2 % options.pods, "unseeded djb2 is the original function");
+    kv_delete_db();
+}
+
+// Every region of a table starts on a cache line, each pod's metadata fills whole lines of its own, and the
+// store-wide write version does not share a line with the header fields every operation reads.
+static void layout_test(void) {
+    kvOptions options = { .pods = 7, .slotsPerPod = 64, .keyBytes = 20, .valueBytes = valueSize, .orderedIndex = 1 };
+
+    printf("-----------Layout-----------\n");
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    if (kv_store_create_with(__TEST3_SHARED_MEM_NAME__, &options) < 0) {
+        check(0, "kv_store_create_with");
+        return;
+    }
+    kvStore *header = (kvStore *) kvStoreInfoAddr;
+    uint64_t offsets[] = { header->podMetaOffset, header->indexHeadsOffset, header->slotNextOffset,
+                           header->slotPrevOffset, header->slotBucketsOffset, header->slotPrintsOffset,
+                           header->keysOffset, header->valueOffsetsOffset, header->slotExpiryOffset,
+                           header->slotAccessOffset, header->skipHeadsOffset, header->skipNextOffset,
+                           header->skipPrevOffset, header->slotVersionsOffset, header->dropVersionsOffset,
+                           header->arenaOffset };
+    int misaligned = 0;
+    for (size_t i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+        misaligned += offsets[i] % 64 != 0 || offsets[i] < sizeof(kvStore);
+    }
+    check(misaligned == 0, "every region starts on a cache line after the header");
+    check(sizeof(kvPodMeta) % 64 == 0 && (uintptr_t) layout->podMeta % 64 == 0, "pod metadata fills whole lines");
+    check(offsetof(kvStore, writeVersion) % 64 == 0 && offsetof(kvStore, users) % 64 == 0,
+          "the write version and the user slots start lines of their own");
+    check(header->keyStride == 24, "keys are padded to 8 bytes");
+    kv_delete_db();
+}
+
+// A watch returns as soon as another process writes the key's pod, and only once its timeout passed when the
+// writes go to other pods.
+static void watch_test(void) {
+    kvOptions options = { .pods = 16, .slotsPerPod = 64, .keyBytes = keySize, .valueBytes = valueSize,
+                          .placement = KV_PLACE_ONE };
+    char key[keySize];
+    char other[keySize];
+    struct timespec start;
+
+    printf("-----------Watch-----------\n");
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    if (kv_store_create_with(__TEST3_SHARED_MEM_NAME__, &options) < 0) {
+        check(0, "kv_store_create_with");
+        return;
+    }
+    pod_key(key, "watch", 2);
+    pod_key(other, "other", 9);
+    kv_store_write(key, "first");
+    unsigned int version = kv_store_version(key);
+    check(kv_store_watch(key, version, 0) == version, "a watch without a timeout returns at once");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid == 0) {
+        struct timespec pause = { 0, 100 * 1000 * 1000 };
+        nanosleep(&pause, NULL);
+        kv_store_write(other, "elsewhere");
+        _exit(0);
+    }
+    check(kv_store_watch(key, version, 300) == version && elapsed_ms(&start) >= 290,
+          "a watch times out when only other pods are written");
+    waitpid(pid, NULL, 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid = fork();
+    if (pid == 0) {
+        struct timespec pause = { 0, 100 * 1000 * 1000 };
+        nanosleep(&pause, NULL);
+        kv_store_write(key, "second");
+        _exit(0);
+    }
+    unsigned int woken = kv_store_watch(key, version, 5000);
+    check(woken != version && woken == kv_store_version(key) && elapsed_ms(&start) < 2000,
+          "a write by another process wakes the watch");
+    waitpid(pid, NULL, 0);
+    char **values = kv_store_read_all(key);
+    int seen = 0;
+    for (int i = 0; values != NULL && values[i] != NULL; i++) {
+        seen += strcmp(values[i], "second") == 0;
+        free(values[i]);
+    }
+    free(values);
+    check(seen == 1, "the write that woke the watch is read");
+    kv_delete_db();
+}
+
+// Entries written with a TTL stop being read once it passed, before anything reclaimed them; kv_store_expire()
+// then frees exactly the expired slots of its pod, and the sweeper those of every pod.
+static void ttl_test(void) {
+    kvOptions options = { .pods = 4, .slotsPerPod = 64, .keyBytes = keySize, .valueBytes = valueSize,
+                          .placement = KV_PLACE_ONE };
+    char key[keySize];
+    char keep[keySize];
+    struct timespec expire = { 3, 100 * 1000 * 1000 };
+    struct timespec sweep = { 0, 200 * 1000 * 1000 };
+    kvPodStats stats;
+    int written[4] = { 0 };
+
+    printf("-----------Expiry-----------\n");
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    if (kv_store_create_with(__TEST3_SHARED_MEM_NAME__, &options) < 0) {
+        check(0, "kv_store_create_with");
+        return;
+    }
+    for (int i = 0; i < 40; i++) {
+        test_key(key, "ttl", i);
+        kv_store_write_ttl(key, "short lived", 2);
+        written[hash(key)]++;
+    }
+    pod_key(keep, "keep", 0);
+    kv_store_write_ttl(keep, "kept", 0);
+    check(restore_count("ttl", 40, "short lived") == 40, "entries are read before their TTL passed");
+
+    nanosleep(&expire, NULL);
+    check(restore_count("ttl", 40, "short lived") == 0, "entries are not read once their TTL passed");
+    char *read = kv_store_read(keep);
+    check(read != NULL && strcmp(read, "kept") == 0, "an entry without a TTL stays");
+    free(read);
+    check(kv_store_pod_stats(1, &stats) == 0 && stats.live == written[1], "expired entries keep their slots until reclaimed");
+
+    check(kv_store_expire(0) == written[0], "kv_store_expire() reclaims every expired slot of its pod");
+    check(kv_store_pod_stats(0, &stats) == 0 && stats.live == 1, "only the entry without a TTL is left in the pod");
+    check(kv_store_sweeper_start(20) == 0, "kv_store_sweeper_start");
+    nanosleep(&sweep, NULL);
+    kv_store_sweeper_stop();
+    int live = 0;
+    for (int podNum = 1; podNum < options.pods; podNum++) {
+        kv_store_pod_stats(podNum, &stats);
+        live += stats.live;
+    }
+    check(live == 0, "the sweeper reclaims the expired slots of every pod");
+    kv_delete_db();
+}
+
+// Fills a single pod under policy, reads every key but the newest, and writes 8 keys more. Returns whether the
+// newest key is left, or -1 if the key read last was dropped.
+static int evict_unread(int policy) {
+    kvOptions options = { .pods = 1, .slotsPerPod = 64, .keyBytes = keySize, .valueBytes = valueSize,
+                          .evictionPolicy = policy };
+    char key[keySize];
+
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    if (kv_store_create_with(__TEST3_SHARED_MEM_NAME__, &options) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < 64; i++) {
+        test_key(key, "evict", i);
+        kv_store_write(key, "value");
+    }
+    for (int i = 0; i < 63; i++) {
+        test_key(key, "evict", i);
+        free(kv_store_read(key));
+    }
+    for (int i = 0; i < 8; i++) {
+        test_key(key, "fresh", i);
+        kv_store_write(key, "value");
+    }
+    test_key(key, "evict", 63);
+    char *newest = kv_store_read(key);
+    test_key(key, "evict", 62);
+    char *lastRead = kv_store_read(key);
+    int result = lastRead == NULL ? -1 : newest != NULL;
+    free(newest);
+    free(lastRead);
+    kv_delete_db();
+    return result;
+}
+
+// FIFO drops the oldest entries whether they were read or not; CLOCK and LRU drop the one entry nobody read
+// although it was written last.
+static void evict_test(void) {
+    printf("-----------Eviction-----------\n");
+    check(evict_unread(KV_EVICT_FIFO) == 1, "FIFO evicts the oldest entries");
+    check(evict_unread(KV_EVICT_CLOCK) == 0, "CLOCK evicts the entry that was not read");
+    check(evict_unread(KV_EVICT_LRU) == 0, "LRU evicts the least recently used entry");
+}
+
+// Which of its candidate pods holds key: 0 or 1, or -1 if neither does.
+static int key_candidate(char *key) {
+    unsigned long pods[2];
+    int count = key_pods(key_hash(key), pods);
+    for (int i = 0; i < count; i++) {
+        if (pod_holds(pods[i], key)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Under two-choice placement some keys go to their second pod; every way of reading finds them there, and
+// writing such a key again adds to that pod rather than starting over in the first one.
+static void placement_test(void) {
+    kvOptions options = { .pods = 16, .slotsPerPod = 64, .keyBytes = keySize, .valueBytes = valueSize };
+    const int count = 256;
+    char *keys[count];
+    char value[32];
+    int candidates[2] = { 0, 0 };
+    char *second = NULL;
+
+    printf("-----------Placement-----------\n");
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    if (kv_store_create_with(__TEST3_SHARED_MEM_NAME__, &options) < 0) {
+        check(0, "kv_store_create_with");
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        keys[i] = calloc(1, keySize);
+        test_key(keys[i], "place", i);
+        snprintf(value, sizeof(value), "value-%d", i);
+        kv_store_write(keys[i], value);
+    }
+    for (int i = 0; i < count; i++) {
+        int candidate = key_candidate(keys[i]);
+        if (candidate >= 0) {
+            candidates[candidate]++;
+        }
+        if (candidate == 1 && second == NULL) {
+            second = keys[i];
+        }
+    }
+    check(candidates[0] + candidates[1] == count, "every key is in one of its pods");
+    check(candidates[1] > 0, "some keys are placed in their second pod");
+
+    int modes[] = { KV_LOOKUP_INDEX, KV_LOOKUP_FINGERPRINT, KV_LOOKUP_SCAN };
+    for (int m = 0; m < 3; m++) {
+        kv_store_lookup_mode(modes[m]);
+        int missed = 0;
+        for (int i = 0; i < count; i++) {
+            snprintf(value, sizeof(value), "value-%d", i);
+            char *read = kv_store_read(keys[i]);
+            char **all = kv_store_read_all(keys[i]);
+            missed += read == NULL || strcmp(read, value) != 0;
+            missed += all == NULL || all[0] == NULL || strcmp(all[0], value) != 0 || all[1] != NULL;
+            for (int v = 0; all != NULL && all[v] != NULL; v++) {
+                free(all[v]);
+            }
+            free(all);
+            free(read);
+        }
+        char **batch = kv_store_read_batch(keys, count);
+        for (int i = 0; i < count; i++) {
+            snprintf(value, sizeof(value), "value-%d", i);
+            missed += batch == NULL || batch[i] == NULL || strcmp(batch[i], value) != 0;
+            free(batch != NULL ? batch[i] : NULL);
+        }
+        free(batch);
+        check(missed == 0, "reads, reads of all values and batches find keys in either pod");
+    }
+    kv_store_lookup_mode(KV_LOOKUP_INDEX);
+
+    if (second != NULL) {
+        kv_store_write(second, "again");
+        char **all = kv_store_read_all(second);
+        int values = 0;
+        for (int v = 0; all != NULL && all[v] != NULL; v++) {
+            free(all[v]);
+            values++;
+        }
+        free(all);
+        check(key_candidate(second) == 1 && values == 2, "a key in its second pod is written there again");
+    }
+    kv_delete_db();
+    for (int i = 0; i < count; i++) {
+        free(keys[i]);
+    }
+
+    options.placement = KV_PLACE_ONE;
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    if (kv_store_create_with(__TEST3_SHARED_MEM_NAME__, &options) < 0) {
+        check(0, "kv_store_create_with");
+        return;
+    }
+    char key[keySize];
+    int elsewhere = 0;
+    for (int i = 0; i < count; i++) {
+        test_key(key, "place", i);
+        kv_store_write(key, "value");
+        elsewhere += key_candidate(key) != 0 || !pod_holds(hash(key), key);
+    }
+    check(elsewhere == 0, "one-pod placement keeps every key in the pod hash() picks");
+    kv_delete_db();
+}
+
+// Runs scan to its end in batches of maxKeys, as one string of the keys in the order they came. Sets *sorted to
+// whether every key came after the one before it.
+static char *scan_join(kvScan *scan, int maxKeys, int *sorted) {
+    char *keys[maxKeys];
+    char *joined = calloc(1, 1);
+    size_t length = 1;
+    char *previous = NULL;
+    int count;
+
+    *sorted = 1;
+    while ((count = kv_store_scan_next(scan, keys, maxKeys)) > 0) {
+        for (int i = 0; i < count; i++) {
+            *sorted = *sorted && (previous == NULL || strcmp(previous, keys[i]) < 0);
+            length += strlen(keys[i]) + 1;
+            joined = realloc(joined, length);
+            strcat(joined, keys[i]);
+            strcat(joined, "|");
+            free(previous);
+            previous = keys[i];
+        }
+    }
+    free(previous);
+    kv_store_scan_close(scan);
+    return joined;
+}
+
+// The keys a prefix scan returns, in batches of maxKeys.
+static char *scan_prefix_join(const char *prefix, int maxKeys, int *sorted) {
+    kvScan scan;
+    kv_store_scan_prefix(&scan, prefix);
+    return scan_join(&scan, maxKeys, sorted);
+}
+
+// The keys a range scan returns, in batches of maxKeys.
+static char *scan_range_join(const char *from, const char *to, int maxKeys, int *sorted) {
+    kvScan scan;
+    kv_store_scan_range(&scan, from, to);
+    return scan_join(&scan, maxKeys, sorted);
+}
+
+// Scans return the keys of their range once each and in order, whatever the batch size and with or without the
+// ordered index: ranges start at from and stop before to, batches that end right at the last key are followed by
+// an empty one, and a prefix ending in 0xff bytes covers the keys that extend it but not those after it.
+static void scan_test(void) {
+    kvOptions options = { .pods = 8, .slotsPerPod = 64, .keyBytes = keySize, .valueBytes = valueSize };
+    char key[keySize];
+    const char *edges[] = { "ab", "ab\xff", "ab\xff\xff", "ab\xff" "a", "ac", "b", "\xff", "\xff\xff" };
+    char expected[1024];
+    int sorted;
+
+    printf("-----------Scans-----------\n");
+    for (int ordered = 0; ordered < 2; ordered++) {
+        options.orderedIndex = ordered;
+        shm_unlink(__TEST3_SHARED_MEM_NAME__);
+        if (kv_store_create_with(__TEST3_SHARED_MEM_NAME__, &options) < 0) {
+            check(0, "kv_store_create_with");
+            return;
+        }
+        expected[0] = '\0';
+        for (int i = 0; i < 40; i++) {
+            snprintf(key, sizeof(key), "scan-%02d", i);
+            kv_store_write(key, "first");
+            kv_store_write(key, "second");
+            strcat(expected, key);
+            strcat(expected, "|");
+        }
+        for (size_t i = 0; i < sizeof(edges) / sizeof(edges[0]); i++) {
+            strcpy(key, edges[i]);
+            kv_store_write(key, "value");
+        }
+
+        int batches[] = { 1, 7, 8, 40, 41, 2000 };
+        for (size_t i = 0; i < sizeof(batches) / sizeof(batches[0]); i++) {
+            char *found = scan_prefix_join("scan-", batches[i], &sorted);
+            check(sorted && strcmp(found, expected) == 0, "a prefix scan returns each key once, in order");
+            free(found);
+        }
+        char *found = scan_range_join("scan-10", "scan-20", 3, &sorted);
+        check(strncmp(found, "scan-10|", 8) == 0 && strstr(found, "scan-20") == NULL && strlen(found) == 80,
+              "a range starts at from and stops before to");
+        free(found);
+        found = scan_range_join("scan-20", "scan-10", 3, &sorted);
+        check(found[0] == '\0', "a range ending before it starts is empty");
+        free(found);
+        found = scan_prefix_join("none", 8, &sorted);
+        check(found[0] == '\0', "a prefix no key has is empty");
+        free(found);
+        found = scan_range_join("scan-38", NULL, 8, &sorted);
+        check(strcmp(found, "scan-38|scan-39|\xff|\xff\xff|") == 0, "a range without an end runs to the last key");
+        free(found);
+
+        found = scan_prefix_join("ab\xff", 2, &sorted);
+        check(sorted && strcmp(found, "ab\xff|ab\xff" "a|ab\xff\xff|") == 0,
+              "a prefix ending in 0xff covers the keys extending it and not the next prefix");
+        free(found);
+        found = scan_prefix_join("\xff", 1, &sorted);
+        check(strcmp(found, "\xff|\xff\xff|") == 0, "a prefix of 0xff bytes runs to the last key");
+        free(found);
+        found = scan_prefix_join("", 2000, &sorted);
+        check(sorted && strlen(found) == strlen(expected) + 27, "an empty prefix returns every key");
+        free(found);
+        kv_delete_db();
+    }
+}
+
+// Frees a NULL-terminated array of values and returns how many there were.
+static int values_free(char **values) {
+    int count = 0;
+    while (values != NULL && values[count] != NULL) {
+        free(values[count++]);
+    }
+    free(values);
+    return count;
+}
+
+// A snapshot leaves out values written after it began, and once the entry it needs was evicted it answers -1
+// rather than a partial list. The slot the entry was in goes to a newer key, which the snapshot does not see,
+// while keys of other chains keep reading as they were.
+static void mvcc_test(void) {
+    kvOptions options = { .pods = 1, .slotsPerPod = 64, .keyBytes = keySize, .valueBytes = valueSize };
+    kvSnapshotHandle before, after;
+    char key[keySize] = "mvcc";
+    char other[keySize];
+    char fresh[keySize];
+    char **values;
+
+    printf("-----------Snapshot reads-----------\n");
+    shm_unlink(__TEST3_SHARED_MEM_NAME__);
+    if (kv_store_create_with(__TEST3_SHARED_MEM_NAME__, &options) < 0) {
+        check(0, "kv_store_create_with");
+        return;
+    }
+    kv_store_write(key, "one");
+    for (int i = 0; i < 61; i++) {
+        test_key(other, "fill", i);
+        kv_store_write(other, "value");
+    }
+    kv_store_snapshot_begin(&before);
+    kv_store_write(key, "two");
+    int count = kv_store_snapshot_read_all(&before, key, &values);
+    check(count == 1 && strcmp(values[0], "one") == 0, "a snapshot leaves out values written after it");
+    values_free(values);
+    check(values_free(kv_store_read_all(key)) == 2, "a plain read sees both values");
+    test_key(fresh, "late", 0);
+    kv_store_write(fresh, "value");
+    check(kv_store_snapshot_read_all(&before, fresh, &values) == 0 && values == NULL,
+          "a key written after the snapshot has no values in it");
+
+    // The pod is full and its oldest entry is key's first value, whose slot a key of another chain takes
+    for (int i = 0; key_bucket(fresh) == key_bucket(key); i++) {
+        test_key(fresh, "new", i);
+    }
+    kv_store_write(fresh, "value");
+    check(kv_store_snapshot_read_all(&before, key, &values) == -1 && values == NULL,
+          "a snapshot whose entry was evicted is too old");
+    check(kv_store_snapshot_read_all(&before, fresh, &values) == 0,
+          "a reused slot's new entry is not seen by an older snapshot");
+    kv_store_snapshot_begin(&after);
+    count = kv_store_snapshot_read_all(&after, key, &values);
+    check(count == 1 && strcmp(values[0], "two") == 0, "a snapshot taken after the eviction reads what is left");
+    values_free(values);
+
+    int wrong = 0;
+    for (int i = 0; i < 61; i++) {
+        test_key(other, "fill", i);
+        if (key_bucket(other) != key_bucket(key)) {
+            count = kv_store_snapshot_read_all(&before, other, &values);
+            wrong += count != 1 || strcmp(values[0], "value") != 0;
+            values_free(values);
+        }
+    }
+    check(wrong == 0, "an eviction leaves snapshots of other chains readable");
+    kv_delete_db();
+}
+
+int main() {
+    srand(time(NULL));
+
+    arena_fill_test();
+    restore_test();
+    wal_test();
+    recover_test();
+    lz_test();
+    batch_test();
+    lease_test();
+    grow_test();
+    lock_test();
+    seqlock_test();
+    index_test();
+    fingerprint_test();
+    geometry_test();
+    hash_test();
+    layout_test();
+    watch_test();
+    ttl_test();
+    evict_test();
+    placement_test();
+    scan_test();
+    mvcc_test();
+
+    printf("-----------TOTAL ERROR: %d-----------\n", errors);
+    return errors != 0;
+}
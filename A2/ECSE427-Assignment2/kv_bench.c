@@ -0,0 +1,674 @@
+//
+//  kv_bench.c
+//  ECSE427-Assignment2
+//
+//  Multi-process benchmark of the store under a configurable mix. Forks readers and writers against one
+//  store and reports the aggregate throughput plus read and write latency percentiles taken from HDR-style
+//  log-linear histograms (about 3% precision at any magnitude).
+//
+//  By default it sweeps one dimension at a time around a baseline scenario (3 readers + 1 writer, mixed key
+//  sizes, small values, Zipfian keys): the reader/writer split, the key size and value size distributions and
+//  the key skew. -r and -w pin the split instead of sweeping it.
+//
+//  It then compares the eviction policies: a cache-aside loop (read, write the key back on a miss) over many more
+//  keys than a small store holds, reporting the hit rate of FIFO, CLOCK and LRU under Zipfian keys. Last, it fills
+//  a small store to increasing fractions of its capacity with distinct keys and reports how many survive with
+//  two-choice and single-pod placement, compares arena footprint and latency with and without compression on
+//  JSON-like values, times prefix and full scans with and without the ordered index, and times read_all next to
+//  a writer with locked and with versioned (point-in-time) reads.
+//
+//  Usage: ./kv_bench [-r readers] [-w writers] [-n ops per process] [-k distinct keys]
+//
+
+#include <sys/wait.h>
+#include <math.h>
+#include <time.h>
+#include "a2_lib.h"
+
+#define subBucketBits 5
+#define subBuckets (1 << subBucketBits)
+#define histBuckets (64 * subBuckets)
+
+typedef struct {
+    uint64_t count;
+    uint64_t buckets[histBuckets];
+} latencyHist;
+
+// What each forked process reports back through the shared results page
+typedef struct {
+    latencyHist reads;
+    latencyHist writes;
+    uint64_t failedWrites;
+} workerResult;
+
+typedef struct {
+    const char *name;
+    int minLength;
+    int maxLength;
+} lengthDist;
+
+typedef struct {
+    const char *name;
+    int readers;
+    int writers;
+    lengthDist keys;
+    lengthDist values;
+    double zipfTheta;                                   // 0 for uniform keys
+} scenario;
+
+static const lengthDist keyDists[] = {
+    { "key 8", 8, 8 },
+    { "key 8-31", 8, keySize - 1 },
+    { "key 31", keySize - 1, keySize - 1 },
+};
+
+static const lengthDist valueDists[] = {
+    { "val 16-256", 16, 256 },
+    { "val 32", 32, 32 },
+    { "val 256-4k", 256, 4000 },
+};
+
+static int distinctKeys = 50000;
+static int opsPerProcess = 20000;
+
+// Writes of this process that the store refused, reported rather than ignored so that a run which overflowed the
+// store cannot pass for a fast one
+static long failedWrites;
+
+static void bench_write(char *key, char *value) {
+    if (kv_store_write(key, value) != 0) {
+        failedWrites++;
+    }
+}
+
+static uint64_t now_nanoseconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// xorshift64*: cheap enough not to show up in the latencies
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static double next_unit(uint64_t *state) {
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Log-linear bucketing: values below 2 * subBuckets get their own bucket, above that every power of two is split
+// into subBuckets equal buckets.
+static int hist_bucket(uint64_t value) {
+    if (value < 2 * subBuckets) {
+        return value;
+    }
+    int shift = 63 - __builtin_clzll(value) - subBucketBits;
+    return (shift + 1) * subBuckets + (int) ((value >> shift) - subBuckets);
+}
+
+// Highest value that lands in the bucket
+static uint64_t hist_value(int bucket) {
+    if (bucket < 2 * subBuckets) {
+        return bucket;
+    }
+    int shift = bucket / subBuckets - 1;
+    return (((uint64_t) (bucket % subBuckets + subBuckets) + 1) << shift) - 1;
+}
+
+static void hist_record(latencyHist *hist, uint64_t value) {
+    hist->buckets[hist_bucket(value)]++;
+    hist->count++;
+}
+
+static void hist_merge(latencyHist *into, const latencyHist *from) {
+    for (int b = 0; b < histBuckets; b++) {
+        into->buckets[b] += from->buckets[b];
+    }
+    into->count += from->count;
+}
+
+static uint64_t hist_percentile(const latencyHist *hist, double percentile) {
+    uint64_t rank = (uint64_t) ceil(hist->count * percentile / 100.0);
+    uint64_t seen = 0;
+
+    if (hist->count == 0) {
+        return 0;
+    }
+    for (int b = 0; b < histBuckets; b++) {
+        seen += hist->buckets[b];
+        if (seen >= rank) {
+            return hist_value(b);
+        }
+    }
+    return hist_value(histBuckets - 1);
+}
+
+// Zipfian ranks (Gray et al., as used by YCSB). The rank is scrambled afterwards so the hot keys are spread over
+// the pods instead of all being neighbours.
+typedef struct {
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+} zipfGen;
+
+static void zipf_init(zipfGen *zipf, int n, double theta) {
+    double zeta2 = 1 + pow(0.5, theta);
+
+    zipf->theta = theta;
+    zipf->zetan = 0;
+    for (int i = 1; i <= n; i++) {
+        zipf->zetan += 1 / pow(i, theta);
+    }
+    zipf->alpha = 1 / (1 - theta);
+    zipf->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zipf->zetan);
+}
+
+static int next_key(const scenario *run, const zipfGen *zipf, uint64_t *state) {
+    if (run->zipfTheta == 0) {
+        return next_random(state) % distinctKeys;
+    }
+    double u = next_unit(state);
+    double uz = u * zipf->zetan;
+    long rank;
+    if (uz < 1) {
+        rank = 0;
+    } else if (uz < 1 + pow(0.5, zipf->theta)) {
+        rank = 1;
+    } else {
+        rank = (long) (distinctKeys * pow(zipf->eta * u - zipf->eta + 1, zipf->alpha));
+    }
+    return mix64(rank) % distinctKeys;
+}
+
+// Every key has a fixed length drawn from the key distribution, so the same key is always the same string.
+static void make_key(char *key, const lengthDist *dist, int i) {
+    int length = dist->minLength + mix64(i + 1) % (dist->maxLength - dist->minLength + 1);
+    memset(key, 0, keySize);
+    snprintf(key, length + 1, "%0*d", length, i);
+}
+
+static void make_value(char *value, const lengthDist *dist, uint64_t *state) {
+    int length = dist->minLength + next_random(state) % (dist->maxLength - dist->minLength + 1);
+    value[length] = '\0';
+}
+
+static void run_worker(const scenario *run, const zipfGen *zipf, int isWriter, int id, workerResult *result) {
+    char key[keySize];
+    char *value = malloc(maxValueSize + 1);
+    uint64_t state = mix64(getpid() * 31 + id) | 1;
+
+    memset(value, 'v', maxValueSize + 1);
+    memset(result, 0, sizeof(workerResult));
+    for (int i = 0; i < opsPerProcess; i++) {
+        make_key(key, &run->keys, next_key(run, zipf, &state));
+        if (isWriter) {
+            make_value(value, &run->values, &state);
+            uint64_t start = now_nanoseconds();
+            result->failedWrites += kv_store_write(key, value) != 0;
+            hist_record(&result->writes, now_nanoseconds() - start);
+            value[strlen(value)] = 'v';
+        } else {
+            uint64_t start = now_nanoseconds();
+            char *found = kv_store_read(key);
+            hist_record(&result->reads, now_nanoseconds() - start);
+            free(found);
+        }
+    }
+    free(value);
+}
+
+// Single-process cache-aside run against a store of hitRateSlots slots with the given eviction policy.
+#define hitRatePods 64
+#define hitRateSlots (hitRatePods * 64)
+
+static double run_hit_rate(int policy, double theta, int keys, int ops) {
+    kvOptions options = { .pods = hitRatePods, .slotsPerPod = hitRateSlots / hitRatePods, .keyBytes = keySize,
+                          .valueBytes = 32, .hashFunction = KV_HASH_WY, .evictionPolicy = policy };
+    scenario run = { "hit rate", 1, 0, keyDists[1], valueDists[1], theta };
+    int savedKeys = distinctKeys;
+    uint64_t state = 7;
+    char key[keySize];
+    long hits = 0;
+    zipfGen zipf;
+
+    distinctKeys = keys;
+    zipf_init(&zipf, keys, theta);
+    shm_unlink(DATA_BASE_NAME);
+    if (kv_store_create_with(DATA_BASE_NAME, &options) < 0) {
+        distinctKeys = savedKeys;
+        return -1;
+    }
+    for (int i = 0; i < ops; i++) {
+        make_key(key, &run.keys, next_key(&run, &zipf, &state));
+        char *found = kv_store_read(key);
+        if (found != NULL) {
+            hits++;
+            free(found);
+        } else {
+            bench_write(key, "cached value, 32 bytes long ...");
+        }
+    }
+    kv_delete_db();
+    distinctKeys = savedKeys;
+    return 100.0 * hits / ops;
+}
+
+// Writes keys distinct keys once each into a small store and returns the percentage still readable afterwards,
+// i.e. how much of the store's capacity is usable before full pods evict live keys.
+static double run_fill(int placement, int keys) {
+    kvOptions options = { .pods = hitRatePods, .slotsPerPod = hitRateSlots / hitRatePods, .keyBytes = keySize,
+                          .valueBytes = 32, .hashFunction = KV_HASH_WY, .evictionPolicy = KV_EVICT_FIFO,
+                          .placement = placement };
+    char key[keySize];
+    int kept = 0;
+
+    shm_unlink(DATA_BASE_NAME);
+    if (kv_store_create_with(DATA_BASE_NAME, &options) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < keys; i++) {
+        make_key(key, &keyDists[1], i);
+        bench_write(key, "cached value, 32 bytes long ...");
+    }
+    for (int i = 0; i < keys; i++) {
+        make_key(key, &keyDists[1], i);
+        char *found = kv_store_read(key);
+        kept += found != NULL;
+        free(found);
+    }
+    kv_delete_db();
+    return 100.0 * kept / keys;
+}
+
+// Fills a small store with JSON-like values of valueLength bytes, compressed above compressAbove bytes (0 never),
+// and reads them all back. Returns the arena bytes used per value; *writeNs and *readNs get the average latencies.
+static double run_compress(int compressAbove, int valueLength, double *writeNs, double *readNs) {
+    kvOptions options = { .pods = hitRatePods, .slotsPerPod = hitRateSlots / hitRatePods, .keyBytes = keySize,
+                          .valueBytes = valueLength, .hashFunction = KV_HASH_WY, .evictionPolicy = KV_EVICT_FIFO,
+                          .placement = KV_PLACE_TWO_CHOICE, .compressAbove = compressAbove };
+    char key[keySize];
+    char *value = malloc(valueLength + 1);
+    int keys = hitRateSlots / 2;
+    kvStats stats;
+
+    shm_unlink(DATA_BASE_NAME);
+    if (kv_store_create_with(DATA_BASE_NAME, &options) < 0) {
+        free(value);
+        return -1;
+    }
+    uint64_t start = now_nanoseconds();
+    uint64_t state = 42;
+    for (int i = 0; i < keys; i++) {
+        int used = 0;
+        for (int record = 0; used < valueLength; record++) {
+            used += snprintf(value + used, valueLength - used + 1,
+                             "{\"id\":%d,\"user\":\"user-%llu\",\"score\":%llu,\"active\":%s},", i * 64 + record,
+                             (unsigned long long) next_random(&state) % 100000,
+                             (unsigned long long) next_random(&state) % 1000, record % 3 ? "true" : "false");
+        }
+        make_key(key, &keyDists[1], i);
+        bench_write(key, value);
+    }
+    *writeNs = (double) (now_nanoseconds() - start) / keys;
+    start = now_nanoseconds();
+    for (int i = 0; i < keys; i++) {
+        make_key(key, &keyDists[1], i);
+        free(kv_store_read(key));
+    }
+    *readNs = (double) (now_nanoseconds() - start) / keys;
+    kv_store_stats(&stats);
+    kv_delete_db();
+    free(value);
+    return (double) stats.arenaUsed / keys;
+}
+
+// Writes scanUsers users with scanKeysPerUser keys each ("user:<u>:<k>") into a store with or without the ordered
+// index, then scans one user's prefix at a time and finally the whole store. Reports average latencies in ns.
+#define scanUsers 250
+#define scanKeysPerUser 32
+
+static int run_scan(int orderedIndex, double *writeNs, double *prefixNs, double *fullNs) {
+    kvOptions options = { .pods = 256, .slotsPerPod = 64, .keyBytes = keySize, .valueBytes = 32,
+                          .hashFunction = KV_HASH_WY, .evictionPolicy = KV_EVICT_FIFO,
+                          .placement = KV_PLACE_TWO_CHOICE, .orderedIndex = orderedIndex };
+    char key[keySize];
+    char *keys[kvScanMaxBatch];
+    char prefix[keySize];
+    kvScan scan;
+    int keysCount = scanUsers * scanKeysPerUser;
+    int found = 0;
+
+    shm_unlink(DATA_BASE_NAME);
+    if (kv_store_create_with(DATA_BASE_NAME, &options) < 0) {
+        return -1;
+    }
+    uint64_t start = now_nanoseconds();
+    for (int i = 0; i < keysCount; i++) {
+        memset(key, 0, keySize);
+        snprintf(key, keySize, "user:%d:%d", i % scanUsers, i / scanUsers);
+        bench_write(key, "scan value");
+    }
+    *writeNs = (double) (now_nanoseconds() - start) / keysCount;
+
+    start = now_nanoseconds();
+    for (int u = 0; u < scanUsers; u++) {
+        snprintf(prefix, keySize, "user:%d:", u);
+        kv_store_scan_prefix(&scan, prefix);
+        for (int n; (n = kv_store_scan_next(&scan, keys, 64)) > 0; ) {
+            for (int i = 0; i < n; i++) {
+                free(keys[i]);
+            }
+        }
+        kv_store_scan_close(&scan);
+    }
+    *prefixNs = (double) (now_nanoseconds() - start) / scanUsers;
+
+    start = now_nanoseconds();
+    kv_store_scan_range(&scan, NULL, NULL);
+    for (int n; (n = kv_store_scan_next(&scan, keys, kvScanMaxBatch)) > 0; found += n) {
+        for (int i = 0; i < n; i++) {
+            free(keys[i]);
+        }
+    }
+    kv_store_scan_close(&scan);
+    *fullNs = (double) (now_nanoseconds() - start) / (found > 0 ? found : 1);
+    kv_delete_db();
+    return 0;
+}
+
+// Keeps readAllKeys keys with readAllValues values each in a store of 256 pods and has one process add entries of
+// other keys to the same pods (never filling them, so the kept entries stay) while this one calls
+// kv_store_read_all() on the kept keys, with locked reads or versioned ones. Reports the average read_all latency
+// and the writer's throughput.
+#define readAllKeys 64
+#define readAllValues 8
+
+static int run_read_all(int mode, double *readNs, double *writesPerSec) {
+    kvOptions options = { .pods = 256, .slotsPerPod = 256, .keyBytes = keySize, .valueBytes = 32,
+                          .hashFunction = KV_HASH_WY, .evictionPolicy = KV_EVICT_FIFO, .placement = KV_PLACE_ONE };
+    char key[keySize];
+    int writes = opsPerProcess * 5 < 256 * 192 ? opsPerProcess * 5 : 256 * 192;
+    long reads = 0;
+
+    shm_unlink(DATA_BASE_NAME);
+    if (kv_store_create_with(DATA_BASE_NAME, &options) < 0) {
+        return -1;
+    }
+    kv_store_read_mode(mode);
+    for (int i = 0; i < readAllKeys * readAllValues; i++) {
+        memset(key, 0, keySize);
+        snprintf(key, keySize, "kept:%d", i % readAllKeys);
+        bench_write(key, "kept value");
+    }
+
+    fflush(stdout);
+    uint64_t start = now_nanoseconds();
+    pid_t writer = fork();
+    if (writer == 0) {
+        for (int i = 0; i < writes; i++) {
+            memset(key, 0, keySize);
+            snprintf(key, keySize, "churn:%d", i % 4096);
+            bench_write(key, "churn value");
+        }
+        exit(failedWrites > 0);
+    }
+    int status;
+    while (waitpid(writer, &status, WNOHANG) == 0) {
+        memset(key, 0, keySize);
+        snprintf(key, keySize, "kept:%ld", reads % readAllKeys);
+        char **values = kv_store_read_all(key);
+        for (int i = 0; values != NULL && values[i] != NULL; i++) {
+            free(values[i]);
+        }
+        free(values);
+        reads++;
+    }
+    uint64_t elapsed = now_nanoseconds() - start;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "read_all: the writer's writes failed\n");
+        failedWrites++;
+    }
+    *readNs = (double) elapsed / (reads > 0 ? reads : 1);
+    *writesPerSec = writes / (elapsed / 1e9);
+    kv_store_read_mode(KV_READ_OPTIMISTIC);
+    kv_delete_db();
+    return 0;
+}
+
+static void print_hist(const latencyHist *hist) {
+    if (hist->count == 0) {
+        printf(" %8s %8s %8s", "-", "-", "-");
+        return;
+    }
+    printf(" %8llu %8llu %8llu", (unsigned long long) hist_percentile(hist, 50),
+           (unsigned long long) hist_percentile(hist, 99), (unsigned long long) hist_percentile(hist, 99.9));
+}
+
+static int run_scenario(const scenario *run, workerResult *results) {
+    int processes = run->readers + run->writers;
+    kvOptions options = { .pods = numberOfPods, .slotsPerPod = podSize, .keyBytes = keySize,
+                          .valueBytes = (run->values.minLength + run->values.maxLength) / 2 };
+    long failedBefore = failedWrites;
+    char key[keySize];
+    char *value = malloc(maxValueSize + 1);
+    uint64_t state = 42;
+    zipfGen zipf;
+
+    if (run->zipfTheta > 0) {
+        zipf_init(&zipf, distinctKeys, run->zipfTheta);
+    }
+
+    // Every scenario starts from a fresh store holding each key once, with an arena sized for its values
+    shm_unlink(DATA_BASE_NAME);
+    if (kv_store_create_with(DATA_BASE_NAME, &options) < 0) {
+        free(value);
+        return -1;
+    }
+    memset(value, 'v', maxValueSize + 1);
+    for (int i = 0; i < distinctKeys; i++) {
+        make_key(key, &run->keys, i);
+        make_value(value, &run->values, &state);
+        bench_write(key, value);
+        value[strlen(value)] = 'v';
+    }
+    free(value);
+
+    fflush(stdout);
+    uint64_t start = now_nanoseconds();
+    for (int p = 0; p < processes; p++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            run_worker(run, &zipf, p >= run->readers, p, &results[p]);
+            exit(0);
+        } else if (pid < 0) {
+            perror("fork failed");
+            return -1;
+        }
+    }
+    while (wait(NULL) > 0) {
+    }
+    double elapsed = (now_nanoseconds() - start) / 1e9;
+
+    latencyHist reads, writes;
+    memset(&reads, 0, sizeof(reads));
+    memset(&writes, 0, sizeof(writes));
+    for (int p = 0; p < processes; p++) {
+        hist_merge(&reads, &results[p].reads);
+        hist_merge(&writes, &results[p].writes);
+        failedWrites += results[p].failedWrites;
+    }
+
+    char split[16];
+    snprintf(split, sizeof(split), "%dR+%dW", run->readers, run->writers);
+    printf("%-10s %-7s %-9s %-11s %-7s %12.0f", run->name, split, run->keys.name, run->values.name,
+           run->zipfTheta > 0 ? "zipf" : "uniform", (reads.count + writes.count) / elapsed);
+    print_hist(&reads);
+    print_hist(&writes);
+    printf(" %8ld\n", failedWrites - failedBefore);
+
+    kv_delete_db();
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int readers = 3;
+    int writers = 1;
+    int sweepSplit = 1;
+    int option;
+
+    while ((option = getopt(argc, argv, "r:w:n:k:")) != -1) {
+        switch (option) {
+            case 'r':
+                readers = atoi(optarg);
+                sweepSplit = 0;
+                break;
+            case 'w':
+                writers = atoi(optarg);
+                sweepSplit = 0;
+                break;
+            case 'n':
+                opsPerProcess = atoi(optarg);
+                break;
+            case 'k':
+                distinctKeys = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-r readers] [-w writers] [-n ops per process] [-k distinct keys]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (readers + writers < 1 || distinctKeys < 2 || distinctKeys > maxKeyValuePairs) {
+        fprintf(stderr, "Need at least one process and 2 to %d keys\n", maxKeyValuePairs);
+        return 1;
+    }
+
+    // The split sweep keeps the process count and moves it from all readers to all writers
+    int processes = readers + writers;
+    int splits[][2] = { { processes, 0 }, { processes - 1, 1 }, { processes / 2, processes - processes / 2 }, { 0, processes } };
+    scenario base = { "baseline", readers, writers, keyDists[1], valueDists[0], 0.99 };
+    scenario runs[16];
+    int count = 0;
+
+    runs[count++] = base;
+    for (int s = 0; sweepSplit && s < 4; s++) {
+        if (splits[s][0] != base.readers && splits[s][0] >= 0) {
+            runs[count] = base;
+            runs[count].name = "split";
+            runs[count].readers = splits[s][0];
+            runs[count++].writers = splits[s][1];
+        }
+    }
+    for (int k = 0; k < 3; k++) {
+        if (k != 1) {
+            runs[count] = base;
+            runs[count].name = "key size";
+            runs[count++].keys = keyDists[k];
+        }
+    }
+    for (int v = 1; v < 3; v++) {
+        runs[count] = base;
+        runs[count].name = "value size";
+        runs[count++].values = valueDists[v];
+    }
+    runs[count] = base;
+    runs[count].name = "skew";
+    runs[count++].zipfTheta = 0;
+
+    workerResult *results = mmap(NULL, sizeof(workerResult) * processes, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED) {
+        perror("Could not map results");
+        return 1;
+    }
+
+    printf("%d ops per process, %d distinct keys, latencies in ns\n", opsPerProcess, distinctKeys);
+    printf("%-10s %-7s %-9s %-11s %-7s %12s %8s %8s %8s %8s %8s %8s %8s\n", "scenario", "procs", "keys", "values",
+           "skew", "ops/sec", "rd p50", "rd p99", "rd p999", "wr p50", "wr p99", "wr p999", "failed");
+    for (int r = 0; r < count; r++) {
+        if (run_scenario(&runs[r], results) < 0) {
+            return 1;
+        }
+    }
+
+    munmap(results, sizeof(workerResult) * processes);
+
+    const char *policies[] = { "fifo", "clock", "lru" };
+    double thetas[] = { 0.8, 0.99 };
+    int hitRateKeys = 10 * hitRateSlots;
+    printf("\neviction hit rate: cache-aside over %d keys in %d slots, %d ops\n", hitRateKeys, hitRateSlots,
+           opsPerProcess * 10);
+    printf("%-10s %12s %12s\n", "policy", "zipf 0.8", "zipf 0.99");
+    for (int p = 0; p < 3; p++) {
+        printf("%-10s", policies[p]);
+        for (int t = 0; t < 2; t++) {
+            printf(" %11.1f%%", run_hit_rate(p, thetas[t], hitRateKeys, opsPerProcess * 10));
+        }
+        printf("\n");
+    }
+
+    const char *placements[] = { "two-choice", "single-pod" };
+    double fills[] = { 0.5, 0.75, 0.9, 0.95, 1.0 };
+    printf("\nplacement: %% of distinct keys still stored after writing a fraction of %d slots once\n", hitRateSlots);
+    printf("%-10s", "placement");
+    for (int f = 0; f < 5; f++) {
+        printf(" %11.0f%%", fills[f] * 100);
+    }
+    printf("\n");
+    for (int p = 0; p < 2; p++) {
+        printf("%-10s", placements[p]);
+        for (int f = 0; f < 5; f++) {
+            printf(" %11.1f%%", run_fill(p, fills[f] * hitRateSlots));
+        }
+        printf("\n");
+    }
+
+    int valueLengths[] = { 256, 1024, 4000 };
+    printf("\ncompression: JSON-like values, arena bytes per value and single-process latency in ns\n");
+    printf("%-10s %8s %12s %10s %10s\n", "values", "compress", "arena bytes", "write", "read");
+    for (int v = 0; v < 3; v++) {
+        for (int c = 0; c < 2; c++) {
+            double writeNs = 0, readNs = 0;
+            double bytes = run_compress(c ? 64 : 0, valueLengths[v], &writeNs, &readNs);
+            printf("%-10d %8s %12.0f %10.0f %10.0f\n", valueLengths[v], c ? "on" : "off", bytes, writeNs, readNs);
+        }
+    }
+
+    printf("\nscans: %d keys under %d prefixes, latency in ns\n", scanUsers * scanKeysPerUser, scanUsers);
+    printf("%-10s %10s %14s %14s\n", "index", "write", "prefix scan", "full per key");
+    for (int i = 0; i < 2; i++) {
+        double writeNs = 0, prefixNs = 0, fullNs = 0;
+        if (run_scan(!i, &writeNs, &prefixNs, &fullNs) < 0) {
+            return 1;
+        }
+        printf("%-10s %10.0f %14.0f %14.0f\n", i ? "none" : "ordered", writeNs, prefixNs, fullNs);
+    }
+
+    printf("\nread_all under writes: %d keys x %d values, one writer adding other keys to the same pods\n",
+           readAllKeys, readAllValues);
+    printf("%-10s %14s %14s\n", "reads", "read_all ns", "writes/sec");
+    for (int m = 0; m < 2; m++) {
+        double readNs = 0, writesPerSec = 0;
+        if (run_read_all(m ? KV_READ_OPTIMISTIC : KV_READ_LOCKED, &readNs, &writesPerSec) < 0) {
+            return 1;
+        }
+        printf("%-10s %14.0f %14.0f\n", m ? "versioned" : "locked", readNs, writesPerSec);
+    }
+
+    if (failedWrites > 0) {
+        printf("\n%ld writes failed; the results above include them\n", failedWrites);
+        return 1;
+    }
+    return 0;
+}
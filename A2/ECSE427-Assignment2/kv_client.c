@@ -0,0 +1,554 @@
+//
+//  kv_client.c
+//  ECSE427-Assignment2
+//
+//  The a2_lib.h API over kv_server's socket, for processes that cannot map the store themselves. Link it instead
+//  of a2_lib.c: every call becomes one request to the server, on a connection of the calling thread opened on
+//  first use (and again after a fork or a lost connection). Batches go out as pipelined requests of at most
+//  kvWireMaxBatch entries, all sent before the first response is read.
+//
+//  What differs from a2_lib.c: a lease is a private copy of the value, so it never goes stale; kv_store_watch()
+//  polls the version instead of sleeping on the pod's futex; snapshot, restore and log paths are file names in the
+//  server's data directory, and calls that change the store for everyone need the server's user.
+//  The socket is kvServerSocket unless KV_SERVER_SOCKET names another.
+//
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <time.h>
+#include "kv_server.h"
+
+#define watchPollMs 1
+
+static __thread int serverFd = -1;
+static __thread pid_t serverPid;
+static __thread kvWireBuffer request;                  // requests built but not sent yet
+static __thread kvWireBuffer response;                 // body of the last response received
+
+static void client_disconnect(void) {
+    close(serverFd);
+    serverFd = -1;
+}
+
+// Returns this thread's connection to the server, opening it if needed.
+static int client_connect(void) {
+    struct sockaddr_un address;
+    const char *path = getenv("KV_SERVER_SOCKET") != NULL ? getenv("KV_SERVER_SOCKET") : kvServerSocket;
+
+    // A forked child shares its parent's connection, and with it the parent's responses
+    if (serverFd >= 0 && serverPid == getpid()) {
+        return serverFd;
+    }
+    if (serverFd >= 0) {
+        client_disconnect();
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Could not create socket");
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    if (connect(fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+        perror("Could not connect to kv_server");
+        close(fd);
+        return -1;
+    }
+    serverFd = fd;
+    serverPid = getpid();
+    return fd;
+}
+
+// Sends every request built so far. Returns -1 if the server cannot be reached.
+static int client_send(void) {
+    size_t sent = 0;
+    int fd = client_connect();
+
+    while (fd >= 0 && sent < request.used) {
+        ssize_t written = send(fd, request.data + sent, request.used - sent, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0) {
+            perror("Could not send to kv_server");
+            client_disconnect();
+            fd = -1;
+            break;
+        }
+        sent += written;
+    }
+    request.used = 0;
+    return fd >= 0 ? 0 : -1;
+}
+
+static int client_receive_bytes(void *data, size_t length) {
+    size_t received = 0;
+
+    while (received < length) {
+        ssize_t read = recv(serverFd, (char *) data + received, length - received, 0);
+        if (read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (read <= 0) {
+            fprintf(stderr, "Lost the connection to kv_server\n");
+            client_disconnect();
+            return -1;
+        }
+        received += read;
+    }
+    return 0;
+}
+
+// Receives the next response into reply. Returns its code, or -1 with reply->bad set if the connection failed.
+static int client_receive(kvWireReader *reply) {
+    kvWireHeader header;
+
+    memset(reply, 0, sizeof(*reply));
+    reply->bad = 1;
+    if (serverFd < 0 || client_receive_bytes(&header, sizeof(header)) < 0) {
+        return -1;
+    }
+    if (header.length > kvWireMaxMessage) {
+        client_disconnect();
+        return -1;
+    }
+    response.used = 0;
+    wire_reserve(&response, header.length);
+    if (client_receive_bytes(response.data, header.length) < 0) {
+        return -1;
+    }
+    reply->data = response.data;
+    reply->length = header.length;
+    reply->bad = 0;
+    return header.code;
+}
+
+// Sends the request built so far and returns the code of its response.
+static int client_call(kvWireReader *reply) {
+    if (client_send() < 0) {
+        memset(reply, 0, sizeof(*reply));
+        reply->bad = 1;
+        return -1;
+    }
+    return client_receive(reply);
+}
+
+// Builds a request for op holding one string, sends it and returns the response's code.
+static int client_call_key(int op, const char *key, kvWireReader *reply) {
+    size_t start = wire_begin(&request, op);
+    wire_put_string(&request, key);
+    wire_end(&request, start, op);
+    return client_call(reply);
+}
+
+static int client_call_int(int op, int64_t value, kvWireReader *reply) {
+    size_t start = wire_begin(&request, op);
+    wire_put_int(&request, value);
+    wire_end(&request, start, op);
+    return client_call(reply);
+}
+
+int kv_store_create(char *name) {
+    return kv_store_create_with(name, NULL);
+}
+
+int kv_store_create_with(char *name, const kvOptions *options) {
+    kvWireReader reply;
+    size_t start = wire_begin(&request, KV_OP_CREATE);
+
+    wire_put_string(&request, name);
+    wire_put(&request, options, options != NULL ? sizeof(kvOptions) : kvWireNull);
+    wire_put_string(&request, options != NULL ? options->hugetlbDir : NULL);
+    wire_put_string(&request, options != NULL ? options->walPath : NULL);
+    wire_end(&request, start, KV_OP_CREATE);
+    return client_call(&reply);
+}
+
+int kv_store_stats(kvStats *stats) {
+    kvWireReader reply;
+    uint32_t length;
+    size_t start = wire_begin(&request, KV_OP_STATS);
+
+    wire_end(&request, start, KV_OP_STATS);
+    int code = client_call(&reply);
+    const char *field = wire_get(&reply, &length);
+    if (field == NULL || length != sizeof(kvStats)) {
+        return -1;
+    }
+    memcpy(stats, field, sizeof(kvStats));
+    return code;
+}
+
+int kv_store_pod_stats(int podNum, kvPodStats *stats) {
+    kvWireReader reply;
+    uint32_t length;
+
+    int code = client_call_int(KV_OP_POD_STATS, podNum, &reply);
+    const char *field = wire_get(&reply, &length);
+    if (field == NULL || length != sizeof(kvPodStats)) {
+        return -1;
+    }
+    memcpy(stats, field, sizeof(kvPodStats));
+    return code;
+}
+
+int kv_store_grow(int pods, int slotsPerPod) {
+    kvWireReader reply;
+    size_t start = wire_begin(&request, KV_OP_GROW);
+
+    wire_put_int(&request, pods);
+    wire_put_int(&request, slotsPerPod);
+    wire_end(&request, start, KV_OP_GROW);
+    return client_call(&reply);
+}
+
+int kv_store_write(char *key, char *value) {
+    return kv_store_write_ttl(key, value, 0);
+}
+
+int kv_store_write_ttl(char *key, char *value, unsigned int ttl) {
+    kvWireReader reply;
+    size_t start = wire_begin(&request, KV_OP_WRITE);
+
+    wire_put_string(&request, key);
+    wire_put_string(&request, value);
+    wire_put_int(&request, ttl);
+    wire_end(&request, start, KV_OP_WRITE);
+    return client_call(&reply);
+}
+
+int kv_store_expire(int podNum) {
+    kvWireReader reply;
+    return client_call_int(KV_OP_EXPIRE, podNum, &reply);
+}
+
+int kv_store_sweeper_start(int intervalMs) {
+    kvWireReader reply;
+    return client_call_int(KV_OP_SWEEPER_START, intervalMs, &reply);
+}
+
+void kv_store_sweeper_stop(void) {
+    kvWireReader reply;
+    size_t start = wire_begin(&request, KV_OP_SWEEPER_STOP);
+
+    wire_end(&request, start, KV_OP_SWEEPER_STOP);
+    client_call(&reply);
+}
+
+char *kv_store_read(char *key) {
+    kvWireReader reply;
+
+    if (client_call_key(KV_OP_READ, key, &reply) < 0) {
+        return NULL;
+    }
+    const char *value = wire_get_string(&reply);
+    return value != NULL ? strdup(value) : NULL;
+}
+
+char **kv_store_read_all(char *key) {
+    kvWireReader reply;
+
+    int valuesCount = client_call_key(KV_OP_READ_ALL, key, &reply);
+    if (valuesCount <= 0) {
+        return NULL;
+    }
+    char **values = malloc(sizeof(char *) * (valuesCount + 1));
+    for (int i = 0; i < valuesCount; i++) {
+        const char *value = wire_get_string(&reply);
+        values[i] = value != NULL ? strdup(value) : strdup("");
+    }
+    values[valuesCount] = NULL;
+    return values;
+}
+
+// Queues one request per kvWireMaxBatch entries, then reads their responses in the same order.
+int kv_store_write_batch(char **keys, char **values, int count) {
+    kvWireReader reply;
+    int result = 0;
+
+    for (int first = 0; first < count; first += kvWireMaxBatch) {
+        int chunk = count - first < kvWireMaxBatch ? count - first : kvWireMaxBatch;
+        size_t start = wire_begin(&request, KV_OP_WRITE_BATCH);
+        wire_put_int(&request, chunk);
+        for (int i = 0; i < chunk; i++) {
+            wire_put_string(&request, keys[first + i]);
+        }
+        for (int i = 0; i < chunk; i++) {
+            wire_put_string(&request, values[first + i]);
+        }
+        wire_end(&request, start, KV_OP_WRITE_BATCH);
+    }
+    if (client_send() < 0) {
+        return -1;
+    }
+    // Every chunk's response is read, so the next call starts at its own
+    for (int first = 0; first < count; first += kvWireMaxBatch) {
+        if (client_receive(&reply) < 0) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+char **kv_store_read_batch(char **keys, int count) {
+    kvWireReader reply;
+    char **results = calloc(count, sizeof(char *));
+
+    for (int first = 0; first < count; first += kvWireMaxBatch) {
+        int chunk = count - first < kvWireMaxBatch ? count - first : kvWireMaxBatch;
+        size_t start = wire_begin(&request, KV_OP_READ_BATCH);
+        wire_put_int(&request, chunk);
+        for (int i = 0; i < chunk; i++) {
+            wire_put_string(&request, keys[first + i]);
+        }
+        wire_end(&request, start, KV_OP_READ_BATCH);
+    }
+    // A chunk that failed fails the batch, but the responses of the others are still read, unless the connection
+    // itself broke
+    int failed = client_send() < 0;
+    for (int first = 0; first < count && serverFd >= 0; first += kvWireMaxBatch) {
+        int chunk = count - first < kvWireMaxBatch ? count - first : kvWireMaxBatch;
+        if (client_receive(&reply) < 0) {
+            failed = 1;
+            continue;
+        }
+        for (int i = 0; i < chunk; i++) {
+            const char *value = wire_get_string(&reply);
+            results[first + i] = value != NULL ? strdup(value) : NULL;
+        }
+    }
+    if (failed) {
+        for (int i = 0; i < count; i++) {
+            free(results[i]);
+        }
+        free(results);
+        return NULL;
+    }
+    return results;
+}
+
+// The lease holds its own copy of the value, which no later write can touch.
+int kv_store_read_lease(char *key, kvLease *lease) {
+    memset(lease, 0, sizeof(*lease));
+    lease->buffer = kv_store_read(key);
+    if (lease->buffer == NULL) {
+        return -1;
+    }
+    lease->value = lease->buffer;
+    lease->length = strlen(lease->buffer);
+    return 0;
+}
+
+int kv_store_lease_valid(kvLease *lease) {
+    return lease->value != NULL;
+}
+
+void kv_store_lease_release(kvLease *lease) {
+    free(lease->buffer);
+    lease->buffer = NULL;
+    lease->value = NULL;
+    lease->length = 0;
+}
+
+unsigned int kv_store_version(char *key) {
+    kvWireReader reply;
+
+    if (client_call_key(KV_OP_VERSION, key, &reply) < 0) {
+        return 0;
+    }
+    return wire_get_int(&reply);
+}
+
+// The server answers every request straight away, so waiting for a write means asking again.
+unsigned int kv_store_watch(char *key, unsigned int lastVersion, int timeoutMs) {
+    struct timespec start, now;
+    struct timespec pause = { 0, watchPollMs * 1000000L };
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
+        unsigned int version = kv_store_version(key);
+        if (version != lastVersion) {
+            return version;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long elapsedMs = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (timeoutMs >= 0 && elapsedMs >= timeoutMs) {
+            return lastVersion;
+        }
+        nanosleep(&pause, NULL);
+    }
+}
+
+int kv_store_read_all_into(char *key, char *buffer, size_t bufferSize, size_t *needed) {
+    kvWireReader reply;
+    size_t used = 0;
+
+    int valuesCount = client_call_key(KV_OP_READ_ALL, key, &reply);
+    if (valuesCount < 0) {
+        valuesCount = 0;
+    }
+    for (int i = 0; i < valuesCount; i++) {
+        uint32_t length;
+        const char *value = wire_get(&reply, &length);
+        if (value != NULL && used + length <= bufferSize) {
+            memcpy(buffer + used, value, length);
+        }
+        used += length;
+    }
+    *needed = used;
+    return used <= bufferSize ? valuesCount : -1;
+}
+
+int kv_store_read_all_each(char *key, int (*callback)(const char *value, size_t length, void *arg), void *arg) {
+    kvWireReader reply;
+    int visited = 0;
+
+    int valuesCount = client_call_key(KV_OP_READ_ALL, key, &reply);
+    while (visited < valuesCount) {
+        uint32_t length;
+        const char *value = wire_get(&reply, &length);
+        visited++;
+        if (value == NULL || callback(value, length - 1, arg) != 0) {
+            break;
+        }
+    }
+    return visited;
+}
+
+int kv_store_scan_range(kvScan *scan, const char *from, const char *to) {
+    scan->from = from != NULL ? strdup(from) : NULL;
+    scan->to = to != NULL ? strdup(to) : NULL;
+    scan->last = NULL;
+    scan->done = 0;
+    return 0;
+}
+
+// Same range as a2_lib.c: the prefix up to its last byte below 0xff, incremented.
+int kv_store_scan_prefix(kvScan *scan, const char *prefix) {
+    char *to = strdup(prefix);
+    int end = strlen(to) - 1;
+
+    while (end >= 0 && (unsigned char) to[end] == 0xff) {
+        end--;
+    }
+    if (end >= 0) {
+        to[end]++;
+        to[end + 1] = '\0';
+    }
+    kv_store_scan_range(scan, prefix, end >= 0 ? to : NULL);
+    free(to);
+    return 0;
+}
+
+// The cursor stays here; each batch tells the server where the last one ended.
+int kv_store_scan_next(kvScan *scan, char **keys, int maxKeys) {
+    kvWireReader reply;
+
+    if (maxKeys < 1) {
+        return -1;
+    }
+    if (scan->done) {
+        return 0;
+    }
+    if (maxKeys > kvScanMaxBatch) {
+        maxKeys = kvScanMaxBatch;
+    }
+    size_t start = wire_begin(&request, KV_OP_SCAN);
+    wire_put_string(&request, scan->from);
+    wire_put_string(&request, scan->to);
+    wire_put_string(&request, scan->last);
+    wire_put_int(&request, maxKeys);
+    wire_end(&request, start, KV_OP_SCAN);
+
+    int count = client_call(&reply);
+    for (int i = 0; i < count; i++) {
+        const char *key = wire_get_string(&reply);
+        keys[i] = strdup(key != NULL ? key : "");
+    }
+    if (count > 0) {
+        free(scan->last);
+        scan->last = strdup(keys[count - 1]);
+    }
+    if (count >= 0) {
+        scan->done = count < maxKeys;
+    }
+    return count;
+}
+
+void kv_store_scan_close(kvScan *scan) {
+    free(scan->from);
+    free(scan->to);
+    free(scan->last);
+    scan->from = scan->to = scan->last = NULL;
+}
+
+int kv_store_snapshot(const char *path) {
+    kvWireReader reply;
+    return client_call_key(KV_OP_SNAPSHOT, path, &reply);
+}
+
+int kv_store_restore(const char *path) {
+    kvWireReader reply;
+    return client_call_key(KV_OP_RESTORE, path, &reply);
+}
+
+// The handle is just the server's version number, so it can be used on any connection.
+int kv_store_snapshot_begin(kvSnapshotHandle *snapshot) {
+    kvWireReader reply;
+    size_t start = wire_begin(&request, KV_OP_SNAPSHOT_BEGIN);
+
+    wire_end(&request, start, KV_OP_SNAPSHOT_BEGIN);
+    int code = client_call(&reply);
+    snapshot->version = wire_get_int(&reply);
+    return reply.bad ? -1 : code;
+}
+
+int kv_store_snapshot_read_all(const kvSnapshotHandle *snapshot, char *key, char ***values) {
+    kvWireReader reply;
+    size_t start = wire_begin(&request, KV_OP_SNAPSHOT_READ_ALL);
+
+    *values = NULL;
+    wire_put_int(&request, snapshot->version);
+    wire_put_string(&request, key);
+    wire_end(&request, start, KV_OP_SNAPSHOT_READ_ALL);
+    int valuesCount = client_call(&reply);
+    if (valuesCount <= 0) {
+        return valuesCount;
+    }
+    *values = malloc(sizeof(char *) * (valuesCount + 1));
+    for (int i = 0; i < valuesCount; i++) {
+        const char *value = wire_get_string(&reply);
+        (*values)[i] = value != NULL ? strdup(value) : strdup("");
+    }
+    (*values)[valuesCount] = NULL;
+    return valuesCount;
+}
+
+int kv_delete_db(void) {
+    kvWireReader reply;
+    size_t start = wire_begin(&request, KV_OP_DELETE);
+
+    wire_end(&request, start, KV_OP_DELETE);
+    return client_call(&reply);
+}
+
+int kv_store_read_mode(int mode) {
+    kvWireReader reply;
+    return client_call_int(KV_OP_READ_MODE, mode, &reply);
+}
+
+int kv_store_lookup_mode(int mode) {
+    kvWireReader reply;
+    return client_call_int(KV_OP_LOOKUP_MODE, mode, &reply);
+}
+
+unsigned long hash(const char *str) {
+    kvWireReader reply;
+
+    if (client_call_key(KV_OP_HASH, str, &reply) < 0) {
+        return 0;
+    }
+    return wire_get_int(&reply);
+}
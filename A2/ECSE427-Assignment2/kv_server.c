@@ -0,0 +1,542 @@
+//
+//  kv_server.c
+//  ECSE427-Assignment2
+//
+//  Daemon that owns a store and serves it over a Unix domain socket (protocol in kv_server.h), for processes that
+//  cannot shm_open it themselves. One thread runs an epoll loop over every connection: it reads whatever arrived,
+//  handles each complete request in order and writes all their responses back in one go. The store is opened by
+//  the first client's kv_store_create() and closed by kv_delete_db(); a durable store's fdatasync, a grow or a
+//  snapshot hold up every client while they run.
+//
+//  Who may connect goes by the socket's mode (0600 unless given), since clients never touch the segment itself.
+//  Peers are told apart by SO_PEERCRED: only root and the server's own user may create, delete or grow the store,
+//  snapshot or restore it, change its read or lookup mode or run the sweeper, which affect every client or the
+//  server's files; anybody else's kv_store_create() only attaches to the store already open. Store names are a
+//  single shm name component. Snapshot, restore and log paths are plain file names inside the data directory,
+//  and refused without one. Whoever creates the store cannot pick a hugetlbfs directory, only the mapping flags in
+//  clientMapFlags, and a geometry whose keys and values fit into maxClientStoreBytes. A connection that does not
+//  read its responses is not read from either once maxPendingOutput bytes of them are waiting.
+//
+//  Usage: ./kv_server [socket path] [socket mode, octal] [data directory]
+//
+
+#define _GNU_SOURCE
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <signal.h>
+#include "kv_server.h"
+
+#define maxEvents 64
+#define readChunk 65536
+#define maxPendingOutput (4 << 20)                      // unsent response bytes past which requests wait
+#define clientMapFlags (KV_MAP_THP | KV_MAP_EXISTING)   // mapping flags that only change how the server maps it
+#define maxClientKeyBytes 1024
+#define maxClientStoreBytes (1ULL << 32)                // bytes of keys and values a created store may budget for
+
+typedef struct {
+    int fd;
+    int privileged;                                     // the peer is root or the server's user
+    uint32_t events;                                    // epoll events the connection is registered for
+    kvWireBuffer in;                                    // received bytes not handled yet
+    kvWireBuffer out;                                   // responses not sent yet
+    size_t sent;                                        // bytes of out already sent
+} kvConnection;
+
+static volatile sig_atomic_t stopping;
+static int storeOpen;
+static char openName[NAME_MAX];
+static const char *dataDir;
+
+static void on_signal(int signal) {
+    (void) signal;
+    stopping = 1;
+}
+
+// Resolves a file name a client sent to a path inside the data directory. Returns NULL (and refuses the request)
+// without a data directory, or if the name is not a plain file name there.
+static const char *data_path(const char *name, char *path) {
+    if (dataDir == NULL || name == NULL || name[0] == '\0' || strchr(name, '/') != NULL || strcmp(name, ".") == 0
+        || strcmp(name, "..") == 0 || snprintf(path, PATH_MAX, "%s/%s", dataDir, name) >= PATH_MAX) {
+        return NULL;
+    }
+    return path;
+}
+
+// Whether a client's store name is one shm name component: an optional leading slash and no other, and no "..".
+static int name_allowed(const char *name) {
+    const char *component = name[0] == '/' ? name + 1 : name;
+    return component[0] != '\0' && strchr(component, '/') == NULL && strstr(component, "..") == NULL
+        && strlen(name) < NAME_MAX;
+}
+
+// Drops the mapping flags outside clientMapFlags from a client's options, and says whether their geometry stays
+// within the server's limits; kv_store_create_with() checks the rest.
+static int options_allowed(kvOptions *options) {
+    options->mapFlags &= clientMapFlags;
+    if (options->pods < 1 || options->slotsPerPod < 1 || options->keyBytes < 1 || options->keyBytes > maxClientKeyBytes
+        || options->valueBytes < 1 || (size_t) options->valueBytes > maxValueSize) {
+        return 0;
+    }
+    uint64_t slots = (uint64_t) options->pods * options->slotsPerPod;
+    return slots <= maxClientStoreBytes && slots * (options->keyBytes + options->valueBytes) <= maxClientStoreBytes;
+}
+
+// Whether op changes the store, its files or this server for every client, and is only taken from privileged
+// peers. KV_OP_CREATE is too unless it attaches to the store already open.
+static int op_privileged(int op) {
+    return op == KV_OP_DELETE || op == KV_OP_GROW || op == KV_OP_SNAPSHOT || op == KV_OP_RESTORE
+        || op == KV_OP_READ_MODE || op == KV_OP_LOOKUP_MODE || op == KV_OP_SWEEPER_START || op == KV_OP_SWEEPER_STOP;
+}
+
+// Answers one request, appending its response to out.
+static void handle_request(int op, kvWireReader *request, kvWireBuffer *out, int privileged) {
+    size_t start = wire_begin(out, 0);
+    int32_t code = -1;
+    char path[PATH_MAX];
+
+    if ((op != KV_OP_CREATE && !storeOpen) || (op_privileged(op) && !privileged)) {
+        wire_end(out, start, code);
+        return;
+    }
+
+    switch (op) {
+    case KV_OP_CREATE: {
+        const char *name = wire_get_string(request);
+        uint32_t length;
+        const char *raw = wire_get(request, &length);
+        const char *hugetlbDir = wire_get_string(request);
+        const char *walPath = wire_get_string(request);
+        kvOptions options;
+
+        if (request->bad || name == NULL || !name_allowed(name) || (raw != NULL && length != sizeof(kvOptions))
+            || hugetlbDir != NULL || (walPath != NULL && data_path(walPath, path) == NULL)) {
+            break;
+        }
+        if (storeOpen) {
+            // Every client shares the one store this server holds
+            code = strcmp(name, openName) == 0 ? 0 : -1;
+            break;
+        }
+        if (!privileged) {
+            break;
+        }
+        if (raw != NULL) {
+            memcpy(&options, raw, sizeof(options));
+            options.hugetlbDir = NULL;
+            options.walPath = walPath != NULL ? path : NULL;
+            if (!options_allowed(&options)) {
+                break;
+            }
+        }
+        code = kv_store_create_with((char *) name, raw != NULL ? &options : NULL);
+        if (code == 0) {
+            storeOpen = 1;
+            strncpy(openName, name, sizeof(openName) - 1);
+        }
+        break;
+    }
+    case KV_OP_STATS: {
+        kvStats stats;
+        code = kv_store_stats(&stats);
+        wire_put(out, &stats, sizeof(stats));
+        break;
+    }
+    case KV_OP_POD_STATS: {
+        kvPodStats stats;
+        int podNum = wire_get_int(request);
+        memset(&stats, 0, sizeof(stats));
+        code = request->bad ? -1 : kv_store_pod_stats(podNum, &stats);
+        wire_put(out, &stats, sizeof(stats));
+        break;
+    }
+    case KV_OP_GROW: {
+        int pods = wire_get_int(request);
+        int slotsPerPod = wire_get_int(request);
+        code = request->bad ? -1 : kv_store_grow(pods, slotsPerPod);
+        break;
+    }
+    case KV_OP_WRITE: {
+        const char *key = wire_get_string(request);
+        const char *value = wire_get_string(request);
+        unsigned int ttl = wire_get_int(request);
+        if (!request->bad && key != NULL && value != NULL) {
+            code = kv_store_write_ttl((char *) key, (char *) value, ttl);
+        }
+        break;
+    }
+    case KV_OP_EXPIRE: {
+        int podNum = wire_get_int(request);
+        code = request->bad ? -1 : kv_store_expire(podNum);
+        break;
+    }
+    case KV_OP_SWEEPER_START: {
+        int intervalMs = wire_get_int(request);
+        code = request->bad ? -1 : kv_store_sweeper_start(intervalMs);
+        break;
+    }
+    case KV_OP_SWEEPER_STOP:
+        kv_store_sweeper_stop();
+        code = 0;
+        break;
+    case KV_OP_READ: {
+        const char *key = wire_get_string(request);
+        if (!request->bad && key != NULL) {
+            char *value = kv_store_read((char *) key);
+            wire_put_string(out, value);
+            free(value);
+            code = 0;
+        }
+        break;
+    }
+    case KV_OP_READ_ALL: {
+        const char *key = wire_get_string(request);
+        if (!request->bad && key != NULL) {
+            char **values = kv_store_read_all((char *) key);
+            code = 0;
+            for (int i = 0; values != NULL && values[i] != NULL; i++, code++) {
+                wire_put_string(out, values[i]);
+                free(values[i]);
+            }
+            free(values);
+        }
+        break;
+    }
+    case KV_OP_WRITE_BATCH: {
+        int count = wire_get_int(request);
+        if (request->bad || count < 0 || count > kvWireMaxBatch) {
+            break;
+        }
+        char *keys[count];
+        char *values[count];
+        for (int i = 0; i < count; i++) {
+            keys[i] = (char *) wire_get_string(request);
+        }
+        for (int i = 0; i < count; i++) {
+            values[i] = (char *) wire_get_string(request);
+        }
+        int complete = !request->bad;
+        for (int i = 0; complete && i < count; i++) {
+            complete = keys[i] != NULL && values[i] != NULL;
+        }
+        if (complete) {
+            code = kv_store_write_batch(keys, values, count);
+        }
+        break;
+    }
+    case KV_OP_READ_BATCH: {
+        int count = wire_get_int(request);
+        if (request->bad || count < 0 || count > kvWireMaxBatch) {
+            break;
+        }
+        char *keys[count];
+        int complete = 1;
+        for (int i = 0; i < count; i++) {
+            keys[i] = (char *) wire_get_string(request);
+            complete = complete && keys[i] != NULL;
+        }
+        if (request->bad || !complete) {
+            break;
+        }
+        char **values = kv_store_read_batch(keys, count);
+        for (int i = 0; i < count; i++) {
+            wire_put_string(out, values != NULL ? values[i] : NULL);
+            free(values != NULL ? values[i] : NULL);
+        }
+        free(values);
+        code = 0;
+        break;
+    }
+    case KV_OP_VERSION: {
+        const char *key = wire_get_string(request);
+        if (!request->bad && key != NULL) {
+            wire_put_int(out, kv_store_version((char *) key));
+            code = 0;
+        }
+        break;
+    }
+    case KV_OP_SCAN: {
+        // The cursor lives in the client; each request carries where it stands
+        const char *from = wire_get_string(request);
+        const char *to = wire_get_string(request);
+        const char *last = wire_get_string(request);
+        int maxKeys = wire_get_int(request);
+        if (request->bad || maxKeys < 1) {
+            break;
+        }
+        if (maxKeys > kvScanMaxBatch) {
+            maxKeys = kvScanMaxBatch;
+        }
+        char *keys[maxKeys];
+        kvScan scan;
+        kv_store_scan_range(&scan, from, to);
+        scan.last = last != NULL ? strdup(last) : NULL;
+        code = kv_store_scan_next(&scan, keys, maxKeys);
+        for (int i = 0; i < code; i++) {
+            wire_put_string(out, keys[i]);
+            free(keys[i]);
+        }
+        kv_store_scan_close(&scan);
+        break;
+    }
+    case KV_OP_SNAPSHOT:
+    case KV_OP_RESTORE: {
+        const char *name = wire_get_string(request);
+        if (!request->bad && data_path(name, path) != NULL) {
+            code = op == KV_OP_SNAPSHOT ? kv_store_snapshot(path) : kv_store_restore(path);
+        }
+        break;
+    }
+    case KV_OP_DELETE:
+        code = kv_delete_db();
+        if (code == 0) {
+            storeOpen = 0;
+        }
+        break;
+    case KV_OP_READ_MODE:
+    case KV_OP_LOOKUP_MODE: {
+        int mode = wire_get_int(request);
+        if (!request->bad) {
+            code = op == KV_OP_READ_MODE ? kv_store_read_mode(mode) : kv_store_lookup_mode(mode);
+        }
+        break;
+    }
+    case KV_OP_HASH: {
+        const char *key = wire_get_string(request);
+        if (!request->bad && key != NULL) {
+            wire_put_int(out, hash(key));
+            code = 0;
+        }
+        break;
+    }
+    case KV_OP_SNAPSHOT_BEGIN: {
+        kvSnapshotHandle snapshot;
+        code = kv_store_snapshot_begin(&snapshot);
+        wire_put_int(out, snapshot.version);
+        break;
+    }
+    case KV_OP_SNAPSHOT_READ_ALL: {
+        kvSnapshotHandle snapshot = { wire_get_int(request) };
+        const char *key = wire_get_string(request);
+        char **values;
+        if (request->bad || key == NULL) {
+            break;
+        }
+        code = kv_store_snapshot_read_all(&snapshot, (char *) key, &values);
+        for (int i = 0; code > 0 && i < code; i++) {
+            wire_put_string(out, values[i]);
+            free(values[i]);
+        }
+        free(code > 0 ? values : NULL);
+        break;
+    }
+    default:
+        fprintf(stderr, "Unknown operation %d\n", op);
+        break;
+    }
+    wire_end(out, start, code);
+}
+
+static void connection_close(int epollFd, kvConnection *connection) {
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, connection->fd, NULL);
+    close(connection->fd);
+    free(connection->in.data);
+    free(connection->out.data);
+    free(connection);
+}
+
+// Registers the events the connection waits for: requests while fewer than maxPendingOutput response bytes wait
+// to be sent, so a client that stops reading is not read from either, and room in the socket while any wait.
+static int connection_watch(int epollFd, kvConnection *connection) {
+    size_t pending = connection->out.used - connection->sent;
+    uint32_t events = (pending < maxPendingOutput ? EPOLLIN : 0) | (pending > 0 ? EPOLLOUT : 0);
+
+    if (events == connection->events) {
+        return 0;
+    }
+    connection->events = events;
+    struct epoll_event event = { events, { .ptr = connection } };
+    return epoll_ctl(epollFd, EPOLL_CTL_MOD, connection->fd, &event);
+}
+
+// Sends as much of the pending responses as the socket takes. Returns -1 if the connection broke.
+static int connection_send(kvConnection *connection) {
+    while (connection->sent < connection->out.used) {
+        ssize_t written = send(connection->fd, connection->out.data + connection->sent,
+                               connection->out.used - connection->sent, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                return -1;
+            }
+            break;
+        }
+        connection->sent += written;
+    }
+    // Sent bytes are dropped once they outgrow what may still be pending, so the buffer stays bounded
+    if (connection->sent == connection->out.used || connection->sent >= maxPendingOutput) {
+        memmove(connection->out.data, connection->out.data + connection->sent, connection->out.used - connection->sent);
+        connection->out.used -= connection->sent;
+        connection->sent = 0;
+    }
+    return 0;
+}
+
+// Handles the complete requests received so far, in order, stopping once maxPendingOutput bytes of responses
+// wait to be sent. Returns -1 if the client sent a message longer than any request.
+static int connection_handle(kvConnection *connection) {
+    size_t pos = 0;
+
+    while (connection->in.used - pos >= sizeof(kvWireHeader)
+           && connection->out.used - connection->sent < maxPendingOutput) {
+        kvWireHeader header;
+        memcpy(&header, connection->in.data + pos, sizeof(header));
+        if (header.length > kvWireMaxMessage - sizeof(header)) {
+            fprintf(stderr, "Dropping a client that sent a %u byte message\n", header.length);
+            return -1;
+        }
+        if (connection->in.used - pos - sizeof(header) < header.length) {
+            break;
+        }
+        kvWireReader request = { connection->in.data + pos + sizeof(header), header.length, 0, 0 };
+        handle_request(header.code, &request, &connection->out, connection->privileged);
+        pos += sizeof(header) + header.length;
+    }
+    memmove(connection->in.data, connection->in.data + pos, connection->in.used - pos);
+    connection->in.used -= pos;
+    return 0;
+}
+
+// Handles the requests received so far and sends the responses, going on with requests held back by the cap for
+// as long as the socket takes their responses. Returns -1 once the connection is done with.
+static int connection_serve(int epollFd, kvConnection *connection) {
+    size_t waiting;
+
+    do {
+        waiting = connection->in.used;
+        if (connection_handle(connection) < 0 || connection_send(connection) < 0) {
+            return -1;
+        }
+    } while (connection->in.used < waiting && connection->in.used > 0 && connection->out.used == 0);
+    return connection_watch(epollFd, connection);
+}
+
+// Reads what the client sent so far, up to one longest message at a time, and serves it. Returns -1 once the
+// connection is done with.
+static int connection_read(int epollFd, kvConnection *connection) {
+    while (connection->in.used < kvWireMaxMessage) {
+        wire_reserve(&connection->in, readChunk);
+        ssize_t received = recv(connection->fd, connection->in.data + connection->in.used, readChunk, 0);
+        if (received == 0) {
+            return -1;
+        }
+        if (received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                return -1;
+            }
+            break;
+        }
+        connection->in.used += received;
+    }
+    return connection_serve(epollFd, connection);
+}
+
+// Whether the peer on fd may use the privileged operations: root, or the user the server runs as.
+static int peer_privileged(int fd) {
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) < 0) {
+        return 0;
+    }
+    return credentials.uid == 0 || credentials.uid == geteuid();
+}
+
+static int server_listen(const char *path, mode_t mode) {
+    struct sockaddr_un address;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd < 0) {
+        perror("Could not create socket");
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) < 0 || chmod(path, mode) < 0
+        || listen(fd, SOMAXCONN) < 0) {
+        perror("Could not listen on socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1] : getenv("KV_SERVER_SOCKET") != NULL ? getenv("KV_SERVER_SOCKET")
+                                                                               : kvServerSocket;
+    mode_t mode = argc > 2 ? strtol(argv[2], NULL, 8) : 0600;
+    struct epoll_event events[maxEvents];
+    struct sigaction action;
+
+    dataDir = argc > 3 ? argv[3] : NULL;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    int listenFd = server_listen(path, mode);
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (listenFd < 0 || epollFd < 0) {
+        return 1;
+    }
+    struct epoll_event listenEvent = { EPOLLIN, { .ptr = NULL } };
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &listenEvent);
+    fprintf(stderr, "kv_server listening on %s\n", path);
+
+    while (!stopping) {
+        int ready = epoll_wait(epollFd, events, maxEvents, -1);
+        if (ready < 0 && errno != EINTR) {
+            perror("epoll_wait failed");
+            break;
+        }
+        for (int i = 0; i < ready; i++) {
+            kvConnection *connection = events[i].data.ptr;
+
+            if (connection == NULL) {
+                int fd;
+                while ((fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    connection = calloc(1, sizeof(kvConnection));
+                    connection->fd = fd;
+                    connection->privileged = peer_privileged(fd);
+                    connection->events = EPOLLIN;
+                    struct epoll_event event = { EPOLLIN, { .ptr = connection } };
+                    epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+                }
+                continue;
+            }
+            int broken = (events[i].events & (EPOLLERR | EPOLLHUP)) && !(events[i].events & EPOLLIN);
+            if (!broken && (events[i].events & EPOLLIN)) {
+                broken = connection_read(epollFd, connection) < 0;
+            } else if (!broken && (events[i].events & EPOLLOUT)) {
+                broken = connection_serve(epollFd, connection) < 0;
+            }
+            if (broken) {
+                connection_close(epollFd, connection);
+            }
+        }
+    }
+
+    // The store outlives the server, like any shm segment; only the socket goes
+    close(listenFd);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,167 @@
+//
+//  kv_server.h
+//  ECSE427-Assignment2
+//
+//  Wire protocol between kv_server, the daemon that owns a store and serves it over a Unix domain socket, and
+//  kv_client.c, the library giving processes that cannot map the store (other uids, other IPC namespaces) the
+//  a2_lib.h API over that socket.
+//
+
+#ifndef kv_server_h
+#define kv_server_h
+
+#include "a2_lib.h"
+
+#define kvServerSocket "/tmp/kv_server.sock"            // socket path unless KV_SERVER_SOCKET says otherwise
+#define kvWireMaxMessage (16 << 20)                     // longest message, header included
+#define kvWireMaxBatch 256                              // entries per batch message; longer batches are pipelined
+
+// Every message starts with a kvWireHeader giving the number of bytes that follow it and, in a request, the
+// operation or, in a response, what the call returned. The body is a sequence of fields, each a u32 length and
+// that many bytes: strings include their NUL, a NULL string is a length of kvWireNull and integers are 8-byte
+// fields. Both ends run on the same machine, so kvOptions (without its strings), kvStats and kvPodStats travel as
+// raw structs.
+//
+// Requests are pipelined: a client may send any number of them before reading, and the server answers each
+// connection's requests in order, handling every complete request it received before writing all their responses
+// back at once.
+typedef struct {
+    uint32_t length;
+    int32_t code;
+} kvWireHeader;
+
+#define kvWireNull UINT32_MAX
+
+// Operations, and the fields of their requests. Responses carry the function's return value as the code, followed
+// by any results. Paths, walPath included, are file names inside the server's data directory. DELETE, GROW,
+// SNAPSHOT, RESTORE, READ_MODE, LOOKUP_MODE, the sweeper and a CREATE that does not attach to the store already
+// open fail for peers other than root and the server's user.
+#define KV_OP_CREATE 1                                  // name, options or NULL, hugetlbDir (must be NULL), walPath
+#define KV_OP_STATS 2                                   // -> kvStats
+#define KV_OP_POD_STATS 3                               // podNum -> kvPodStats
+#define KV_OP_GROW 4                                    // pods, slotsPerPod
+#define KV_OP_WRITE 5                                   // key, value, ttl
+#define KV_OP_EXPIRE 6                                  // podNum
+#define KV_OP_SWEEPER_START 7                           // intervalMs
+#define KV_OP_SWEEPER_STOP 8
+#define KV_OP_READ 9                                    // key -> value or NULL
+#define KV_OP_READ_ALL 10                               // key -> code values
+#define KV_OP_WRITE_BATCH 11                            // count, count keys, count values
+#define KV_OP_READ_BATCH 12                             // count, count keys -> count values or NULLs
+#define KV_OP_VERSION 13                                // key -> version
+#define KV_OP_SCAN 14                                   // from, to, last, maxKeys -> code keys
+#define KV_OP_SNAPSHOT 15                               // path
+#define KV_OP_RESTORE 16                                // path
+#define KV_OP_DELETE 17
+#define KV_OP_READ_MODE 18                              // mode
+#define KV_OP_LOOKUP_MODE 19                            // mode
+#define KV_OP_HASH 20                                   // key -> hash
+#define KV_OP_SNAPSHOT_BEGIN 21                         // -> version
+#define KV_OP_SNAPSHOT_READ_ALL 22                      // version, key -> code values
+
+// A growing buffer messages are built in (and, on the server, received into).
+typedef struct {
+    char *data;
+    size_t used;
+    size_t capacity;
+} kvWireBuffer;
+
+// Walks the fields of one received message body. A field running past the end, or a string without its NUL,
+// sets bad; every later field then reads as empty.
+typedef struct {
+    const char *data;
+    size_t length;
+    size_t pos;
+    int bad;
+} kvWireReader;
+
+static inline void wire_reserve(kvWireBuffer *buffer, size_t bytes) {
+    if (buffer->used + bytes > buffer->capacity) {
+        buffer->capacity = buffer->capacity * 2 > buffer->used + bytes ? buffer->capacity * 2 : buffer->used + bytes;
+        buffer->data = realloc(buffer->data, buffer->capacity);
+    }
+}
+
+static inline void wire_put_raw(kvWireBuffer *buffer, const void *data, size_t length) {
+    wire_reserve(buffer, length);
+    memcpy(buffer->data + buffer->used, data, length);
+    buffer->used += length;
+}
+
+static inline void wire_put(kvWireBuffer *buffer, const void *data, uint32_t length) {
+    wire_put_raw(buffer, &length, sizeof(length));
+    if (length != kvWireNull) {
+        wire_put_raw(buffer, data, length);
+    }
+}
+
+static inline void wire_put_string(kvWireBuffer *buffer, const char *string) {
+    wire_put(buffer, string, string != NULL ? strlen(string) + 1 : kvWireNull);
+}
+
+static inline void wire_put_int(kvWireBuffer *buffer, int64_t value) {
+    wire_put(buffer, &value, sizeof(value));
+}
+
+// Starts a message with a header whose length is filled in by wire_end(). Returns where the message starts.
+static inline size_t wire_begin(kvWireBuffer *buffer, int32_t code) {
+    kvWireHeader header = { 0, code };
+    size_t start = buffer->used;
+
+    wire_put_raw(buffer, &header, sizeof(header));
+    return start;
+}
+
+static inline void wire_end(kvWireBuffer *buffer, size_t start, int32_t code) {
+    kvWireHeader header = { buffer->used - start - sizeof(kvWireHeader), code };
+    memcpy(buffer->data + start, &header, sizeof(header));
+}
+
+// Returns the next field's bytes and sets *length, or returns NULL for a NULL field or a bad message.
+static inline const char *wire_get(kvWireReader *reader, uint32_t *length) {
+    *length = 0;
+    if (reader->bad || reader->length - reader->pos < sizeof(uint32_t)) {
+        reader->bad = 1;
+        return NULL;
+    }
+    memcpy(length, reader->data + reader->pos, sizeof(uint32_t));
+    reader->pos += sizeof(uint32_t);
+    if (*length == kvWireNull) {
+        *length = 0;
+        return NULL;
+    }
+    if (*length > reader->length - reader->pos) {
+        reader->bad = 1;
+        *length = 0;
+        return NULL;
+    }
+    reader->pos += *length;
+    return reader->data + reader->pos - *length;
+}
+
+// Returns the next string in place, inside the message, or NULL.
+static inline const char *wire_get_string(kvWireReader *reader) {
+    uint32_t length;
+    const char *string = wire_get(reader, &length);
+
+    if (string != NULL && (length == 0 || string[length - 1] != '\0')) {
+        reader->bad = 1;
+        return NULL;
+    }
+    return string;
+}
+
+static inline int64_t wire_get_int(kvWireReader *reader) {
+    uint32_t length;
+    const char *field = wire_get(reader, &length);
+    int64_t value = 0;
+
+    if (field != NULL && length == sizeof(value)) {
+        memcpy(&value, field, sizeof(value));
+    } else {
+        reader->bad = 1;
+    }
+    return value;
+}
+
+#endif /* kv_server_h */
@@ -0,0 +1,87 @@
+//
+//  kv_stat.c
+//  ECSE427-Assignment2
+//
+//  Dumps how a live store's entries are spread over its pods: the occupancy distribution, the hottest pods and
+//  how long the index chains get. A pod that is full evicts its oldest entry on every write, so full pods holding
+//  many distinct keys are where still-needed values get lost.
+//
+//  Usage: ./kv_stat [store name] [pods to list]
+//
+
+#include <math.h>
+#include "a2_lib.h"
+
+static kvPodStats *pods;
+
+// Orders pod numbers by entries, then distinct keys, hottest first
+static int by_live(const void *a, const void *b) {
+    const kvPodStats *left = &pods[*(const int *) a];
+    const kvPodStats *right = &pods[*(const int *) b];
+    if (left->live != right->live) {
+        return right->live - left->live;
+    }
+    return right->distinctKeys - left->distinctKeys;
+}
+
+int main(int argc, char **argv) {
+    char *name = argc > 1 ? argv[1] : DATA_BASE_NAME;
+    int listed = argc > 2 ? atoi(argv[2]) : 10;
+    kvStats stats;
+
+    // Only an existing store is attached to, never created; its header supplies the geometry and hash function
+    kvOptions options = { .mapFlags = KV_MAP_EXISTING };
+    if (kv_store_create_with(name, &options) < 0 || kv_store_stats(&stats) < 0) {
+        return 1;
+    }
+
+    pods = malloc(sizeof(kvPodStats) * stats.pods);
+    int *podNums = malloc(sizeof(int) * stats.pods);
+    long live = 0, distinct = 0, chains = 0;
+    int full = 0, longestChain = 0;
+    double squares = 0;
+
+    for (int p = 0; p < stats.pods; p++) {
+        kv_store_pod_stats(p, &pods[p]);
+        live += pods[p].live;
+        distinct += pods[p].distinctKeys;
+        chains += pods[p].chains;
+        full += pods[p].live == stats.slotsPerPod;
+        squares += (double) pods[p].distinctKeys * pods[p].distinctKeys;
+        if (pods[p].longestChain > longestChain) {
+            longestChain = pods[p].longestChain;
+        }
+        podNums[p] = p;
+    }
+
+    double mean = (double) distinct / stats.pods;
+    double deviation = sqrt(squares / stats.pods - mean * mean);
+    printf("store %s: %d pods x %d slots, hash %s seed %#llx, %s placement, grown %d times%s\n", name, stats.pods,
+           stats.slotsPerPod, stats.hashFunction == KV_HASH_WY ? "wy" : "djb2", (unsigned long long) stats.hashSeed,
+           stats.placement == KV_PLACE_TWO_CHOICE ? "two-choice" : "single-pod", stats.generation,
+           stats.growing ? " (moving entries)" : "");
+    if (stats.compressAbove > 0) {
+        printf("values over %d bytes stored compressed, arena %zu bytes used\n", stats.compressAbove, stats.arenaUsed);
+    }
+    if (stats.orderedIndex) {
+        printf("ordered index kept for scans\n");
+    }
+    printf("entries %ld (%.1f%% of slots), distinct keys %ld, superseded versions %ld\n", live,
+           100.0 * live / ((double) stats.pods * stats.slotsPerPod), distinct, live - distinct);
+    printf("distinct keys per pod: mean %.1f, stddev %.1f (%.1f expected for a uniform hash)\n", mean, deviation,
+           sqrt(mean * (1 - 1.0 / stats.pods)));
+    printf("full pods (evicting on every write) %d, index chains %ld, longest chain %d\n", full, chains,
+           longestChain);
+
+    qsort(podNums, stats.pods, sizeof(int), by_live);
+
+    printf("\n%8s %8s %10s %10s\n", "pod", "entries", "distinct", "longest");
+    for (int p = 0; p < listed && p < stats.pods; p++) {
+        const kvPodStats *pod = &pods[podNums[p]];
+        printf("%8d %8d %10d %10d\n", podNums[p], pod->live, pod->distinctKeys, pod->longestChain);
+    }
+
+    free(podNums);
+    free(pods);
+    return 0;
+}